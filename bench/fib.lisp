@@ -0,0 +1,7 @@
+; doubly recursive calls: call overhead and integer arithmetic
+(defun fib (n)
+    (if (lt n 2)
+        n
+        (+ (fib (- n 1)) (fib (- n 2)))))
+
+(println (fib 30))
@@ -0,0 +1,27 @@
+; list building with cons, map and a recursive filter: allocation and gc
+(defun range (n acc)
+    (if (eq n 0)
+        acc
+        (range (- n 1) (cons n acc))))
+
+(defun keep (proc items)
+    (cond
+        ((empty items) null)
+        ((proc (car items)) (cons (car items) (keep proc (cdr items))))
+        (true (keep proc (cdr items)))))
+
+(defun sum (items acc)
+    (if (empty items)
+        acc
+        (sum (cdr items) (+ acc (car items)))))
+
+(setq total 0)
+(setq i 0)
+(while (lt i 40)
+    (progn
+        (setq xs (range 20000 null))
+        (setq ys (map (lambda (x) (* x 3)) xs))
+        (setq zs (keep (lambda (x) (gt x 30000)) ys))
+        (setq total (+ total (sum zs 0)))
+        (setq i (+ i 1))))
+(println total)
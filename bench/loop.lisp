@@ -0,0 +1,6 @@
+; the 10M iteration while loop from example/6.lisp
+(setq i 0)
+
+(while (lt i 10000000) (setq i (+ i 1)))
+
+(println i)
@@ -0,0 +1,18 @@
+; code built from macros: if, not, and, or, inc, dec and a user macro
+(defmacro clamp (x lo hi)
+    (list 'cond (list (list 'lt x lo) lo) (list (list 'gt x hi) hi) (list true x)))
+
+(defun step (i acc)
+    (progn
+        (if (and (not (eq i 0)) (or (gt i 10) (lt i 5)))
+            (inc acc)
+            (dec acc))
+        (clamp acc 0 100000)))
+
+(setq i 0)
+(setq acc 0)
+(while (lt i 2000000)
+    (progn
+        (setq acc (step i acc))
+        (inc i)))
+(println acc)
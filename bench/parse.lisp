@@ -0,0 +1,12 @@
+; reading source: symbol heavy text parsed and interned over and over
+(setq source "(quote (alpha beta gamma delta epsilon zeta eta theta iota kappa lambda mu nu xi omicron pi rho sigma tau upsilon phi chi psi omega
+    (define-record point x y z) (with-open-file stream path direction) (multiple-value-bind quotient remainder floor)
+    (destructuring-bind first second third rest) (unwind-protect cleanup-form protected-form)
+    12345 67.89 \"a string literal\" [vector of symbols] (nested (lists (of (symbols))))))")
+
+(setq i 0)
+(while (lt i 50000)
+    (progn
+        (eval source)
+        (setq i (+ i 1))))
+(println (eval source))
@@ -0,0 +1,12 @@
+; printing large results: a million element list and nested structures
+(setq xs (vector->list (make-vector 1000000 1234567)))
+(println xs)
+(println (vector->list (make-vector 200000 2.5)))
+
+(setq nested null)
+(setq i 0)
+(while (lt i 100000)
+    (progn
+        (setq nested (cons (list i "s" 'sym [i i]) nested))
+        (setq i (+ i 1))))
+(println nested)
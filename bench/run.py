@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+"""Run the lisp workloads in bench/ and report timings as JSON.
+
+    python3 bench/run.py                          # ./toylisp, 5 runs each
+    python3 bench/run.py --runs 10 fib tak        # only some workloads
+    python3 bench/run.py --save base.json         # keep a baseline
+    python3 bench/run.py --compare base.json      # diff against it
+
+Each workload reports wall time (min and median of the runs), objects and
+bytes allocated from --gc-stats, and peak RSS. With --compare a table of
+median ratios goes to stderr and the exit status is 1 if any workload got
+slower than --threshold.
+"""
+
+import argparse
+import json
+import os
+import re
+import statistics
+import subprocess
+import sys
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(BENCH_DIR)
+ALLOCATED = re.compile(r"gc: allocated (\d+) objects / (\d+) bytes")
+
+
+def run_once(binary, path, extra_args):
+    # toylisp loads ./lib.lisp, so workloads run from the repository root
+    start = time.perf_counter()
+    proc = subprocess.Popen([binary, "--gc-stats"] + extra_args + [path], cwd=ROOT,
+                            stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    stderr = proc.stderr.read().decode(errors="replace")
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall = time.perf_counter() - start
+    proc.stderr.close()
+    if status != 0:
+        raise RuntimeError("%s failed with wait status %d\n%s" % (path, status, stderr))
+    match = ALLOCATED.search(stderr)
+    return {
+        "wall_ms": wall * 1000.0,
+        "alloc_objects": int(match.group(1)) if match else None,
+        "alloc_bytes": int(match.group(2)) if match else None,
+        "peak_rss_kb": usage.ru_maxrss,
+    }
+
+
+def run_workload(binary, name, runs, extra_args):
+    path = os.path.join(BENCH_DIR, name + ".lisp")
+    samples = [run_once(binary, path, extra_args) for _ in range(runs)]
+    walls = [s["wall_ms"] for s in samples]
+    return {
+        "runs": runs,
+        "wall_ms": [round(w, 3) for w in walls],
+        "min_ms": round(min(walls), 3),
+        "median_ms": round(statistics.median(walls), 3),
+        "alloc_objects": samples[-1]["alloc_objects"],
+        "alloc_bytes": samples[-1]["alloc_bytes"],
+        "peak_rss_kb": max(s["peak_rss_kb"] for s in samples),
+    }
+
+
+def compare(baseline, results, threshold):
+    regressed = []
+    sys.stderr.write("%-10s %12s %12s %8s\n" % ("workload", "base ms", "now ms", "ratio"))
+    for name, now in sorted(results.items()):
+        base = baseline.get("results", {}).get(name)
+        if not base:
+            sys.stderr.write("%-10s %12s %12.1f %8s\n" % (name, "-", now["median_ms"], "new"))
+            continue
+        ratio = now["median_ms"] / base["median_ms"] if base["median_ms"] else float("inf")
+        flag = ""
+        if ratio > threshold:
+            regressed.append(name)
+            flag = "  slower"
+        sys.stderr.write("%-10s %12.1f %12.1f %8.2f%s\n" % (name, base["median_ms"], now["median_ms"], ratio, flag))
+    return regressed
+
+
+def main():
+    parser = argparse.ArgumentParser(description="toylisp benchmark harness")
+    parser.add_argument("workloads", nargs="*", help="workload names (default: all of bench/*.lisp)")
+    parser.add_argument("--binary", default=os.path.join(ROOT, "toylisp"))
+    parser.add_argument("--runs", type=int, default=5)
+    parser.add_argument("--arg", action="append", default=[], help="extra interpreter option, e.g. --arg=--eval=tree")
+    parser.add_argument("--save", metavar="FILE", help="write the results to FILE as a baseline")
+    parser.add_argument("--compare", metavar="FILE", help="compare median times against a saved baseline")
+    parser.add_argument("--threshold", type=float, default=1.10, help="ratio above which --compare fails")
+    args = parser.parse_args()
+
+    names = args.workloads or sorted(f[:-5] for f in os.listdir(BENCH_DIR) if f.endswith(".lisp"))
+    binary = os.path.abspath(args.binary)
+    results = {}
+    for name in names:
+        results[name] = run_workload(binary, name, args.runs, args.arg)
+        sys.stderr.write("%-10s %10.1f ms\n" % (name, results[name]["median_ms"]))
+
+    report = {"binary": binary, "args": args.arg, "results": results}
+    json.dump(report, sys.stdout, indent=2, sort_keys=True)
+    sys.stdout.write("\n")
+    if args.save:
+        with open(args.save, "w") as f:
+            json.dump(report, f, indent=2, sort_keys=True)
+    if args.compare:
+        with open(args.compare) as f:
+            regressed = compare(json.load(f), results, args.threshold)
+        if regressed:
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,14 @@
+; takeuchi function: deep non-tail recursion with three arguments
+(defun tak (x y z)
+    (if (lt y x)
+        (tak (tak (- x 1) y z)
+             (tak (- y 1) z x)
+             (tak (- z 1) x y))
+        z))
+
+(setq i 0)
+(while (lt i 60)
+    (progn
+        (setq r (tak 18 12 6))
+        (setq i (+ i 1))))
+(println r)
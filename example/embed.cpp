@@ -0,0 +1,31 @@
+// runs one interpreter per thread. build from the repository root with
+//   g++ -std=c++11 -O2 -DTOYLISP_NO_MAIN main.cpp example/embed.cpp -pthread -o embed
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../toylisp.h"
+
+int main() {
+    std::vector<std::thread> threads;
+    std::vector<std::string> results(4);
+    for(int i = 0; i < 4; i++) {
+        threads.push_back(std::thread([i, &results]() {
+            Interpreter* interpreter = interpreterCreate();
+            if(!interpreter) return;
+            std::string source = "(defun fib (n) (if (lt n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+                                 "(setq x " + std::to_string(i) + ")"
+                                 "(fib (+ 20 x))";
+            interpreterEval(interpreter, source, &results[i]);
+            interpreterDestroy(interpreter);
+        }));
+    }
+    for(auto& thread : threads) {
+        thread.join();
+    }
+    for(int i = 0; i < 4; i++) {
+        ::printf("fib(%d) = %s\n", 20 + i, results[i].c_str());
+    }
+    return 0;
+}
@@ -3,22 +3,44 @@
 #include <fstream>
 #include <sstream>
 #include <map>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
 #include <functional>
+#include <chrono>
 
 #include <cinttypes>
 #include <cstring>
+#include <cerrno>
 #include <cfloat>
 #include <cassert>
 #include <cstdarg>
+#include <cstddef>
+#include <csetjmp>
+
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <csignal>
+#include <atomic>
+#include <pthread.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <exception>
+
+#include "toylisp.h"
 
 #define car(x) (x->v_cons.head)
 #define cdr(x) (x->v_cons.tail)
 #define cons(x, y) (makeCons(x, y))
 #define acons(x, y, z) (cons(makeCons(x, y), z))
 
-#define INTPOOL_MIN -5
-#define INTPOOL_MAX 256
-
 enum ObjType {
     T_NULL,
     T_INT,
@@ -31,27 +53,55 @@ enum ObjType {
     T_BUILTIN,
     T_FUNCTION,
     T_LAMBDA,
-    T_MACRO
+    T_MACRO,
+    T_VECTOR, /* growable array, items live in one malloc'd buffer */
+    T_HASHMAP, /* open addressing hash table keyed by numbers, strings and symbols */
+    T_CHANNEL, /* bounded queue that green threads block on */
+    T_VARREF, /* resolved variable reference inside a function body */
+    T_CODE, /* compiled bytecode of a function or top level form */
+    T_FREE /* unused heap cell, never visible to lisp code */
 };
 
 struct Obj;
+struct Channel;
+
+struct HashEntry {
+    uint64_t hash;
+    Obj* key; // nullptr marks a free slot
+    Obj* value;
+};
 
-typedef Obj*(*Builtin)(Obj*, Obj*);
+// builtins get their evaluated arguments as a vector, usually the top of the
+// vm stack; special forms get the unevaluated argument forms
+typedef Obj*(*Builtin)(Obj* env, int64_t argc, Obj** argv);
+typedef Obj*(*SpecialForm)(Obj* env, Obj* args);
 
 struct Obj {
     ObjType type;
+    bool marked; // gc mark bit
     union {
         int64_t v_int;
         double v_float;
-        char* v_str;
+        struct {
+            int64_t v_strlen; // bytes, not counting the terminating nul
+            char v_str[8]; // really v_strlen + 1 bytes, allocated with the cell
+        };
         bool v_bool;
-        char* v_symbol;
+        struct {
+            char* v_symbol;
+            Obj* v_global; // global value cell, nullptr while unbound
+            uint64_t v_symhash; // hashString of the name, from intern
+        };
         struct {
             Obj* fn_name;
             int64_t fn_param_count;
+            int64_t fn_slot_count; // frame size, one slot per parameter
+            Obj* fn_code; // compiled on first call by the vm
             union {
                 struct {
                     Builtin ptr;
+                    SpecialForm form; // set instead of ptr for special forms
+                    uint64_t calls; // counted when built with RUNTIME_STATS
                 } v_builtin;
                 struct {
                     Obj* params;
@@ -75,41 +125,495 @@ struct Obj {
         } v_cons;
         struct {
             Obj* up; // up env
-            Obj* vars; // cons(cons(name1 obj1) cons(cons(name2 obj2) cons(cons(name3 obj3) cons(cons(name4 obj4) null))))
+            Obj* names; // symbols naming the slots, parameters first
+            Obj* vars; // created at runtime: cons(cons(name1 obj1) cons(cons(name2 obj2) null))
+            int64_t size;
+            Obj* slots[1]; // really `size` slots, allocated with the frame
         } v_env;
+        struct {
+            Obj** items;
+            int64_t size;
+            int64_t capacity;
+        } v_vector;
+        struct {
+            HashEntry* entries; // capacity is a power of two
+            int64_t count;
+            int64_t capacity;
+        } v_hash;
+        struct {
+            Channel* state; // buffered values and waiting threads, owned by the cell
+            int64_t capacity;
+        } v_channel;
+        struct {
+            Obj* symbol;
+            int64_t depth; // frames to walk up, -1 for the global value cell
+            int64_t slot;
+        } v_ref;
+        struct {
+            intptr_t* ops;
+            Obj** consts;
+            int32_t nops;
+            int32_t nconsts;
+            int32_t maxStack;
+            bool needsEnv; // locals live in a heap env frame instead of the vm stack
+            uint32_t hotness; // calls and loop iterations counted towards the jit threshold
+            void** native; // jit: native address of each op, nullptr until compiled
+        } v_code;
     };
-    Obj(ObjType type)
-    : type(type) {
-    }
 };
 
-static Obj* nullObj;
-static Obj* trueObj;
-static Obj* falseObj;
-static Obj* globalEnv;
-static Obj* symbols;
-static Obj* modules;
+// integers that fit in 63 bits live in the pointer itself, tagged by the low
+// bit (heap cells are 8 byte aligned), so arithmetic on them never allocates.
+// wider integers are boxed in T_INT cells
+#define FIXNUM_MIN (INT64_MIN >> 1)
+#define FIXNUM_MAX (INT64_MAX >> 1)
+
+bool isFixnum(const Obj* x) {
+    return reinterpret_cast<uintptr_t>(x) & 1;
+}
+
+Obj* makeFixnum(int64_t x) {
+    return reinterpret_cast<Obj*>((static_cast<uintptr_t>(x) << 1) | 1);
+}
+
+int64_t fixnumValue(const Obj* x) {
+    return reinterpret_cast<intptr_t>(x) >> 1;
+}
+
+ObjType typeOf(const Obj* x) {
+    return isFixnum(x) ? T_INT : x->type;
+}
+
+int64_t intValue(const Obj* x) {
+    return isFixnum(x) ? fixnumValue(x) : x->v_int;
+}
+
+// null, true and false are shared by every interpreter in the process and
+// never written after startup: they are born marked, so no collection touches them
+Obj makeStaticCell(ObjType type, bool value) {
+    Obj cell;
+    ::memset(&cell, 0, sizeof(cell)); // a null cell is as big as a cons, so car/cdr of null read nullptr
+    cell.type = type;
+    cell.marked = true;
+    cell.v_bool = value;
+    return cell;
+}
+
+static Obj nullCell = makeStaticCell(T_NULL, false);
+static Obj trueCell = makeStaticCell(T_BOOL, true);
+static Obj falseCell = makeStaticCell(T_BOOL, false);
+static Obj* const nullObj = &nullCell;
+static Obj* const trueObj = &trueCell;
+static Obj* const falseObj = &falseCell;
+
+// symbol table: open addressing keyed by the fnv-1a hash of the name
+struct SymbolTable {
+    struct Entry {
+        uint64_t hash;
+        Obj* symbol;
+    };
+    std::vector<Entry> entries; // capacity is always a power of two
+    size_t count;
+};
+
+// bytecode vm state: a value stack and a call frame stack, both off the
+// native stack so lisp recursion depth is not bound by it
+struct VMFrame {
+    Obj* fn; // nullptr for top level code
+    Obj* code;
+    const intptr_t* pc; // resume point while a callee runs
+    Obj** bp; // first local slot
+    Obj** retSp; // stack top to restore on return
+    Obj* env;
+    bool entry; // return to the c++ caller when this frame returns
+};
+
+struct VM {
+    Obj** stack;
+    Obj** end;
+    Obj** sp;
+    Obj** high; // high-water mark scanned by the collector
+    VMFrame* frames;
+    VMFrame* framesEnd;
+    VMFrame* fp;
+};
+
+// macro call site => {macro, expansion} for the tree evaluator. emptied by
+// every collection, so its keys never outlive the forms they point to
+struct MacroExpansion {
+    Obj* macro;
+    Obj* expanded;
+};
+
+// inline caches for the tree evaluator's call sites, direct mapped by the
+// address of the call form. a site keeps the callees its head evaluated to
+// and how to call each, so a hit skips dispatching on the callee and checking
+// its arity. a head naming a global keeps one callee, used while the global
+// still holds it without looking the name up at all; other heads keep up to
+// CALL_CACHE_WAYS. creating a binding, and every collection, bumps the epoch
+// and so empties every site
+#define CALL_CACHE_BITS 10
+#define CALL_CACHE_WAYS 4
+
+enum CallKind : uint8_t {
+    CALL_MACRO,
+    CALL_TAIL_FORM, // progn, cond and if, evaluated in place
+    CALL_FORM,
+    CALL_BUILTIN,
+    CALL_FUNCTION, // functions and lambdas
+    CALL_UNCACHED, // not callable or given the wrong argument count
+};
+
+struct CallSite {
+    Obj* form; // the call
+    Obj* shape; // envShape the global head was looked up in
+    uint64_t epoch;
+    int64_t argc;
+    bool global; // callees[0] is the value of the global named by the head
+    int32_t ways;
+    Obj* callees[CALL_CACHE_WAYS];
+    CallKind kinds[CALL_CACHE_WAYS];
+};
+
+// calls that don't get a vm frame: builtins, the tree evaluator's functions
+// and collections. records live on the native stack and are linked from
+// callTop, frame is vm.fp when the record was pushed
+struct CallRecord {
+    Obj* name;
+    VMFrame* frame;
+    CallRecord* up;
+};
+
+// green threads: lisp functions started by spawn that take turns on the
+// interpreter's vm. when one blocks or yields, its part of the vm stacks is
+// copied out, and copied back on top of whatever the stacks hold when it
+// runs again, so a suspended thread costs only the slots and frames it uses
+struct GreenThread {
+    int64_t id;
+    Obj* fn;
+    Obj* args; // until the thread first runs
+    Obj* value; // result of the blocking call when it resumes, or the value a blocked send carries
+    Obj* channel; // the channel it waits on
+    std::vector<Obj*> slots; // saved value stack
+    std::vector<VMFrame> frames; // saved frames, the thread's entry frame first; empty until it first suspends
+    Obj** base; // where slots were saved from, to relocate the frames
+    GreenThread* next; // in the run queue or a channel's wait queue
+    size_t index; // in Scheduler::threads
+};
+
+struct ThreadQueue {
+    GreenThread* head;
+    GreenThread* tail;
+};
+
+// the values a channel buffers, in a ring, and the threads waiting on it
+struct Channel {
+    std::vector<Obj*> ring;
+    size_t head;
+    size_t count;
+    ThreadQueue senders;
+    ThreadQueue receivers;
+};
+
+struct Scheduler {
+    std::vector<GreenThread*> threads; // every thread that hasn't finished
+    ThreadQueue runnable;
+    GreenThread* current; // the thread running now, nullptr outside green threads
+    VMFrame* entryFrame; // current's first frame
+    CallRecord* callBase; // callTop when current was resumed
+    bool suspending; // a builtin parked current and vmRun returns to the scheduler
+    int64_t nextId;
+};
+
+// runtime counters behind (stats) and --stats. a build with RUNTIME_STATS=0
+// drops every increment, and builtin call counts stay zero
+#ifndef RUNTIME_STATS
+#define RUNTIME_STATS 1
+#endif
+
+struct RuntimeStats {
+    uint64_t allocations[T_FREE + 1]; // objects made, by type
+    uint64_t interns;
+    uint64_t varLookups; // by-name lookups through findVar
+    uint64_t varLookupFrames; // env frames those lookups walked
+    uint64_t macroExpansions;
+    uint64_t macroCacheHits;
+    uint64_t callCacheHits;
+    uint64_t callCacheMisses;
+    uint64_t envFrames;
+    uint64_t builtinCalls;
+};
+
+#define GC_CHUNK_SIZE (256 * 1024)
+#ifndef GC_MIN_THRESHOLD
+#define GC_MIN_THRESHOLD (8 * 1024 * 1024) // build with 0 to collect on every allocation
+#endif
+
+static const size_t sizeClasses[] = { 16, 24, 32, 48, 64, 96, 128, 192, 256 };
+static const int sizeClassCount = sizeof(sizeClasses) / sizeof(sizeClasses[0]);
+
+struct Chunk {
+    char* base;
+    char* end;
+    char* top; // cells from here to end were never handed out and hold garbage
+    size_t cellSize;
+    int sizeClass; // -1 for a large object living alone in its chunk
+};
+
+struct GCStats {
+    uint64_t collections;
+    uint64_t allocatedObjects;
+    uint64_t allocatedBytes;
+    uint64_t freedObjects;
+    uint64_t freedBytes;
+    uint64_t liveObjects;
+    uint64_t liveBytes;
+    uint64_t heapBytes;
+    uint64_t peakHeapBytes;
+    double gcMillis;
+};
+
+// jit state. native code for hot code objects lives in executable mappings
+// that are only given back with the interpreter
+#if defined(__x86_64__)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+#define JIT_DEFAULT_THRESHOLD 100
+#define JIT_CHUNK_SIZE (1024 * 1024)
+#define JIT_MAX_CODE (64 * 1024 * 1024)
+
+// how native code left the vm when it bailed out
+struct JitExit {
+    Obj** sp;
+    intptr_t reason; // a JitBailout, or -1 when the vm just runs what follows
+};
+
+struct Jit {
+    bool enabled = JIT_SUPPORTED;
+    bool log = false; // compiles and the first bailout at each op go to stderr
+    uint32_t threshold = JIT_DEFAULT_THRESHOLD; // calls or loop iterations before compiling
+    JitExit exit = JitExit();
+    std::exception_ptr error; // from a helper native code called, rethrown once native code has returned
+    std::vector<std::pair<char*, size_t>> chunks;
+    char* next = nullptr; // free space in the newest chunk
+    char* end = nullptr;
+    size_t codeBytes = 0;
+    const void* enter = nullptr; // trampoline from c++ into native code
+    std::set<std::pair<const intptr_t*, intptr_t>> loggedBailouts; // {pc, reason}
+};
+
+struct WorkerPool;
+
+// everything one interpreter owns: globals, symbols, vm stacks and heap.
+// interpreters share no mutable state, so separate threads can each run
+// their own at once. a thread runs the interpreter interp points to
+struct Interpreter {
+    Obj* globalEnv = nullptr;
+    Obj* modules = nullptr;
+    SymbolTable symbols = SymbolTable();
+
+    // well-known symbols, interned once at init()
+    Obj* symQuote = nullptr;
+    Obj* symNull = nullptr;
+    Obj* symTrue = nullptr;
+    Obj* symFalse = nullptr;
+    Obj* symLambda = nullptr;
+    Obj* symToplevel = nullptr; // names top level code in backtraces and profiles
+    Obj* symGC = nullptr;
+    Obj* typeSymbols[T_FREE + 1] = {};
+
+    VM vm = VM();
+    bool vmEnabled = true; // false runs the tree-walking reference evaluator
+    int optLevel = 0; // -O: 1 folds constants and prunes branches, 2 also inlines small functions
+    int64_t recursionLimit = 1000000; // nested lisp calls the vm allows
+    uintptr_t nativeStackLimit = 0; // bytes of native stack evaluation may use
+    bool embedded = false; // errors throw LispError to the embedding api instead of exiting
+    WorkerPool* pool = nullptr; // threads for pmap, pfor-each and preduce, started on first use
+    size_t workerCount = 0; // 0 means one per hardware thread
+    bool isWorker = false; // runs chunks for another interpreter's pool
+
+    // objects only referenced from c++ containers while those are being built
+    std::vector<std::vector<Obj*>*> extraRoots;
+    std::map<Obj*, MacroExpansion> macroCache;
+    std::vector<CallSite> callSites = std::vector<CallSite>(1 << CALL_CACHE_BITS);
+    uint64_t callEpoch = 1; // sites filled in another epoch are empty
+    CallRecord* volatile callTop = nullptr;
+    RuntimeStats runtimeStats = RuntimeStats();
+
+    std::vector<Chunk> heapChunks; // sorted by base address
+    Obj* freeLists[sizeClassCount] = {};
+    // the newest chunk of each size class is carved front to back on demand, so
+    // its pages are only touched once they are used
+    char* bumpNext[sizeClassCount] = {};
+    char* bumpEnd[sizeClassCount] = {};
+    uintptr_t heapLow = UINTPTR_MAX;
+    uintptr_t heapHigh = 0;
+    uintptr_t gcStackBottom = 0; // where the conservative stack scan stops, 0 while collection is off
+    size_t heapLimit = 0; // 0 means unlimited
+    size_t gcThreshold = GC_MIN_THRESHOLD;
+    size_t bytesSinceGC = 0;
+    size_t externalBytes = 0; // malloc'd vector and hashmap storage reached by the last mark
+    GCStats gcStats = GCStats();
+    std::vector<Obj*> markStack;
+    Scheduler scheduler = Scheduler();
+    Jit jit;
+};
+
+static thread_local Interpreter* interp = nullptr;
+
+#if RUNTIME_STATS
+#define STAT_ADD(field, n) (interp->runtimeStats.field += (n))
+#define STAT_BUILTIN_CALL(fn) (interp->runtimeStats.builtinCalls++, (fn)->v_builtin.calls++)
+#else
+#define STAT_ADD(field, n) ((void)0)
+#define STAT_BUILTIN_CALL(fn) ((void)0)
+#endif
+
+// links a record for the rest of the enclosing block, at construction or on
+// the first enter(). a tail call in the tree evaluator renames it in place
+struct CallScope {
+    CallRecord record;
+    bool linked;
 
-static std::map<int64_t, Obj*> integerCacheMap;
+    CallScope() : linked(false) {
+    }
+    explicit CallScope(Obj* name) : linked(false) {
+        enter(name);
+    }
+    ~CallScope() {
+        if(linked) interp->callTop = record.up;
+    }
+    void enter(Obj* name) {
+        record.name = name;
+        if(!linked) {
+            record.frame = interp->vm.fp;
+            record.up = interp->callTop;
+            std::atomic_signal_fence(std::memory_order_release); // the profiler may sample in between
+            interp->callTop = &record;
+            linked = true;
+        }
+    }
+};
 
-Obj* parse_list();
-Obj* parse_int_float();
-Obj* parse_string();
-Obj* parse_symbol();
-Obj* parse_quote();
+struct Parser;
+Obj* parse_list(Parser* p);
+Obj* parse_vector(Parser* p);
+Obj* parse_atom(Parser* p);
+Obj* parse_string(Parser* p);
+Obj* parse_quote(Parser* p);
 Obj* eval(Obj* env, Obj* x);
-Obj* eval_list(Obj* env, Obj* x);
 Obj* macroexpand(Obj* env, Obj* macro, Obj* args);
+Obj* builtin_quote(Obj* env, Obj* x);
+Obj* builtin_cond(Obj* env, Obj* x);
+Obj* builtin_defun(Obj* env, Obj* x);
+Obj* builtin_lambda(Obj* env, Obj* x);
+Obj* builtin_defmacro(Obj* env, Obj* x);
 int64_t list_length(Obj* x);
 bool is_list(Obj* x);
-std::string readTextFile(const std::string& filename);
+Obj* evalTop(Obj* env, Obj* x);
+Obj* optimizeCode(Obj* env, Obj* x);
+Obj* optimizeBody(Obj* body);
+Obj* vmApply(Obj* env, Obj* fn, Obj* args);
+Obj* vmCall(Obj* env, Obj* fn, int64_t argc, Obj** argv);
+Obj** vmPushList(Obj* env, Obj* list, int64_t argc);
+void vmCheckStack(Obj* env, int64_t slots);
+Obj* vmRun();
+void jitCount(Obj* code, Obj* name, const char* counted);
+Obj* builtin_pmap(Obj* env, int64_t argc, Obj** argv);
+Obj* builtin_pfor_each(Obj* env, int64_t argc, Obj** argv);
+Obj* builtin_preduce(Obj* env, int64_t argc, Obj** argv);
+Obj* builtin_spawn(Obj* env, int64_t argc, Obj** argv);
+Obj* builtin_yield(Obj* env, int64_t argc, Obj** argv);
+Obj* builtin_chan(Obj* env, int64_t argc, Obj** argv);
+Obj* builtin_send(Obj* env, int64_t argc, Obj** argv);
+Obj* builtin_recv(Obj* env, int64_t argc, Obj** argv);
+Obj* builtin_optimize(Obj* env, int64_t argc, Obj** argv);
+
+// the names on the lisp call stack, innermost first, at most max of them:
+// vm frames merged with the call records pushed above each of them
+size_t callStackNames(Obj** names, size_t max) {
+    size_t n = 0;
+    CallRecord* r = interp->callTop;
+    VMFrame* f = interp->vm.fp;
+    while(n < max && (r || (f && f > interp->vm.frames))) {
+        if(r && (!f || r->frame >= f)) {
+            if(r->name) names[n++] = r->name;
+            r = r->up;
+            continue;
+        }
+        // frames running top level code or a macro expansion belong to their
+        // caller; evalTop's call record names top level code for both evaluators
+        if(f->fn) {
+            names[n++] = f->fn->fn_name;
+        }
+        f--;
+    }
+    return n;
+}
+
+const char* callName(Obj* name) {
+    return name == interp->symLambda ? "lambda" : name->v_symbol;
+}
+
+// the lisp call stack as a python style traceback, empty at top level
+std::string stackTrace() {
+    std::vector<Obj*> names(1024);
+    size_t n;
+    while((n = callStackNames(names.data(), names.size())) == names.size()) {
+        names.resize(names.size() * 2);
+    }
+    if(n == 0 || (n == 1 && names[0] == interp->symToplevel)) return "";
+    // outermost first, runs of one name folded, long traces cut in the middle
+    std::vector<std::pair<Obj*, size_t> > lines;
+    for(size_t i = n; i > 0; i--) {
+        if(!lines.empty() && lines.back().first == names[i - 1]) {
+            lines.back().second++;
+        } else {
+            lines.push_back(std::make_pair(names[i - 1], 1));
+        }
+    }
+    std::string trace = "Traceback (most recent call last):\n";
+    char line[256];
+    const size_t shown = 20;
+    for(size_t i = 0; i < lines.size(); i++) {
+        if(lines.size() > 2 * shown && i == shown) {
+            ::snprintf(line, sizeof(line), "  ... %zu more\n", lines.size() - 2 * shown);
+            trace += line;
+            i = lines.size() - shown;
+        }
+        trace += "  ";
+        trace += callName(lines[i].first);
+        trace += "\n";
+        if(lines[i].second > 1) {
+            ::snprintf(line, sizeof(line), "  [previous line repeated %zu more times]\n", lines[i].second - 1);
+            trace += line;
+        }
+    }
+    return trace;
+}
 
-void printStackTrace(Obj* env) {
-    // TODO unimplements
+void printStackTrace() {
+    std::string trace = stackTrace();
+    if(trace.empty()) return;
+    ::fflush(stdout);
+    ::fputs(trace.c_str(), stderr);
 }
 
+// what an embedding caller gets instead of the process exiting on an error
+struct LispError {
+    std::string message;
+    std::string traceback;
+};
+
 void throw_error_v(Obj* env, const char* format, va_list ap) {
-    printStackTrace(env);
+    if(interp->embedded) {
+        char message[1024];
+        ::vsnprintf(message, sizeof(message), format, ap);
+        throw LispError { message, stackTrace() };
+    }
+    printStackTrace();
     vprintf(format, ap);
     ::exit(-1);
 }
@@ -135,288 +639,1101 @@ Obj* toBoolObj(bool b) {
 
 std::string typeToString(ObjType type);
 
-Obj* makeObj(ObjType type) {
-    return new Obj(type);
-}
+// heap: obj cells are carved out of size-class arenas and reclaimed by a
+// mark-and-sweep collector. roots are the interpreter globals plus a
+// conservative scan of the native stack, so c++ locals holding an Obj* stay
+// alive without any registration. each interpreter has a heap of its own
 
-Obj* makeCons(Obj* head, Obj* tail) {
-    Obj* obj = makeObj(T_CONS);
-    obj->v_cons.head = head;
-    obj->v_cons.tail = tail;
-    return obj;
+size_t objSize(ObjType type) {
+    switch(type) {
+        case T_NULL:
+        case T_INT:
+        case T_FLOAT:
+        case T_BOOL:
+            return offsetof(Obj, v_int) + sizeof(int64_t);
+        case T_STRING: return offsetof(Obj, v_str) + 1;
+        case T_SYMBOL: return offsetof(Obj, v_symhash) + sizeof(uint64_t);
+        case T_CONS: return offsetof(Obj, v_cons) + sizeof(Obj::v_cons);
+        case T_ENV: return offsetof(Obj, v_env.slots);
+        case T_VARREF: return offsetof(Obj, v_ref) + sizeof(Obj::v_ref);
+        case T_CODE: return offsetof(Obj, v_code) + sizeof(Obj::v_code);
+        case T_VECTOR: return offsetof(Obj, v_vector) + sizeof(Obj::v_vector);
+        case T_HASHMAP: return offsetof(Obj, v_hash) + sizeof(Obj::v_hash);
+        case T_CHANNEL: return offsetof(Obj, v_channel) + sizeof(Obj::v_channel);
+        default: return sizeof(Obj);
+    }
 }
 
-// integer cache pool
-
-
-Obj* makeInt(int64_t x) {
-    Obj* obj = nullptr;
-    if(x >= INTPOOL_MIN && x < INTPOOL_MAX) {
-        if(integerCacheMap.find(x) == integerCacheMap.end()) {
-            obj = makeObj(T_INT);
-            obj->v_int = x;
-            integerCacheMap[x] = obj;
-        }
-        return integerCacheMap[x];
+size_t objSizeOf(Obj* x) {
+    if(x->type == T_ENV) {
+        return objSize(T_ENV) + x->v_env.size * sizeof(Obj*);
     }
-    obj = makeObj(T_INT);
-    obj->v_int = x;
-    return obj;
+    if(x->type == T_STRING) {
+        return objSize(T_STRING) + x->v_strlen;
+    }
+    return objSize(x->type);
 }
 
-Obj* makeFloat(double x) {
-    auto obj = makeObj(T_FLOAT);
-    obj->v_float = x;
-    return obj;
+int sizeClassOf(size_t size) {
+    for(int i = 0; i < sizeClassCount; i++) {
+        if(size <= sizeClasses[i]) return i;
+    }
+    return -1;
 }
 
-Obj* makeSymbol(const char* name) {
-    Obj* obj = makeObj(T_SYMBOL);
-    obj->v_symbol = ::strdup(name);
-    symbols = cons(obj, symbols);
-    return obj;
+void addChunk(const Chunk& chunk) {
+    auto pos = std::upper_bound(interp->heapChunks.begin(), interp->heapChunks.end(), chunk,
+        [](const Chunk& a, const Chunk& b) { return a.base < b.base; });
+    interp->heapChunks.insert(pos, chunk);
+    interp->heapLow = std::min(interp->heapLow, reinterpret_cast<uintptr_t>(chunk.base));
+    interp->heapHigh = std::max(interp->heapHigh, reinterpret_cast<uintptr_t>(chunk.end));
+    interp->gcStats.heapBytes += chunk.end - chunk.base;
+    interp->gcStats.peakHeapBytes = std::max(interp->gcStats.peakHeapBytes, interp->gcStats.heapBytes);
 }
 
-Obj* makeString(const char* str) {
-    Obj* obj = makeObj(T_STRING);
-    obj->v_str = ::strdup(str);
-    return obj;
+void syncChunkTop(int sizeClass);
+
+char* allocChunk(size_t cellSize, int sizeClass) {
+    size_t size = sizeClass < 0 ? cellSize : GC_CHUNK_SIZE - GC_CHUNK_SIZE % cellSize;
+    char* base = static_cast<char*>(::malloc(size));
+    if(!base) {
+        ::fprintf(stderr, "MemoryError: out of memory\n");
+        ::exit(-1);
+    }
+    Chunk chunk = { base, base + size, base + size, cellSize, sizeClass };
+    if(sizeClass >= 0) {
+        syncChunkTop(sizeClass);
+        chunk.top = base;
+        interp->bumpNext[sizeClass] = base;
+        interp->bumpEnd[sizeClass] = chunk.end;
+    }
+    addChunk(chunk);
+    return base;
 }
 
-Obj* makeEnv(Obj* up, Obj* vars) {
-    Obj* obj = makeObj(T_ENV);
-    obj->v_env.up = up;
-    obj->v_env.vars = vars;
-    return obj;
+Chunk* chunkAt(uintptr_t addr) {
+    if(addr < interp->heapLow || addr >= interp->heapHigh) return nullptr;
+    auto it = std::upper_bound(interp->heapChunks.begin(), interp->heapChunks.end(), addr,
+        [](uintptr_t a, const Chunk& c) { return a < reinterpret_cast<uintptr_t>(c.base); });
+    if(it == interp->heapChunks.begin()) return nullptr;
+    --it;
+    return addr < reinterpret_cast<uintptr_t>(it->end) ? &*it : nullptr;
 }
 
-Obj* pushEnv(Obj* env, Obj* vars, Obj* values) {
-    throw_error_assert(list_length(vars) == list_length(values), env, "can't apply function: number of argument does not match");
-    Obj *map = nullObj;
-    for (Obj *p = vars, *q = values; p != nullObj; p = cdr(p), q = cdr(q)) {
-        Obj *sym = car(p);
-        Obj *val = car(q);
-        map = acons(sym, val, map);
-    }
-    return makeEnv(env, map);
+// record how far a size class has carved its newest chunk
+void syncChunkTop(int sizeClass) {
+    if(!interp->bumpEnd[sizeClass]) return;
+    chunkAt(reinterpret_cast<uintptr_t>(interp->bumpEnd[sizeClass]) - 1)->top = interp->bumpNext[sizeClass];
 }
 
-Obj* intern(const char* name) {
-    for(Obj* p = symbols; p != nullObj; p = cdr(p)) {
-        if(::strcmp(car(p)->v_symbol, name) == 0) {
-            return car(p);
-        }
-    }
-    return makeSymbol(name);
+// find the live cell containing addr, or nullptr if addr is not a heap pointer
+Obj* findCell(uintptr_t addr) {
+    Chunk* chunk = chunkAt(addr);
+    if(!chunk || addr >= reinterpret_cast<uintptr_t>(chunk->top)) return nullptr;
+    size_t offset = addr - reinterpret_cast<uintptr_t>(chunk->base);
+    Obj* cell = reinterpret_cast<Obj*>(chunk->base + offset - offset % chunk->cellSize);
+    return cell->type == T_FREE ? nullptr : cell;
 }
 
-void addVar(Obj* env, Obj* symbol, Obj* obj) {
-    env->v_env.vars = acons(symbol, obj, env->v_env.vars);
+void markObj(Obj* obj) {
+    if(obj == nullptr || isFixnum(obj) || obj->marked) return;
+    obj->marked = true;
+    interp->markStack.push_back(obj);
 }
 
-void visitObj(Obj* obj, const std::function<void(Obj*)>& cb, bool recursion) {
-    cb(obj);
-    if(obj->type == T_CONS) {
-        for(Obj* p = obj; p != nullObj; p = cdr(p)) {
-            if(recursion) {
-                visitObj(car(p), cb, recursion);
-            } else {
-                cb(car(p));
+void markChildren(Obj* obj) {
+    switch(obj->type) {
+        case T_CONS:
+            markObj(obj->v_cons.head);
+            markObj(obj->v_cons.tail);
+            break;
+        case T_ENV:
+            markObj(obj->v_env.up);
+            markObj(obj->v_env.names);
+            markObj(obj->v_env.vars);
+            for(int64_t i = 0; i < obj->v_env.size; i++) {
+                markObj(obj->v_env.slots[i]);
+            }
+            break;
+        case T_SYMBOL:
+            markObj(obj->v_global);
+            break;
+        case T_VARREF:
+            markObj(obj->v_ref.symbol);
+            break;
+        case T_BUILTIN:
+            markObj(obj->fn_name);
+            break;
+        case T_FUNCTION:
+        case T_MACRO:
+            markObj(obj->fn_name);
+            markObj(obj->fn_code);
+            markObj(obj->v_function.params);
+            markObj(obj->v_function.body);
+            break;
+        case T_LAMBDA:
+            markObj(obj->fn_name);
+            markObj(obj->fn_code);
+            markObj(obj->v_lambda.params);
+            markObj(obj->v_lambda.body);
+            markObj(obj->v_lambda.env);
+            break;
+        case T_CODE:
+            for(int32_t i = 0; i < obj->v_code.nconsts; i++) {
+                markObj(obj->v_code.consts[i]);
+            }
+            break;
+        case T_VECTOR:
+            interp->externalBytes += obj->v_vector.capacity * sizeof(Obj*);
+            for(int64_t i = 0; i < obj->v_vector.size; i++) {
+                markObj(obj->v_vector.items[i]);
+            }
+            break;
+        case T_HASHMAP:
+            interp->externalBytes += obj->v_hash.capacity * sizeof(HashEntry);
+            for(int64_t i = 0; i < obj->v_hash.capacity; i++) {
+                markObj(obj->v_hash.entries[i].key);
+                markObj(obj->v_hash.entries[i].value);
+            }
+            break;
+        case T_CHANNEL: {
+            Channel* c = obj->v_channel.state;
+            interp->externalBytes += c->ring.size() * sizeof(Obj*);
+            for(size_t i = 0; i < c->count; i++) {
+                markObj(c->ring[(c->head + i) % c->ring.size()]);
             }
+            break;
         }
+        default: break;
     }
 }
 
-Obj* findVar(Obj* env, Obj* symbol) {
-    Obj* vars = env->v_env.vars;
-    if(vars != nullObj) {
-        for(Obj* var = car(vars); vars != nullObj; vars = cdr(vars), var = car(vars)) {
-            if(car(var) == symbol || ::strcmp(car(var)->v_symbol, symbol->v_symbol) == 0) {
-                return var;
-            }
+void markRange(const void* from, const void* to) {
+    const uintptr_t* p = static_cast<const uintptr_t*>(from);
+    const uintptr_t* end = static_cast<const uintptr_t*>(to);
+    for(; p < end; p++) {
+        markObj(findCell(*p));
+    }
+}
+
+void markRoots() {
+    markObj(nullObj);
+    markObj(trueObj);
+    markObj(falseObj);
+    markObj(interp->globalEnv);
+    markObj(interp->modules);
+    for(auto& entry : interp->symbols.entries) {
+        markObj(entry.symbol);
+    }
+    for(auto roots : interp->extraRoots) {
+        for(Obj* obj : *roots) {
+            markObj(obj);
         }
     }
-    if(env->v_env.up != nullObj) {
-        return findVar(env->v_env.up, symbol);
+    if(interp->vm.stack) {
+        // slots above sp may be stale, so the value stack is scanned conservatively
+        markRange(interp->vm.stack, interp->vm.high);
+        for(VMFrame* frame = interp->vm.frames; frame <= interp->vm.fp; frame++) {
+            markObj(frame->fn);
+            markObj(frame->code);
+            markObj(frame->env);
+        }
+    }
+    for(GreenThread* t : interp->scheduler.threads) {
+        markObj(t->fn);
+        markObj(t->args);
+        markObj(t->value);
+        markObj(t->channel);
+        markRange(t->slots.data(), t->slots.data() + t->slots.size());
+        for(VMFrame& frame : t->frames) {
+            markObj(frame.fn);
+            markObj(frame.code);
+            markObj(frame.env);
+        }
     }
-    return nullptr;
 }
 
-static std::string source;
-static size_t sourcePosition = 0;
-static size_t sourceLength = 0;
-
-int peekChar() {
-    if(sourcePosition < sourceLength) {
-        return source[sourcePosition];
-    }
-    return EOF;
+__attribute__((noinline)) void markNativeStack() {
+    // spill callee-saved registers so pointers held only in registers are seen
+    jmp_buf regs;
+    setjmp(regs);
+    __builtin_unwind_init();
+    uintptr_t top = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    top &= ~(sizeof(uintptr_t) - 1);
+    markRange(&regs, reinterpret_cast<const char*>(&regs) + sizeof(regs));
+    markRange(reinterpret_cast<const void*>(top), reinterpret_cast<const void*>(interp->gcStackBottom));
 }
 
-int nextChar() {
-    if(sourcePosition < sourceLength) {
-        return source[sourcePosition++];
+void finalizeObj(Obj* obj) {
+    if(obj->type == T_SYMBOL) {
+        ::free(obj->v_symbol);
+    } else if(obj->type == T_CODE) {
+        ::free(obj->v_code.ops);
+        ::free(obj->v_code.consts);
+        ::free(obj->v_code.native);
+    } else if(obj->type == T_VECTOR) {
+        ::free(obj->v_vector.items);
+    } else if(obj->type == T_HASHMAP) {
+        ::free(obj->v_hash.entries);
+    } else if(obj->type == T_CHANNEL) {
+        delete obj->v_channel.state;
     }
-    return EOF;
 }
 
-int skipChar(int ch) {
-    int c = nextChar();
-    assert(c == ch);
-    return c;
+// releases every chunk of the current interpreter's heap
+void freeHeap() {
+    for(int i = 0; i < sizeClassCount; i++) {
+        syncChunkTop(i);
+    }
+    for(auto& chunk : interp->heapChunks) {
+        for(char* p = chunk.base; p < chunk.top; p += chunk.cellSize) {
+            Obj* obj = reinterpret_cast<Obj*>(p);
+            if(obj->type != T_FREE) finalizeObj(obj);
+        }
+        ::free(chunk.base);
+    }
+    interp->heapChunks.clear();
 }
 
-
-Obj* parse() {
-    for(;;) {
-        int c = peekChar();
-        if(::isspace(c)) {
-            nextChar();
-            continue;
-        }
-        if(c == EOF) {
-            return nullptr;
-        }
-        if(c == ';') {
-            while(peekChar() != '\n') {
-                nextChar();
+void sweep() {
+    for(int i = 0; i < sizeClassCount; i++) {
+        interp->freeLists[i] = nullptr;
+    }
+    interp->gcStats.liveObjects = 0;
+    interp->gcStats.liveBytes = 0;
+    size_t reserved = 0;
+    std::vector<Chunk> kept;
+    kept.reserve(interp->heapChunks.size());
+    for(auto& chunk : interp->heapChunks) {
+        Obj* chunkFree = nullptr;
+        Obj* chunkFreeTail = nullptr;
+        size_t live = 0;
+        for(char* p = chunk.base; p < chunk.top; p += chunk.cellSize) {
+            Obj* cell = reinterpret_cast<Obj*>(p);
+            if(cell->type != T_FREE) {
+                if(cell->marked) {
+                    cell->marked = false;
+                    live++;
+                    continue;
+                }
+                finalizeObj(cell);
+                cell->type = T_FREE;
+                interp->gcStats.freedObjects++;
+                interp->gcStats.freedBytes += chunk.cellSize;
             }
-            skipChar('\n');
-            continue;
-        }
-        if(c == '(') {
-            return parse_list();
+            cell->v_cons.head = chunkFree;
+            chunkFree = cell;
+            if(!chunkFreeTail) chunkFreeTail = cell;
         }
-        if(::isdigit(c)) {
-            return parse_int_float();
-        }
-        if(c == '\"') {
-            return parse_string();
-        }
-        if(c == '\'') {
-            return parse_quote();
+        bool carving = chunk.sizeClass >= 0 && interp->bumpEnd[chunk.sizeClass] == chunk.end;
+        if(live == 0 && !carving && (chunk.sizeClass < 0 || reserved >= GC_MIN_THRESHOLD)) {
+            // give empty chunks back to the system once a reserve is kept
+            interp->gcStats.heapBytes -= chunk.end - chunk.base;
+            ::free(chunk.base);
+            continue;
         }
-        if(::isalpha(c) || ::strchr("+-*/=!@#$%^&", c)) {
-            return parse_symbol();
+        if(live == 0) reserved += chunk.end - chunk.base;
+        interp->gcStats.liveObjects += live;
+        interp->gcStats.liveBytes += live * chunk.cellSize;
+        if(chunk.sizeClass >= 0 && chunkFree) {
+            chunkFreeTail->v_cons.head = interp->freeLists[chunk.sizeClass];
+            interp->freeLists[chunk.sizeClass] = chunkFree;
         }
-        throw_error(globalEnv, "ParserError: unprocessed character: %c", c);
+        kept.push_back(chunk);
     }
-    return nullObj;
+    interp->heapChunks.swap(kept);
+    interp->heapLow = interp->heapChunks.empty() ? UINTPTR_MAX : reinterpret_cast<uintptr_t>(interp->heapChunks.front().base);
+    interp->heapHigh = interp->heapChunks.empty() ? 0 : reinterpret_cast<uintptr_t>(interp->heapChunks.back().end);
 }
 
-Obj* parse_all() {
-    Obj *head, *tail;
-    head = tail = cons(parse(), nullObj);
-    while(peekChar() != EOF) {
-        tail->v_cons.tail = cons(parse(), nullObj);
-        tail = tail->v_cons.tail;
+void gcCollect() {
+    CallScope scope(interp->symGC);
+    for(int i = 0; i < sizeClassCount; i++) {
+        syncChunkTop(i);
     }
-    return head;
+    auto start = std::chrono::steady_clock::now();
+    interp->externalBytes = 0;
+    interp->macroCache.clear();
+    interp->callEpoch++;
+    markRoots();
+    markNativeStack();
+    while(!interp->markStack.empty()) {
+        Obj* obj = interp->markStack.back();
+        interp->markStack.pop_back();
+        markChildren(obj);
+    }
+    sweep();
+    interp->bytesSinceGC = 0;
+    // storage outside the heap still costs marking time, so it paces collections too
+    interp->gcThreshold = std::max(static_cast<size_t>(GC_MIN_THRESHOLD), static_cast<size_t>(interp->gcStats.liveBytes) + interp->externalBytes);
+    interp->gcStats.collections++;
+    interp->gcStats.gcMillis += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 }
 
-Obj* parse_int_float() {
-    bool isFloat = false;
-    char s[64];
-    char* p = s;
-    if(peekChar() == '-') {
-        *p++ = nextChar();
-    }
-    while(::isdigit(peekChar())) {
-        *p++ = nextChar();
+Obj* makeObjSized(ObjType type, size_t size) {
+    STAT_ADD(allocations[type], 1);
+    int sizeClass = sizeClassOf(size);
+    size_t cellSize = sizeClass < 0 ? size : sizeClasses[sizeClass];
+    if(interp->gcStackBottom && interp->bytesSinceGC >= interp->gcThreshold) {
+        gcCollect();
     }
-    if(peekChar() == '.') {
-        isFloat = true;
-        *p++ = nextChar();
-        while(::isdigit(peekChar())) {
-            *p++ = nextChar();
+    Obj* obj;
+    if(sizeClass < 0 || (!interp->freeLists[sizeClass] && interp->bumpNext[sizeClass] == interp->bumpEnd[sizeClass])) {
+        size_t growth = sizeClass < 0 ? cellSize : GC_CHUNK_SIZE;
+        if(interp->heapLimit && interp->gcStats.heapBytes + growth > interp->heapLimit) {
+            if(interp->gcStackBottom) gcCollect();
+            bool satisfied = sizeClass >= 0 && interp->freeLists[sizeClass];
+            if(!satisfied && interp->gcStats.heapBytes + growth > interp->heapLimit) {
+                throw_error(interp->globalEnv, "MemoryError: heap limit of %zu bytes exceeded", interp->heapLimit);
+            }
         }
     }
-    *p = '\0';
-    Obj* obj;
-    if(isFloat) {
-        obj = makeFloat(::atof(s));
+    if(sizeClass < 0) {
+        obj = reinterpret_cast<Obj*>(allocChunk(cellSize, sizeClass));
+    } else if(interp->freeLists[sizeClass]) {
+        obj = interp->freeLists[sizeClass];
+        interp->freeLists[sizeClass] = obj->v_cons.head;
     } else {
-        obj = makeInt(::atof(s));
+        if(interp->bumpNext[sizeClass] == interp->bumpEnd[sizeClass]) {
+            allocChunk(cellSize, sizeClass);
+        }
+        obj = reinterpret_cast<Obj*>(interp->bumpNext[sizeClass]);
+        interp->bumpNext[sizeClass] += cellSize;
     }
+    ::memset(obj, 0, cellSize);
+    obj->type = type;
+    interp->bytesSinceGC += cellSize;
+    interp->gcStats.allocatedObjects++;
+    interp->gcStats.allocatedBytes += cellSize;
     return obj;
 }
 
-Obj* parse_string() {
-    skipChar('\"');
-    char str[1024] = { 0 };
-    char *p = str;
-    while(peekChar() != '\"') {
-        *p++ = nextChar();
-    }
-    skipChar('\"');
-    return makeString(str);
+Obj* makeObj(ObjType type) {
+    return makeObjSized(type, objSize(type));
+}
+
+Obj* makeCons(Obj* head, Obj* tail) {
+    Obj* obj = makeObj(T_CONS);
+    obj->v_cons.head = head;
+    obj->v_cons.tail = tail;
+    return obj;
 }
 
-Obj* parse_symbol() {
-    char sym[128] = { 0 };
-    int p = 0;
-    while(::isalpha(peekChar()) || ::strchr("+-*/=!@#$%^&", peekChar())) {
-        sym[p++] = nextChar();
+// ints in fixnum range are tagged pointers, (x << 1) | 1; larger ones are boxed
+Obj* makeInt(int64_t x) {
+    if(x >= FIXNUM_MIN && x <= FIXNUM_MAX) {
+        return makeFixnum(x);
     }
-    sym[p] = '\0';
-    return intern(sym);
+    Obj* obj = makeObj(T_INT);
+    obj->v_int = x;
+    return obj;
 }
 
-Obj* parse_list() {
-    skipChar('(');
-    if(peekChar() == ')') {
-        nextChar();
-        return nullObj;
+Obj* makeFloat(double x) {
+    auto obj = makeObj(T_FLOAT);
+    obj->v_float = x;
+    return obj;
+}
+
+Obj* makeSymbol(const char* name, size_t len, uint64_t hash) {
+    Obj* obj = makeObj(T_SYMBOL);
+    obj->v_symbol = ::strndup(name, len);
+    obj->v_symhash = hash;
+    return obj;
+}
+
+// copies len bytes of str, or leaves them for the caller to fill when str is nullptr
+Obj* makeString(const char* str, size_t len) {
+    Obj* obj = makeObjSized(T_STRING, objSize(T_STRING) + len);
+    obj->v_strlen = len;
+    if(str) ::memcpy(obj->v_str, str, len);
+    obj->v_str[len] = '\0';
+    return obj;
+}
+
+Obj* makeString(const char* str) {
+    return makeString(str, ::strlen(str));
+}
+
+// orders strings bytewise, a prefix first
+int compareStrings(Obj* a, Obj* b) {
+    int c = ::memcmp(a->v_str, b->v_str, std::min(a->v_strlen, b->v_strlen));
+    if(c != 0) return c;
+    return a->v_strlen < b->v_strlen ? -1 : a->v_strlen > b->v_strlen;
+}
+
+void vectorReserve(Obj* vector, int64_t capacity) {
+    if(capacity <= vector->v_vector.capacity) return;
+    Obj** items = static_cast<Obj**>(::realloc(vector->v_vector.items, capacity * sizeof(Obj*)));
+    if(!items) {
+        ::fprintf(stderr, "MemoryError: out of memory\n");
+        ::exit(-1);
     }
+    vector->v_vector.items = items;
+    vector->v_vector.capacity = capacity;
+}
 
-    Obj *head, *tail;
-    head = tail = cons(parse(), nullObj);
+// a vector of size copies of fill
+Obj* makeVector(int64_t size, Obj* fill) {
+    Obj* obj = makeObj(T_VECTOR);
+    vectorReserve(obj, std::max<int64_t>(size, 4));
+    std::fill(obj->v_vector.items, obj->v_vector.items + size, fill);
+    obj->v_vector.size = size;
+    return obj;
+}
 
-    while(peekChar() != ')') {
-        if(::isspace(peekChar())) {
-            nextChar();
-            continue;
-        }
-        tail->v_cons.tail = cons(parse(), nullObj);
-        tail = tail->v_cons.tail;
+void vectorPush(Obj* vector, Obj* item) {
+    if(vector->v_vector.size == vector->v_vector.capacity) {
+        vectorReserve(vector, vector->v_vector.capacity * 2);
     }
+    vector->v_vector.items[vector->v_vector.size++] = item;
+}
 
-    skipChar(')');
+Channel* newChannel(int64_t capacity) {
+    Channel* c = new Channel();
+    c->ring.assign(capacity, nullptr);
+    return c;
+}
 
-    return head;
+// a channel buffering up to capacity values
+Obj* makeChannel(int64_t capacity) {
+    Obj* obj = makeObj(T_CHANNEL);
+    obj->v_channel.state = newChannel(capacity);
+    obj->v_channel.capacity = capacity;
+    return obj;
 }
 
+// env frames are contiguous: one slot per parameter or local, unbound slots are nullptr
+Obj* makeEnv(Obj* up, Obj* names, int64_t size) {
+    STAT_ADD(envFrames, 1);
+    Obj* obj = makeObjSized(T_ENV, objSize(T_ENV) + size * sizeof(Obj*));
+    obj->v_env.up = up;
+    obj->v_env.names = names;
+    obj->v_env.vars = nullObj;
+    obj->v_env.size = size;
+    return obj;
+}
 
-void run_before(const std::string& text) {
-    source.assign(text);
-    sourcePosition = 0;
-    sourceLength = source.length();
+// bind the argc evaluated arguments of fn at argv to the parameter slots of a
+// new frame. the caller has checked them against fn's arity
+Obj* pushEnv(Obj* up, Obj* fn, int64_t argc, Obj** argv) {
+    Obj* names = fn->type == T_LAMBDA ? fn->v_lambda.params : fn->v_function.params;
+    Obj* frame = makeEnv(up, names, fn->fn_slot_count);
+    ::memcpy(frame->v_env.slots, argv, argc * sizeof(Obj*));
+    return frame;
 }
 
-Obj* run(Obj* env) {
-    Obj* retObj = nullObj;
-    for(Obj* p = parse_all(); p != nullObj; p = cdr(p)) {
-        retObj = eval(env, car(p));
+Obj* makeVarRef(Obj* symbol, int64_t depth, int64_t slot) {
+    Obj* obj = makeObj(T_VARREF);
+    obj->v_ref.symbol = symbol;
+    obj->v_ref.depth = depth;
+    obj->v_ref.slot = slot;
+    return obj;
+}
+
+// fnv-1a; pass the previous result as hash to continue over more bytes
+uint64_t hashString(const char* str, size_t len, uint64_t hash = 14695981039346656037ULL) {
+    for(size_t i = 0; i < len; i++) {
+        hash ^= static_cast<unsigned char>(str[i]);
+        hash *= 1099511628211ULL;
     }
-    return retObj;
+    return hash;
 }
 
-bool moduleExists(const char* moduleName) {
-    assert(moduleName);
-    for(Obj* p = modules; p != nullObj; p = cdr(p)) {
-        if(!strcmp(car(p)->v_str, moduleName)) {
-            return true;
-        }
+void growSymbolTable() {
+    std::vector<SymbolTable::Entry> old;
+    old.swap(interp->symbols.entries);
+    interp->symbols.entries.assign(old.empty() ? 256 : old.size() * 2, SymbolTable::Entry { 0, nullptr });
+    size_t mask = interp->symbols.entries.size() - 1;
+    for(auto& entry : old) {
+        if(!entry.symbol) continue;
+        size_t i = entry.hash & mask;
+        while(interp->symbols.entries[i].symbol) i = (i + 1) & mask;
+        interp->symbols.entries[i] = entry;
     }
-    return false;
+}
+
+Obj* intern(const char* name, size_t len) {
+    STAT_ADD(interns, 1);
+    if((interp->symbols.count + 1) * 10 > interp->symbols.entries.size() * 7) {
+        growSymbolTable();
+    }
+    uint64_t hash = hashString(name, len);
+    size_t mask = interp->symbols.entries.size() - 1;
+    size_t i = hash & mask;
+    for(; interp->symbols.entries[i].symbol; i = (i + 1) & mask) {
+        SymbolTable::Entry& entry = interp->symbols.entries[i];
+        if(entry.hash == hash && ::strncmp(entry.symbol->v_symbol, name, len) == 0 && entry.symbol->v_symbol[len] == '\0') {
+            return entry.symbol;
+        }
+    }
+    Obj* symbol = makeSymbol(name, len, hash);
+    // the collector never frees symbols, so the slot found above is still free
+    interp->symbols.entries[i] = SymbolTable::Entry { hash, symbol };
+    interp->symbols.count++;
+    return symbol;
+}
+
+Obj* intern(const char* name) {
+    return intern(name, ::strlen(name));
+}
+
+void addVar(Obj* env, Obj* symbol, Obj* obj) {
+    // the new binding may shadow, or stand for, a callee some site remembers
+    interp->callEpoch++;
+    if(env == interp->globalEnv) {
+        symbol->v_global = obj;
+    } else {
+        env->v_env.vars = acons(symbol, obj, env->v_env.vars);
+    }
+}
+
+void visitObj(Obj* obj, const std::function<void(Obj*)>& cb, bool recursion) {
+    cb(obj);
+    if(typeOf(obj) == T_CONS) {
+        for(Obj* p = obj; p != nullObj; p = cdr(p)) {
+            if(recursion) {
+                visitObj(car(p), cb, recursion);
+            } else {
+                cb(car(p));
+            }
+        }
+    }
+}
+
+// find the cell holding symbol's value by name, for code that was not resolved
+// ahead of time (top level forms, macro expansions, eval)
+Obj** findVar(Obj* env, Obj* symbol) {
+    STAT_ADD(varLookups, 1);
+    for(Obj* e = env; e != nullObj; e = e->v_env.up) {
+        STAT_ADD(varLookupFrames, 1);
+        int64_t i = 0;
+        for(Obj* p = e->v_env.names; p != nullObj; p = cdr(p), i++) {
+            if(car(p) == symbol) return &e->v_env.slots[i];
+        }
+        for(Obj* p = e->v_env.vars; p != nullObj; p = cdr(p)) {
+            if(car(car(p)) == symbol) return &cdr(car(p));
+        }
+    }
+    return symbol->v_global ? &symbol->v_global : nullptr;
+}
+
+Obj** findVarRef(Obj* env, Obj* ref) {
+    if(ref->v_ref.depth < 0) {
+        return &ref->v_ref.symbol->v_global;
+    }
+    for(int64_t i = 0; i < ref->v_ref.depth; i++) {
+        env = env->v_env.up;
+    }
+    return &env->v_env.slots[ref->v_ref.slot];
+}
+
+#define PARSER_BUFFER_SIZE (64 * 1024)
+
+// reads source a buffer at a time from a file or a string, so top level forms
+// can be evaluated as they are parsed. each load or eval gets its own parser
+struct Parser {
+    std::string name; // file name, or "<string>"
+    FILE* file;
+    std::vector<char> buffer;
+    const char* pos;
+    const char* end;
+    int64_t line;
+    int64_t column;
+    std::string token; // text of the literal being read, reused across tokens
+
+    Parser(const std::string& name, FILE* file)
+    : name(name), file(file), buffer(PARSER_BUFFER_SIZE), pos(nullptr), end(nullptr), line(1), column(1) {
+    }
+    explicit Parser(const std::string& text)
+    : name("<string>"), file(nullptr), buffer(text.begin(), text.end()),
+      pos(buffer.data()), end(buffer.data() + buffer.size()), line(1), column(1) {
+    }
+    ~Parser() {
+        if(file) ::fclose(file);
+    }
+    Parser(const Parser&) = delete;
+    Parser& operator=(const Parser&) = delete;
+};
+
+void parseError(Parser* p, const char* format, ...) {
+    char message[256];
+    va_list ap;
+    va_start(ap, format);
+    ::vsnprintf(message, sizeof(message), format, ap);
+    va_end(ap);
+    throw_error(interp->globalEnv, "ParserError: %s:%" PRId64 ":%" PRId64 ": %s", p->name.c_str(), p->line, p->column, message);
+}
+
+int peekChar(Parser* p) {
+    if(p->pos == p->end) {
+        if(!p->file) return EOF;
+        size_t n = ::fread(p->buffer.data(), 1, p->buffer.size(), p->file);
+        if(n == 0) return EOF;
+        p->pos = p->buffer.data();
+        p->end = p->pos + n;
+    }
+    return static_cast<unsigned char>(*p->pos);
+}
+
+int nextChar(Parser* p) {
+    int c = peekChar(p);
+    if(c == EOF) return EOF;
+    p->pos++;
+    if(c == '\n') {
+        p->line++;
+        p->column = 1;
+    } else {
+        p->column++;
+    }
+    return c;
+}
+
+int skipChar(Parser* p, int ch) {
+    int c = nextChar(p);
+    assert(c == ch);
+    return c;
+}
+
+// skip whitespace and ; comments, returning the next character
+int skipSpace(Parser* p) {
+    for(;;) {
+        int c = peekChar(p);
+        if(::isspace(c)) {
+            nextChar(p);
+        } else if(c == ';') {
+            while(c != '\n' && c != EOF) {
+                c = nextChar(p);
+            }
+        } else {
+            return c;
+        }
+    }
+}
+
+bool isSymbolChar(int c) {
+    return ::isalpha(c) || (c != EOF && c != '\0' && ::strchr("+-*/=!@#$%^&<>", c));
+}
+
+// symbols and numbers are read as one token of these, then told apart
+bool isAtomChar(int c) {
+    return isSymbolChar(c) || ::isdigit(c) || c == '.';
+}
+
+// the next form, nullptr at the end of input
+Obj* parse(Parser* p) {
+    int c = skipSpace(p);
+    if(c == EOF) {
+        return nullptr;
+    }
+    if(c == '(') {
+        return parse_list(p);
+    }
+    if(c == '[') {
+        return parse_vector(p);
+    }
+    if(c == '\"') {
+        return parse_string(p);
+    }
+    if(c == '\'') {
+        return parse_quote(p);
+    }
+    if(isAtomChar(c)) {
+        return parse_atom(p);
+    }
+    parseError(p, "unprocessed character: %c", c);
+    return nullptr;
+}
+
+// [+-]digits[.digits][e[+-]digits], false for anything else
+bool isNumber(const std::string& token, bool* isFloat) {
+    const char* q = token.c_str();
+    bool digits = false;
+    *isFloat = false;
+    if(*q == '-' || *q == '+') q++;
+    for(; ::isdigit(*q); q++) digits = true;
+    if(*q == '.') {
+        *isFloat = true;
+        for(q++; ::isdigit(*q); q++) digits = true;
+    }
+    if(!digits) return false;
+    if(*q == 'e' || *q == 'E') {
+        *isFloat = true;
+        q++;
+        if(*q == '-' || *q == '+') q++;
+        if(!::isdigit(*q)) return false;
+        while(::isdigit(*q)) q++;
+    }
+    return *q == '\0';
+}
+
+// a number, or a symbol when the token doesn't read as one. integers too
+// wide for int64 become floats, like arithmetic that overflows
+Obj* parse_atom(Parser* p) {
+    p->token.clear();
+    while(isAtomChar(peekChar(p))) {
+        p->token += static_cast<char>(nextChar(p));
+    }
+    bool isFloat;
+    if(isNumber(p->token, &isFloat)) {
+        if(!isFloat) {
+            errno = 0;
+            int64_t value = ::strtoll(p->token.c_str(), nullptr, 10);
+            if(errno != ERANGE) {
+                return makeInt(value);
+            }
+        }
+        return makeFloat(::strtod(p->token.c_str(), nullptr));
+    }
+    if(::isdigit(static_cast<unsigned char>(p->token[0]))) {
+        parseError(p, "invalid number literal: %s", p->token.c_str());
+    }
+    return intern(p->token.data(), p->token.size());
+}
+
+int hexDigit(int c) {
+    if(::isdigit(c)) return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// "..." with \n \t \r \0 \\ \" and \xHH escapes
+Obj* parse_string(Parser* p) {
+    skipChar(p, '\"');
+    p->token.clear();
+    for(;;) {
+        int c = nextChar(p);
+        if(c == EOF) {
+            parseError(p, "unterminated string literal");
+        }
+        if(c == '\"') {
+            break;
+        }
+        if(c == '\\') {
+            c = nextChar(p);
+            switch(c) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case '0': c = '\0'; break;
+                case '\\': case '\"': break;
+                case 'x': {
+                    int hi = hexDigit(nextChar(p));
+                    int lo = hexDigit(nextChar(p));
+                    if(hi < 0 || lo < 0) {
+                        parseError(p, "invalid \\x escape");
+                    }
+                    c = hi * 16 + lo;
+                    break;
+                }
+                case EOF: parseError(p, "unterminated string literal"); break;
+                default: parseError(p, "unknown escape: \\%c", c); break;
+            }
+        }
+        p->token += static_cast<char>(c);
+    }
+    return makeString(p->token.data(), p->token.size());
+}
+
+Obj* parse_list(Parser* p) {
+    skipChar(p, '(');
+    Obj *head = nullObj, *tail = nullObj;
+    while(skipSpace(p) != ')') {
+        if(peekChar(p) == EOF) {
+            parseError(p, "unterminated list");
+        }
+        Obj* item = cons(parse(p), nullObj);
+        if(head == nullObj) {
+            head = item;
+        } else {
+            tail->v_cons.tail = item;
+        }
+        tail = item;
+    }
+    skipChar(p, ')');
+    return head;
+}
+
+// [a b c] is a vector literal; like a quoted list its items are not evaluated
+Obj* parse_vector(Parser* p) {
+    skipChar(p, '[');
+    Obj* vector = makeVector(0, nullObj);
+    while(skipSpace(p) != ']') {
+        if(peekChar(p) == EOF) {
+            parseError(p, "unterminated vector literal");
+        }
+        vectorPush(vector, parse(p));
+    }
+    skipChar(p, ']');
+    return vector;
+}
+
+// evaluate each top level form as soon as it is parsed
+Obj* run(Obj* env, Parser* p) {
+    Obj* retObj = nullObj;
+    while(Obj* x = parse(p)) {
+        retObj = evalTop(env, x);
+    }
+    return retObj;
+}
+
+// imported modules keep the forms their source reads as in a cache file next
+// to it (lib.lisp -> lib.lispc): a header, the names of the symbols used, then
+// each top level form tagged in prefix order with symbols as indices into the
+// names. the cache is used while the source hash, size and version all match
+#define MODULE_CACHE_MAGIC 0x43505354u
+#define MODULE_CACHE_VERSION 1
+#define MODULE_CACHE_MAX_SIZE (64 * 1024 * 1024) // forms past this aren't cached
+
+enum CacheTag : uint8_t {
+    CACHE_NULL, CACHE_INT, CACHE_FLOAT, CACHE_STRING, CACHE_SYMBOL, CACHE_LIST, CACHE_VECTOR
+};
+
+struct ModuleCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sourceHash;
+    uint64_t sourceSize;
+    uint64_t symbolCount;
+    uint64_t symbolsSize;
+    uint64_t bodySize;
+};
+
+struct CacheWriter {
+    std::string body;
+    std::map<Obj*, uint32_t> symbolIndex;
+    std::vector<Obj*> symbols;
+    bool full;
+};
+
+template<typename T>
+void cachePut(CacheWriter* w, T value) {
+    w->body.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void cacheForm(CacheWriter* w, Obj* x) {
+    switch(typeOf(x)) {
+        case T_NULL: cachePut<uint8_t>(w, CACHE_NULL); break;
+        case T_INT: cachePut<uint8_t>(w, CACHE_INT); cachePut<int64_t>(w, intValue(x)); break;
+        case T_FLOAT: cachePut<uint8_t>(w, CACHE_FLOAT); cachePut<double>(w, x->v_float); break;
+        case T_STRING:
+            cachePut<uint8_t>(w, CACHE_STRING);
+            cachePut<uint64_t>(w, x->v_strlen);
+            w->body.append(x->v_str, x->v_strlen);
+            break;
+        case T_SYMBOL: {
+            auto it = w->symbolIndex.find(x);
+            if(it == w->symbolIndex.end()) {
+                it = w->symbolIndex.insert(std::make_pair(x, static_cast<uint32_t>(w->symbols.size()))).first;
+                w->symbols.push_back(x);
+            }
+            cachePut<uint8_t>(w, CACHE_SYMBOL);
+            cachePut<uint32_t>(w, it->second);
+            break;
+        }
+        case T_CONS:
+            cachePut<uint8_t>(w, CACHE_LIST);
+            cachePut<uint64_t>(w, list_length(x));
+            for(; x != nullObj; x = cdr(x)) {
+                cacheForm(w, car(x));
+            }
+            break;
+        case T_VECTOR:
+            cachePut<uint8_t>(w, CACHE_VECTOR);
+            cachePut<uint64_t>(w, x->v_vector.size);
+            for(int64_t i = 0; i < x->v_vector.size; i++) {
+                cacheForm(w, x->v_vector.items[i]);
+            }
+            break;
+        default:
+            // the reader never produces anything else
+            w->full = true;
+            break;
+    }
+    if(w->body.size() > MODULE_CACHE_MAX_SIZE) {
+        w->full = true;
+    }
+}
+
+// written to a temporary file and renamed, so readers never see half a cache
+// even with several interpreters importing at once. a cache that can't be
+// written is just skipped
+void writeModuleCache(const std::string& path, CacheWriter* w, uint64_t sourceHash, uint64_t sourceSize) {
+    std::string tmp = path + ".XXXXXX";
+    int fd = ::mkstemp(&tmp[0]);
+    if(fd < 0) return;
+    ::fchmod(fd, 0644);
+    FILE* file = ::fdopen(fd, "wb");
+    if(!file) {
+        ::close(fd);
+        ::unlink(tmp.c_str());
+        return;
+    }
+    std::string names;
+    for(Obj* symbol : w->symbols) {
+        uint32_t len = ::strlen(symbol->v_symbol);
+        names.append(reinterpret_cast<const char*>(&len), sizeof(len));
+        names.append(symbol->v_symbol, len);
+    }
+    ModuleCacheHeader header = {
+        MODULE_CACHE_MAGIC, MODULE_CACHE_VERSION, sourceHash, sourceSize,
+        w->symbols.size(), names.size(), w->body.size()
+    };
+    bool ok = ::fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && ::fwrite(names.data(), 1, names.size(), file) == names.size();
+    ok = ok && ::fwrite(w->body.data(), 1, w->body.size(), file) == w->body.size();
+    ok = ::fclose(file) == 0 && ok;
+    if(!ok || ::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+    }
+}
+
+struct CacheReader {
+    const char* pos;
+    const char* end;
+    std::vector<Obj*> symbols;
+    const char* error; // what a truncated or malformed file is reported as
+    const char* path;
+};
+
+void cacheError(CacheReader* r) {
+    throw_error(interp->globalEnv, "%s: %s", r->error, r->path);
+}
+
+template<typename T>
+T cacheGet(CacheReader* r) {
+    T value;
+    if(static_cast<size_t>(r->end - r->pos) < sizeof(T)) cacheError(r);
+    ::memcpy(&value, r->pos, sizeof(T));
+    r->pos += sizeof(T);
+    return value;
+}
+
+Obj* readCachedForm(CacheReader* r) {
+    switch(cacheGet<uint8_t>(r)) {
+        case CACHE_NULL: return nullObj;
+        case CACHE_INT: return makeInt(cacheGet<int64_t>(r));
+        case CACHE_FLOAT: return makeFloat(cacheGet<double>(r));
+        case CACHE_STRING: {
+            uint64_t len = cacheGet<uint64_t>(r);
+            if(static_cast<uint64_t>(r->end - r->pos) < len) cacheError(r);
+            Obj* str = makeString(r->pos, len);
+            r->pos += len;
+            return str;
+        }
+        case CACHE_SYMBOL: {
+            uint32_t index = cacheGet<uint32_t>(r);
+            if(index >= r->symbols.size()) cacheError(r);
+            return r->symbols[index];
+        }
+        case CACHE_LIST: {
+            uint64_t count = cacheGet<uint64_t>(r);
+            Obj *head = nullObj, *tail = nullObj;
+            for(uint64_t i = 0; i < count; i++) {
+                Obj* item = cons(readCachedForm(r), nullObj);
+                if(head == nullObj) {
+                    head = item;
+                } else {
+                    tail->v_cons.tail = item;
+                }
+                tail = item;
+            }
+            return head;
+        }
+        case CACHE_VECTOR: {
+            uint64_t count = cacheGet<uint64_t>(r);
+            Obj* vector = makeVector(0, nullObj);
+            for(uint64_t i = 0; i < count; i++) {
+                vectorPush(vector, readCachedForm(r));
+            }
+            return vector;
+        }
+        default:
+            cacheError(r);
+            return nullptr;
+    }
+}
+
+// evaluates the forms of a fresh cache; false when there is none, or it is stale
+bool runModuleCache(Obj* env, const std::string& path, uint64_t sourceHash, uint64_t sourceSize) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    ModuleCacheHeader header;
+    if(::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(header)) {
+        ::close(fd);
+        return false;
+    }
+    void* data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(data == MAP_FAILED) return false;
+    ::memcpy(&header, data, sizeof(header));
+    if(header.magic != MODULE_CACHE_MAGIC || header.version != MODULE_CACHE_VERSION ||
+       header.sourceHash != sourceHash || header.sourceSize != sourceSize ||
+       sizeof(header) + header.symbolsSize + header.bodySize != static_cast<uint64_t>(st.st_size)) {
+        ::munmap(data, st.st_size);
+        return false;
+    }
+    CacheReader r;
+    r.pos = static_cast<const char*>(data) + sizeof(header);
+    r.end = static_cast<const char*>(data) + st.st_size;
+    r.error = "ImportError: corrupt module cache";
+    r.path = path.c_str();
+    r.symbols.reserve(header.symbolCount);
+    for(uint64_t i = 0; i < header.symbolCount; i++) {
+        uint32_t len = cacheGet<uint32_t>(&r);
+        if(static_cast<size_t>(r.end - r.pos) < len) cacheError(&r);
+        r.symbols.push_back(intern(r.pos, len));
+        r.pos += len;
+    }
+    if(static_cast<uint64_t>(r.end - r.pos) != header.bodySize) cacheError(&r);
+    while(r.pos < r.end) {
+        evalTop(env, readCachedForm(&r));
+    }
+    ::munmap(data, st.st_size);
+    return true;
+}
+
+bool moduleExists(const char* moduleName) {
+    assert(moduleName);
+    for(Obj* p = interp->modules; p != nullObj; p = cdr(p)) {
+        if(!strcmp(car(p)->v_str, moduleName)) {
+            return true;
+        }
+    }
+    return false;
 }
 
 void loadModule(Obj* env, const std::string& moduleName) {
     if(moduleExists(moduleName.c_str())) return;
-    modules = cons(makeString(moduleName.c_str()), modules);
+    interp->modules = cons(makeString(moduleName.c_str()), interp->modules);
+    FILE* file = ::fopen(moduleName.c_str(), "rb");
+    throw_error_assert(file != nullptr, env, "ImportError: can't open module: %s", moduleName.c_str());
     std::cout << "load module: " << moduleName << std::endl;
-    run_before(readTextFile(moduleName));
-    run(env);
+    uint64_t sourceHash = hashString(nullptr, 0);
+    uint64_t sourceSize = 0;
+    char block[PARSER_BUFFER_SIZE];
+    while(size_t n = ::fread(block, 1, sizeof(block), file)) {
+        sourceHash = hashString(block, n, sourceHash);
+        sourceSize += n;
+    }
+    std::string cachePath = moduleName + "c";
+    if(runModuleCache(env, cachePath, sourceHash, sourceSize)) {
+        ::fclose(file);
+        return;
+    }
+    ::rewind(file);
+    Parser parser(moduleName, file);
+    CacheWriter writer;
+    writer.full = false;
+    while(Obj* x = parse(&parser)) {
+        if(!writer.full) cacheForm(&writer, x);
+        evalTop(env, x);
+    }
+    if(!writer.full) {
+        writeModuleCache(cachePath, &writer, sourceHash, sourceSize);
+    }
 }
 
 std::string typeToString(ObjType type) {
@@ -432,473 +1749,4938 @@ std::string typeToString(ObjType type) {
         case T_FUNCTION: return "FUNCTION";
         case T_LAMBDA: return "LAMBDA";
         case T_MACRO: return "MACRO";
+        case T_VARREF: return "VARREF";
+        case T_CODE: return "CODE";
+        case T_VECTOR: return "VECTOR";
+        case T_HASHMAP: return "HASHMAP";
+        case T_CHANNEL: return "CHANNEL";
         case T_ENV: return "ENV";
+        case T_FREE: break;
     }
     return "UNDEFINED";
 }
 
-Obj* builtin_typeof(Obj* env, Obj* x) {
-    return intern(typeToString(car(x)->type).c_str());
+Obj* builtin_typeof(Obj* env, int64_t argc, Obj** argv) {
+    return interp->typeSymbols[typeOf(argv[0])];
 }
 
-int objToStr(Obj* x, char* str);
+Obj* print(Obj* x);
 
-Obj* print(Obj* x) {
-    char str[1024] = { 0 };
-    if(objToStr(x, str) > 0) {
-        ::printf("%s", str);
-    }
+Obj* builtin_print(Obj* env, int64_t argc, Obj** argv) {
+    print(argv[0]);
+    return nullObj;
+}
+
+Obj* builtin_println(Obj* env, int64_t argc, Obj** argv) {
+    builtin_print(env, argc, argv);
+    putchar('\n');
     return nullObj;
 }
 
-Obj* builtin_print(Obj* env, Obj* x) {
-    print(car(x));
-    return nullObj;
+// arithmetic builtins are variadic folds over one kernel per operator. the
+// operator is a template parameter, so each call picks the int or float loop
+// once and operator specific checks are resolved at compile time
+struct AddOp {
+    static constexpr const char* name = "+";
+    static constexpr int64_t minArgs = 0;
+    static constexpr int64_t identity = 0;
+    static constexpr bool concatenates = true;
+    static constexpr bool checksZero = false;
+    static bool apply(int64_t a, int64_t b, int64_t* r) { return !__builtin_add_overflow(a, b, r); }
+    static double apply(double a, double b) { return a + b; }
+};
+
+struct SubOp {
+    static constexpr const char* name = "-";
+    static constexpr int64_t minArgs = 1;
+    static constexpr int64_t identity = 0;
+    static constexpr bool concatenates = false;
+    static constexpr bool checksZero = false;
+    static bool apply(int64_t a, int64_t b, int64_t* r) { return !__builtin_sub_overflow(a, b, r); }
+    static double apply(double a, double b) { return a - b; }
+};
+
+struct MulOp {
+    static constexpr const char* name = "*";
+    static constexpr int64_t minArgs = 0;
+    static constexpr int64_t identity = 1;
+    static constexpr bool concatenates = false;
+    static constexpr bool checksZero = false;
+    static bool apply(int64_t a, int64_t b, int64_t* r) { return !__builtin_mul_overflow(a, b, r); }
+    static double apply(double a, double b) { return a * b; }
+};
+
+struct DivOp {
+    static constexpr const char* name = "/";
+    static constexpr int64_t minArgs = 1;
+    static constexpr int64_t identity = 1;
+    static constexpr bool concatenates = false;
+    static constexpr bool checksZero = true;
+    static bool apply(int64_t a, int64_t b, int64_t* r) {
+        if(a == INT64_MIN && b == -1) return false;
+        *r = a / b;
+        return true;
+    }
+    static double apply(double a, double b) { return a / b; }
+};
+
+double numberValue(Obj* x) {
+    return typeOf(x) == T_INT ? static_cast<double>(intValue(x)) : x->v_float;
+}
+
+void operandTypeError(Obj* env, const char* name, Obj* a, Obj* b) {
+    throw_error(env, "TypeError: unsupported operand type(s) for %s: '%s' and '%s'", name,
+        typeToString(typeOf(a)).c_str(), typeToString(typeOf(b)).c_str());
+}
+
+// (+ "a" "b" ...) builds the result in one buffer sized up front
+Obj* concatStrings(Obj* env, int64_t argc, Obj** argv) {
+    size_t size = 0;
+    for(int64_t i = 0; i < argc; i++) {
+        if(typeOf(argv[i]) != T_STRING) operandTypeError(env, "+", argv[0], argv[i]);
+        size += argv[i]->v_strlen;
+    }
+    Obj* str = makeString(nullptr, size);
+    char* q = str->v_str;
+    for(int64_t i = 0; i < argc; i++) {
+        ::memcpy(q, argv[i]->v_str, argv[i]->v_strlen);
+        q += argv[i]->v_strlen;
+    }
+    return str;
+}
+
+template<typename Op>
+Obj* floatFold(Obj* env, double acc, Obj** from, Obj** to) {
+    for(Obj** p = from; p < to; p++) {
+        acc = Op::apply(acc, numberValue(*p));
+    }
+    return makeFloat(acc);
+}
+
+template<typename Op>
+Obj* arith(Obj* env, int64_t argc, Obj** argv) {
+    throw_error_assert(argc >= Op::minArgs, env,
+        "%s() takes at least %" PRId64 " positional arguments but %" PRId64 " were given",
+        Op::name, Op::minArgs, argc);
+    if(Op::concatenates) {
+        if(argc > 0 && typeOf(argv[0]) == T_STRING) return concatStrings(env, argc, argv);
+    }
+    bool ints = true;
+    for(int64_t i = 0; i < argc; i++) {
+        ObjType type = typeOf(argv[i]);
+        if(type == T_FLOAT) {
+            ints = false;
+        } else if(type != T_INT) {
+            operandTypeError(env, Op::name, argv[i > 0 ? i - 1 : 0], argv[i]);
+        }
+    }
+    // a single operand is applied to the identity: (- x) negates, (/ x) inverts
+    Obj** p = argv;
+    Obj** end = argv + argc;
+    if(!ints) {
+        double acc = static_cast<double>(Op::identity);
+        if(argc > 1) {
+            acc = numberValue(*p++);
+        }
+        return floatFold<Op>(env, acc, p, end);
+    }
+    int64_t acc = Op::identity;
+    if(argc > 1) {
+        acc = intValue(*p++);
+    }
+    for(; p < end; p++) {
+        int64_t b = intValue(*p);
+        if(Op::checksZero) {
+            if(b == 0) throw_error(env, "ZeroDivisionError: integer division by zero");
+        }
+        int64_t r;
+        if(!Op::apply(acc, b, &r)) {
+            // overflow promotes the rest of the fold to float instead of wrapping
+            return floatFold<Op>(env, static_cast<double>(acc), p, end);
+        }
+        acc = r;
+    }
+    return makeInt(acc);
+}
+
+Obj* builtin_add(Obj* env, int64_t argc, Obj** argv) {
+    return arith<AddOp>(env, argc, argv);
+}
+
+Obj* builtin_sub(Obj* env, int64_t argc, Obj** argv) {
+    return arith<SubOp>(env, argc, argv);
+}
+
+Obj* builtin_mul(Obj* env, int64_t argc, Obj** argv) {
+    return arith<MulOp>(env, argc, argv);
+}
+
+Obj* builtin_div(Obj* env, int64_t argc, Obj** argv) {
+    return arith<DivOp>(env, argc, argv);
+}
+
+// a list of argv[0..argc), consed from the back
+Obj* argList(int64_t argc, Obj** argv) {
+    Obj* list = nullObj;
+    for(int64_t i = argc; i > 0; i--) {
+        list = cons(argv[i - 1], list);
+    }
+    return list;
+}
+
+Obj* builtin_list(Obj* env, int64_t argc, Obj** argv) {
+    return argList(argc, argv);
+}
+
+Obj* builtin_car(Obj* env, int64_t argc, Obj** argv) {
+    return car(argv[0]);
+}
+
+Obj* builtin_cdr(Obj* env, int64_t argc, Obj** argv) {
+    return cdr(argv[0]);
+}
+
+Obj* builtin_cons(Obj* env, int64_t argc, Obj** argv) {
+    return cons(argv[0], argv[1]);
+}
+
+Obj* builtin_progn(Obj* env, Obj* x) {
+    Obj* retObj = nullObj;
+    for(Obj* p = x; p != nullObj; p = cdr(p)) {
+        retObj = eval(env, car(p));
+    }
+    return retObj;
+}
+
+Obj* builtin_setq(Obj* env, Obj* x) {
+    Obj* target = car(x);
+    Obj* obj = eval(env, car(cdr(x)));
+    if(typeOf(target) == T_VARREF) {
+        *findVarRef(env, target) = obj;
+        return obj;
+    }
+    assert(typeOf(target) == T_SYMBOL);
+    Obj** var = findVar(env, target);
+    if(var) {
+        *var = obj;
+    } else {
+        addVar(env, target, obj);
+    }
+    return obj;
+}
+
+Obj* check_paramters(Obj* env, Obj* params) {
+    if(params == interp->symNull) params = nullObj;
+    for(Obj* p = params; p != nullObj; p = cdr(p)) {
+        throw_error_assert(typeOf(p) == T_CONS, env, "parameter list is not a flat list");
+        throw_error_assert(typeOf(car(p)) == T_SYMBOL, env, "parameter must be a symbol");
+    }
+    return params;
+}
+
+// lexical addressing: defun, defmacro and lambda bodies are resolved once
+// when they are defined. variable references become T_VARREF nodes holding
+// a (depth, slot) frame address, or the symbol's global value cell. only
+// parameters get slots: a setq to any other name writes the global, whether
+// or not it is bound yet. macro call arguments are left alone, their
+// expansion is looked up by name at runtime.
+
+struct Scope {
+    std::vector<Obj*> names;
+    Scope* up;
+};
+
+bool findSlot(Scope* scope, Obj* symbol, int64_t* depth, int64_t* slot) {
+    for(int64_t d = 0; scope; scope = scope->up, d++) {
+        for(size_t i = 0; i < scope->names.size(); i++) {
+            if(scope->names[i] == symbol) {
+                *depth = d;
+                *slot = i;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+Obj* resolveSymbol(Scope* scope, Obj* symbol) {
+    int64_t depth, slot;
+    if(findSlot(scope, symbol, &depth, &slot)) {
+        return makeVarRef(symbol, depth, slot);
+    }
+    return makeVarRef(symbol, -1, 0);
+}
+
+// the global binding of a call head, unless a local shadows it
+Obj* globalCallee(Scope* scope, Obj* head) {
+    int64_t depth, slot;
+    if(typeOf(head) != T_SYMBOL || !head->v_global || findSlot(scope, head, &depth, &slot)) {
+        return nullptr;
+    }
+    return head->v_global;
+}
+
+bool isSpecialForm(Obj* fn, SpecialForm form) {
+    return fn && typeOf(fn) == T_BUILTIN && fn->v_builtin.form == form;
+}
+
+Obj* resolve(Scope* scope, Obj* x);
+
+Obj* resolveList(Scope* scope, Obj* x) {
+    if(typeOf(x) != T_CONS) return resolve(scope, x);
+    return cons(resolve(scope, car(x)), resolveList(scope, cdr(x)));
+}
+
+Obj* makeList(const std::vector<Obj*>& items) {
+    Obj* list = nullObj;
+    for(size_t i = items.size(); i > 0; i--) {
+        list = cons(items[i - 1], list);
+    }
+    return list;
+}
+
+// resolve body in a new scope binding params, then lay out fn's frame
+void resolveBody(Obj* fn, Scope* up, Obj* params, Obj* body) {
+    Scope scope;
+    scope.up = up;
+    for(Obj* p = params; p != nullObj; p = cdr(p)) {
+        scope.names.push_back(car(p));
+    }
+    fn->fn_param_count = scope.names.size();
+    Obj* resolved = optimizeBody(resolveList(&scope, body));
+    Obj* names = makeList(scope.names);
+    fn->fn_slot_count = scope.names.size();
+    if(fn->type == T_LAMBDA) {
+        fn->v_lambda.params = names;
+        fn->v_lambda.body = resolved;
+    } else {
+        fn->v_function.params = names;
+        fn->v_function.body = resolved;
+    }
+}
+
+// (lambda params body...) => a T_LAMBDA prototype that builtin_lambda clones
+Obj* makeLambda(Obj* env, Scope* scope, Obj* x) {
+    Obj* lambdaObj = makeObj(T_LAMBDA);
+    lambdaObj->fn_name = interp->symLambda;
+    lambdaObj->v_lambda.env = nullObj;
+    resolveBody(lambdaObj, scope, check_paramters(env, car(x)), cdr(x));
+    return lambdaObj;
+}
+
+Obj* resolve(Scope* scope, Obj* x) {
+    if(typeOf(x) == T_SYMBOL) {
+        return resolveSymbol(scope, x);
+    }
+    if(typeOf(x) != T_CONS) {
+        return x;
+    }
+    Obj* fn = globalCallee(scope, car(x));
+    if(fn && typeOf(fn) == T_MACRO) {
+        return x;
+    }
+    if(isSpecialForm(fn, builtin_quote) || isSpecialForm(fn, builtin_defun) || isSpecialForm(fn, builtin_defmacro)) {
+        return x;
+    }
+    Obj* head = resolveSymbol(scope, car(x));
+    if(isSpecialForm(fn, builtin_lambda)) {
+        return cons(head, cons(makeLambda(interp->globalEnv, scope, cdr(x)), nullObj));
+    }
+    if(isSpecialForm(fn, builtin_setq)) {
+        return cons(head, resolveList(scope, cdr(x)));
+    }
+    if(isSpecialForm(fn, builtin_cond)) {
+        std::vector<Obj*> clauses;
+        interp->extraRoots.push_back(&clauses); // resolved clauses are only held here
+        for(Obj* p = cdr(x); typeOf(p) == T_CONS; p = cdr(p)) {
+            clauses.push_back(resolveList(scope, car(p)));
+        }
+        Obj* resolved = cons(head, makeList(clauses));
+        interp->extraRoots.pop_back();
+        return resolved;
+    }
+    return resolveList(scope, x);
+}
+
+// resolve an unresolved (lambda params body...) against the frames of env
+Obj* makeLambdaIn(Obj* env, Obj* x) {
+    // rebuild the scopes of the frames this lambda closes over
+    std::vector<Scope> scopes;
+    for(Obj* e = env; e != nullObj && e != interp->globalEnv; e = e->v_env.up) {
+        scopes.push_back(Scope());
+        for(Obj* p = e->v_env.names; p != nullObj; p = cdr(p)) {
+            scopes.back().names.push_back(car(p));
+        }
+    }
+    for(size_t i = 0; i < scopes.size(); i++) {
+        scopes[i].up = i + 1 < scopes.size() ? &scopes[i + 1] : nullptr;
+    }
+    return makeLambda(env, scopes.empty() ? nullptr : &scopes[0], x);
+}
+
+Obj* builtin_defun(Obj* env, Obj* x) {
+    Obj* funcObj;
+    if(env != interp->globalEnv) {
+        // inside a function: a named closure over the frames around it, as lambda makes
+        funcObj = makeLambdaIn(env, cdr(x));
+        funcObj->v_lambda.env = env;
+    } else {
+        funcObj = makeObj(T_FUNCTION);
+        resolveBody(funcObj, nullptr, check_paramters(env, car(cdr(x))), cdr(cdr(x)));
+    }
+    funcObj->fn_name = car(x);
+    addVar(interp->globalEnv, funcObj->fn_name, funcObj);
+    return funcObj;
+}
+
+Obj* builtin_lambda(Obj* env, Obj* x) {
+    Obj* lambdaObj;
+    if(typeOf(car(x)) == T_LAMBDA) {
+        // resolved ahead of time inside a function body
+        lambdaObj = makeObj(T_LAMBDA);
+        ::memcpy(lambdaObj, car(x), objSize(T_LAMBDA));
+    } else {
+        lambdaObj = makeLambdaIn(env, x);
+    }
+    lambdaObj->v_lambda.env = env;
+    return lambdaObj;
+}
+
+Obj* builtin_defmacro(Obj* env, Obj* x) {
+    Obj* macroObj = makeObj(T_MACRO);
+    macroObj->fn_name = car(x);
+    resolveBody(macroObj, nullptr, check_paramters(env, car(cdr(x))), cdr(cdr(x)));
+    addVar(interp->globalEnv, macroObj->fn_name, macroObj);
+    return macroObj;
+}
+
+// (macroexpand '(F 1 2 3))
+Obj* builtin_macroexpand(Obj* env, int64_t argc, Obj** argv) {
+    Obj** macro = findVar(env, car(argv[0]));
+    throw_error_assert(macro && *macro && typeOf(*macro) == T_MACRO, env, "macroexpand: not a macro call");
+    return macroexpand(env, *macro, cdr(argv[0]));
+}
+
+Obj* cloneObj(Obj* x) {
+    if(isFixnum(x)) return x;
+    Obj* destObj = ::makeObjSized(x->type, objSizeOf(x));
+    ::memcpy(destObj, x, objSizeOf(x));
+    if(destObj->type == T_CONS) {
+        for(Obj* p = destObj; p != nullObj; p = cdr(p)) {
+            p->v_cons.head = cloneObj(car(p));
+        }
+    } else if(destObj->type == T_VECTOR) {
+        destObj->v_vector.items = nullptr;
+        destObj->v_vector.capacity = 0;
+        vectorReserve(destObj, x->v_vector.capacity);
+        for(int64_t i = 0; i < x->v_vector.size; i++) {
+            destObj->v_vector.items[i] = cloneObj(x->v_vector.items[i]);
+        }
+    } else if(destObj->type == T_HASHMAP) {
+        size_t size = x->v_hash.capacity * sizeof(HashEntry);
+        destObj->v_hash.entries = static_cast<HashEntry*>(::malloc(size));
+        ::memcpy(destObj->v_hash.entries, x->v_hash.entries, size);
+        for(int64_t i = 0; i < x->v_hash.capacity; i++) {
+            HashEntry& entry = destObj->v_hash.entries[i];
+            if(entry.key) entry.value = cloneObj(entry.value);
+        }
+    }
+    return destObj;
+}
+
+Obj* parse_quote(Parser* p) {
+    skipChar(p, '\'');
+    Obj* quoted = parse(p);
+    if(!quoted) {
+        parseError(p, "nothing to quote");
+    }
+    return cons(interp->symQuote, cons(quoted, nullObj));
+}
+
+Obj* builtin_quote(Obj* env, Obj* x)  {
+    return car(x);
+}
+
+Obj* builtin_cond(Obj* env, Obj* x) {
+    for(Obj* p = x; p != nullObj; p = cdr(p)) {
+        Obj* item = car(p);
+        Obj* cond = eval(env, car(item));
+        if(cond != falseObj && cond != nullObj) {
+            return eval(env, car(cdr(item)));
+        }
+    }
+    return nullObj;
+}
+
+Obj* builtin_if(Obj* env, Obj* x) {
+    Obj* test = eval(env, car(x));
+    Obj* thenBody = car(cdr(x));
+    Obj* elseBody = car(cdr(cdr(x)));
+    if(test == falseObj || test == nullObj) {
+        return eval(env, elseBody);
+    } else {
+        return eval(env, thenBody);
+    }
+}
+
+// comparisons chain like the arithmetic: (lt a b c) is a < b < c. eq and neq
+// compare numbers by value, strings by content and anything else by identity
+// (symbols are interned); the ordering ones take numbers only
+struct EqCmp {
+    static constexpr const char* name = "eq";
+    static constexpr bool ordering = false;
+    template<typename T> static bool test(T a, T b) { return a == b; }
+};
+
+struct NeqCmp {
+    static constexpr const char* name = "neq";
+    static constexpr bool ordering = false;
+    template<typename T> static bool test(T a, T b) { return a != b; }
+};
+
+struct LtCmp {
+    static constexpr const char* name = "lt";
+    static constexpr bool ordering = true;
+    template<typename T> static bool test(T a, T b) { return a < b; }
+};
+
+struct GtCmp {
+    static constexpr const char* name = "gt";
+    static constexpr bool ordering = true;
+    template<typename T> static bool test(T a, T b) { return a > b; }
+};
+
+struct LteCmp {
+    static constexpr const char* name = "lte";
+    static constexpr bool ordering = true;
+    template<typename T> static bool test(T a, T b) { return a <= b; }
+};
+
+struct GteCmp {
+    static constexpr const char* name = "gte";
+    static constexpr bool ordering = true;
+    template<typename T> static bool test(T a, T b) { return a >= b; }
+};
+
+template<typename Cmp>
+bool compareObj(Obj* env, Obj* a, Obj* b) {
+    ObjType ta = typeOf(a);
+    ObjType tb = typeOf(b);
+    bool numbers = (ta == T_INT || ta == T_FLOAT) && (tb == T_INT || tb == T_FLOAT);
+    if(ta == T_INT && tb == T_INT) return Cmp::test(intValue(a), intValue(b));
+    if(numbers) return Cmp::test(numberValue(a), numberValue(b));
+    if(Cmp::ordering) {
+        throw_error(env, "TypeError: '%s' not supported between instances of '%s' and '%s'", Cmp::name,
+            typeToString(ta).c_str(), typeToString(tb).c_str());
+    }
+    if(ta == T_STRING && tb == T_STRING) return Cmp::test(compareStrings(a, b), 0);
+    return Cmp::test(a, b);
+}
+
+template<typename Cmp>
+Obj* compare(Obj* env, int64_t argc, Obj** argv) {
+    throw_error_assert(argc >= 2, env,
+        "%s() takes at least 2 positional arguments but %" PRId64 " were given", Cmp::name, argc);
+    for(int64_t i = 1; i < argc; i++) {
+        if(!compareObj<Cmp>(env, argv[i - 1], argv[i])) return falseObj;
+    }
+    return trueObj;
+}
+
+Obj* builtin_eq(Obj* env, int64_t argc, Obj** argv) {
+    return compare<EqCmp>(env, argc, argv);
+}
+
+Obj* builtin_neq(Obj* env, int64_t argc, Obj** argv) {
+    return compare<NeqCmp>(env, argc, argv);
+}
+
+Obj* builtin_gt(Obj* env, int64_t argc, Obj** argv) {
+    return compare<GtCmp>(env, argc, argv);
+}
+
+Obj* builtin_gte(Obj* env, int64_t argc, Obj** argv) {
+    return compare<GteCmp>(env, argc, argv);
+}
+
+Obj* builtin_lt(Obj* env, int64_t argc, Obj** argv) {
+    return compare<LtCmp>(env, argc, argv);
+}
+
+Obj* builtin_lte(Obj* env, int64_t argc, Obj** argv) {
+    return compare<LteCmp>(env, argc, argv);
+}
+
+int64_t list_length(Obj* x) {
+    int64_t i = 0;
+    for(Obj* p = x; p != nullObj; p = cdr(p)) {
+        if(typeOf(p) != T_CONS) {
+            // is not a list
+            return -1;
+        }
+        i++;
+    }
+    return i;
+}
+
+bool is_list(Obj* x) {
+    return list_length(x) != -1;
+}
+
+Obj* builtin_length(Obj* env, int64_t argc, Obj** argv)  {
+    return makeInt(list_length(argv[0]));
+}
+
+Obj* checkVector(Obj* env, const char* name, Obj* x) {
+    if(typeOf(x) != T_VECTOR)
+        throw_error(env, "TypeError: %s() argument must be a vector, not '%s'", name, typeToString(typeOf(x)).c_str());
+    return x;
+}
+
+int64_t checkIndex(Obj* env, const char* name, Obj* vector, Obj* index) {
+    if(typeOf(index) != T_INT)
+        throw_error(env, "TypeError: %s() index must be an integer, not '%s'", name, typeToString(typeOf(index)).c_str());
+    int64_t i = intValue(index);
+    throw_error_assert(i >= 0 && i < vector->v_vector.size, env,
+        "IndexError: %s() index %" PRId64 " out of range for length %" PRId64, name, i, vector->v_vector.size);
+    return i;
+}
+
+// (make-vector 3) => [null null null], (make-vector 2 0) => [0 0]
+Obj* builtin_make_vector(Obj* env, int64_t argc, Obj** argv) {
+    throw_error_assert(argc == 1 || argc == 2, env,
+        "make-vector() takes 1 or 2 positional arguments but %" PRId64 " were given", argc);
+    Obj* size = argv[0];
+    throw_error_assert(typeOf(size) == T_INT && intValue(size) >= 0, env,
+        "TypeError: make-vector() size must be a non-negative integer");
+    return makeVector(intValue(size), argc == 2 ? argv[1] : nullObj);
+}
+
+// the list conversions size their result once instead of growing it item by item
+Obj* listToVector(Obj* list, int64_t size) {
+    Obj* vector = makeVector(size, nullObj);
+    Obj** item = vector->v_vector.items;
+    for(Obj* p = list; p != nullObj; p = cdr(p)) {
+        *item++ = car(p);
+    }
+    return vector;
+}
+
+// (vector 1 2 3) => [1 2 3]
+Obj* builtin_vector(Obj* env, int64_t argc, Obj** argv) {
+    Obj* vector = makeVector(argc, nullObj);
+    std::copy(argv, argv + argc, vector->v_vector.items);
+    return vector;
+}
+
+Obj* builtin_vector_ref(Obj* env, int64_t argc, Obj** argv) {
+    Obj* vector = checkVector(env, "vector-ref", argv[0]);
+    return vector->v_vector.items[checkIndex(env, "vector-ref", vector, argv[1])];
+}
+
+Obj* builtin_vector_set(Obj* env, int64_t argc, Obj** argv) {
+    Obj* vector = checkVector(env, "vector-set!", argv[0]);
+    Obj* value = argv[2];
+    vector->v_vector.items[checkIndex(env, "vector-set!", vector, argv[1])] = value;
+    return value;
+}
+
+Obj* builtin_vector_length(Obj* env, int64_t argc, Obj** argv) {
+    return makeInt(checkVector(env, "vector-length", argv[0])->v_vector.size);
+}
+
+// (vector-push v x) appends x in amortized constant time and returns v
+Obj* builtin_vector_push(Obj* env, int64_t argc, Obj** argv) {
+    Obj* vector = checkVector(env, "vector-push", argv[0]);
+    vectorPush(vector, argv[1]);
+    return vector;
+}
+
+Obj* builtin_list_to_vector(Obj* env, int64_t argc, Obj** argv) {
+    int64_t size = list_length(argv[0]);
+    throw_error_assert(size >= 0, env, "TypeError: list->vector() argument must be a list");
+    return listToVector(argv[0], size);
+}
+
+Obj* builtin_vector_to_list(Obj* env, int64_t argc, Obj** argv) {
+    Obj* vector = checkVector(env, "vector->list", argv[0]);
+    return argList(vector->v_vector.size, vector->v_vector.items);
+}
+
+// hash maps: open addressing with linear probing over one flat array of
+// {hash, key, value} entries. the full hash is kept in the entry so probes
+// rarely touch the key, and removal shifts the following entries back instead
+// of leaving tombstones, so probe lengths stay short under churn
+
+uint64_t mixHash(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// ints, floats, strings and symbols can be keys; numbers that are eq hash alike
+bool hashKey(Obj* key, uint64_t* hash) {
+    switch(typeOf(key)) {
+        case T_INT: *hash = mixHash(intValue(key)); return true;
+        case T_FLOAT: {
+            double d = key->v_float;
+            if(d >= -9.2e18 && d <= 9.2e18 && d == static_cast<double>(static_cast<int64_t>(d))) {
+                *hash = mixHash(static_cast<int64_t>(d));
+            } else {
+                uint64_t bits;
+                ::memcpy(&bits, &d, sizeof(bits));
+                *hash = mixHash(bits);
+            }
+            return true;
+        }
+        case T_STRING: *hash = hashString(key->v_str, key->v_strlen); return true;
+        case T_SYMBOL: *hash = key->v_symhash; return true;
+        default: return false;
+    }
+}
+
+bool keysEqual(Obj* a, Obj* b) {
+    if(a == b) return true;
+    ObjType ta = typeOf(a);
+    ObjType tb = typeOf(b);
+    if(ta == T_INT && tb == T_INT) return intValue(a) == intValue(b);
+    if((ta == T_INT || ta == T_FLOAT) && (tb == T_INT || tb == T_FLOAT)) return numberValue(a) == numberValue(b);
+    return ta == T_STRING && tb == T_STRING && compareStrings(a, b) == 0;
+}
+
+uint64_t checkKey(Obj* env, const char* name, Obj* key) {
+    uint64_t hash;
+    if(!hashKey(key, &hash))
+        throw_error(env, "TypeError: %s() unhashable type: '%s'", name, typeToString(typeOf(key)).c_str());
+    return hash;
+}
+
+Obj* makeHashMap(int64_t capacity) {
+    Obj* obj = makeObj(T_HASHMAP);
+    int64_t size = 8;
+    while(size * 7 < capacity * 10) size *= 2;
+    obj->v_hash.entries = static_cast<HashEntry*>(::calloc(size, sizeof(HashEntry)));
+    if(!obj->v_hash.entries) {
+        ::fprintf(stderr, "MemoryError: out of memory\n");
+        ::exit(-1);
+    }
+    obj->v_hash.capacity = size;
+    return obj;
+}
+
+HashEntry* hashFind(Obj* map, Obj* key, uint64_t hash) {
+    HashEntry* entries = map->v_hash.entries;
+    size_t mask = map->v_hash.capacity - 1;
+    for(size_t i = hash & mask; entries[i].key; i = (i + 1) & mask) {
+        if(entries[i].hash == hash && keysEqual(entries[i].key, key)) {
+            return &entries[i];
+        }
+    }
+    return nullptr;
+}
+
+void hashInsertNew(HashEntry* entries, size_t mask, const HashEntry& entry) {
+    size_t i = entry.hash & mask;
+    while(entries[i].key) i = (i + 1) & mask;
+    entries[i] = entry;
+}
+
+void hashGrow(Obj* map) {
+    HashEntry* old = map->v_hash.entries;
+    int64_t oldCapacity = map->v_hash.capacity;
+    HashEntry* entries = static_cast<HashEntry*>(::calloc(oldCapacity * 2, sizeof(HashEntry)));
+    if(!entries) {
+        ::fprintf(stderr, "MemoryError: out of memory\n");
+        ::exit(-1);
+    }
+    for(int64_t i = 0; i < oldCapacity; i++) {
+        if(old[i].key) hashInsertNew(entries, oldCapacity * 2 - 1, old[i]);
+    }
+    ::free(old);
+    map->v_hash.entries = entries;
+    map->v_hash.capacity = oldCapacity * 2;
+}
+
+void hashSet(Obj* map, Obj* key, uint64_t hash, Obj* value) {
+    if((map->v_hash.count + 1) * 10 > map->v_hash.capacity * 7) {
+        hashGrow(map);
+    }
+    // one probe finds either the key or the free slot it goes in
+    HashEntry* entries = map->v_hash.entries;
+    size_t mask = map->v_hash.capacity - 1;
+    size_t i = hash & mask;
+    for(; entries[i].key; i = (i + 1) & mask) {
+        if(entries[i].hash == hash && keysEqual(entries[i].key, key)) {
+            entries[i].value = value;
+            return;
+        }
+    }
+    entries[i] = HashEntry { hash, key, value };
+    map->v_hash.count++;
+}
+
+bool hashRemove(Obj* map, Obj* key, uint64_t hash) {
+    HashEntry* entry = hashFind(map, key, hash);
+    if(!entry) return false;
+    HashEntry* entries = map->v_hash.entries;
+    size_t mask = map->v_hash.capacity - 1;
+    size_t hole = entry - entries;
+    // move back every following entry whose home slot is at or before the hole
+    for(size_t i = (hole + 1) & mask; entries[i].key; i = (i + 1) & mask) {
+        size_t home = entries[i].hash & mask;
+        if(((i - home) & mask) >= ((i - hole) & mask)) {
+            entries[hole] = entries[i];
+            hole = i;
+        }
+    }
+    entries[hole] = HashEntry { 0, nullptr, nullptr };
+    map->v_hash.count--;
+    return true;
+}
+
+Obj* checkHashMap(Obj* env, const char* name, Obj* x) {
+    if(typeOf(x) != T_HASHMAP)
+        throw_error(env, "TypeError: %s() argument must be a hashmap, not '%s'", name, typeToString(typeOf(x)).c_str());
+    return x;
+}
+
+// (make-hash) or (make-hash expected-count)
+Obj* builtin_make_hash(Obj* env, int64_t argc, Obj** argv) {
+    throw_error_assert(argc <= 1, env, "make-hash() takes at most 1 positional argument but %" PRId64 " were given", argc);
+    int64_t capacity = 0;
+    if(argc == 1) {
+        throw_error_assert(typeOf(argv[0]) == T_INT && intValue(argv[0]) >= 0, env,
+            "TypeError: make-hash() size must be a non-negative integer");
+        capacity = intValue(argv[0]);
+    }
+    return makeHashMap(capacity);
+}
+
+// (hash-get h key) or (hash-get h key default), default is null
+Obj* builtin_hash_get(Obj* env, int64_t argc, Obj** argv) {
+    throw_error_assert(argc == 2 || argc == 3, env,
+        "hash-get() takes 2 or 3 positional arguments but %" PRId64 " were given", argc);
+    Obj* map = checkHashMap(env, "hash-get", argv[0]);
+    Obj* key = argv[1];
+    HashEntry* entry = hashFind(map, key, checkKey(env, "hash-get", key));
+    if(entry) return entry->value;
+    return argc == 3 ? argv[2] : nullObj;
+}
+
+Obj* builtin_hash_set(Obj* env, int64_t argc, Obj** argv) {
+    Obj* map = checkHashMap(env, "hash-set!", argv[0]);
+    Obj* key = argv[1];
+    Obj* value = argv[2];
+    hashSet(map, key, checkKey(env, "hash-set!", key), value);
+    return value;
+}
+
+// (hash-remove! h key) => true if key was present
+Obj* builtin_hash_remove(Obj* env, int64_t argc, Obj** argv) {
+    Obj* map = checkHashMap(env, "hash-remove!", argv[0]);
+    Obj* key = argv[1];
+    return toBoolObj(hashRemove(map, key, checkKey(env, "hash-remove!", key)));
+}
+
+Obj* builtin_hash_keys(Obj* env, int64_t argc, Obj** argv) {
+    Obj* map = checkHashMap(env, "hash-keys", argv[0]);
+    Obj* keys = nullObj;
+    for(int64_t i = map->v_hash.capacity; i > 0; i--) {
+        HashEntry& entry = map->v_hash.entries[i - 1];
+        if(entry.key) keys = cons(entry.key, keys);
+    }
+    return keys;
+}
+
+Obj* builtin_hash_count(Obj* env, int64_t argc, Obj** argv) {
+    return makeInt(checkHashMap(env, "hash-count", argv[0])->v_hash.count);
+}
+
+Obj* builtin_eval(Obj* env, int64_t argc, Obj** argv) {
+    Obj* x = argv[0];
+    if(typeOf(x) == T_STRING) {
+        Parser parser(std::string(x->v_str, x->v_strlen));
+        return run(env, &parser);
+    }
+    return evalTop(env, x);
+}
+
+Obj* builtin_import(Obj* env, int64_t argc, Obj** argv) {
+    throw_error_assert(typeOf(argv[0]) == T_STRING, env, "import() parameter type must be string");
+    loadModule(env, std::string(argv[0]->v_str));
+    return nullObj;
+}
+
+Obj* builtin_while(Obj* env, Obj* x) {
+    while(eval(env, car(x)) == trueObj) {
+        eval(env, car(cdr(x)));
+    }
+    return nullObj;
+}
+
+// optimizer: top level forms, resolved bodies and macro expansions pass through
+// it before they are evaluated or compiled. -O1 folds calls to pure builtins on
+// constant arguments and drops cond and if branches behind constant tests, -O2
+// also inlines calls to small functions. it takes the builtins it folds, the
+// functions it inlines and true, false and null to keep their global values, so
+// code rebinding those should run at -O0, the default. macro calls are left
+// alone until they are expanded
+
+#define INLINE_MAX_NODES 16 // atoms and calls in a function body worth inlining
+#define INLINE_MAX_DEPTH 3 // calls inlined into code that was itself inlined
+
+struct Optimizer {
+    Obj* env; // env by-name code runs in, nullptr for resolved bodies
+    int level;
+    int depth;
+    bool expand; // expand macro calls first, for (optimize form)
+};
+
+Obj* optimize(Optimizer* o, Obj* x);
+
+// the global value a call head or variable refers to, nullptr if a local may shadow it
+Obj* optGlobal(Optimizer* o, Obj* x) {
+    if(typeOf(x) == T_VARREF) {
+        return x->v_ref.depth < 0 ? x->v_ref.symbol->v_global : nullptr;
+    }
+    if(typeOf(x) != T_SYMBOL || !o->env) return nullptr;
+    return findVar(o->env, x) == &x->v_global ? x->v_global : nullptr;
+}
+
+// the value x always evaluates to, nullptr if it is only known at runtime
+Obj* constantValue(Optimizer* o, Obj* x) {
+    switch(typeOf(x)) {
+    case T_NULL:
+    case T_INT:
+    case T_FLOAT:
+    case T_STRING:
+    case T_BOOL:
+        return x;
+    case T_SYMBOL:
+    case T_VARREF: {
+            Obj* sym = typeOf(x) == T_VARREF ? x->v_ref.symbol : x;
+            if(sym != interp->symTrue && sym != interp->symFalse && sym != interp->symNull) return nullptr;
+            return optGlobal(o, x);
+        }
+    case T_CONS:
+        if(isSpecialForm(optGlobal(o, car(x)), builtin_quote) && list_length(x) == 2) {
+            return car(cdr(x));
+        }
+        return nullptr;
+    default:
+        return nullptr;
+    }
+}
+
+// arithmetic and comparisons: no effects, and the result only depends on the arguments
+bool isPureBuiltin(Builtin b) {
+    return b == builtin_add || b == builtin_sub || b == builtin_mul || b == builtin_div
+        || b == builtin_eq || b == builtin_neq
+        || b == builtin_lt || b == builtin_gt || b == builtin_lte || b == builtin_gte;
+}
+
+// a pure builtin applied to constant arguments now. nullptr for anything
+// else, and for calls that would fail, which are left to fail at runtime
+Obj* foldCall(Obj* fn, int64_t argc, Obj** argv) {
+    Builtin b = fn->v_builtin.ptr;
+    if(!isPureBuiltin(b)) return nullptr;
+    bool arithmetic = b == builtin_add || b == builtin_sub || b == builtin_mul || b == builtin_div;
+    bool equality = b == builtin_eq || b == builtin_neq;
+    if(argc < (arithmetic ? 1 : 2)) return nullptr;
+    bool strings = b == builtin_add && typeOf(argv[0]) == T_STRING;
+    for(int64_t i = 0; i < argc; i++) {
+        ObjType type = typeOf(argv[i]);
+        if(strings) {
+            if(type != T_STRING) return nullptr;
+        } else if(!equality) {
+            if(type != T_INT && type != T_FLOAT) return nullptr;
+            if(b == builtin_div && type == T_INT && intValue(argv[i]) == 0 && (i > 0 || argc == 1)) return nullptr;
+        }
+    }
+    return b(interp->globalEnv, argc, argv);
+}
+
+Obj* optimizeList(Optimizer* o, Obj* x) {
+    if(typeOf(x) != T_CONS) return x;
+    Obj* head = optimize(o, car(x));
+    Obj* tail = optimizeList(o, cdr(x));
+    return head == car(x) && tail == cdr(x) ? x : cons(head, tail);
+}
+
+// drop the clauses behind constant false tests and the ones after a constant
+// true test, which ends the cond. nullptr if a clause is malformed
+Obj* optimizeCond(Optimizer* o, Obj* x) {
+    for(Obj* p = cdr(x); p != nullObj; p = cdr(p)) {
+        if(typeOf(car(p)) != T_CONS || list_length(car(p)) < 0) return nullptr;
+    }
+    std::vector<Obj*> clauses;
+    interp->extraRoots.push_back(&clauses); // optimized clauses are only held here
+    bool changed = false;
+    Obj* result = nullptr;
+    for(Obj* p = cdr(x); p != nullObj; p = cdr(p)) {
+        Obj* clause = optimizeList(o, car(p));
+        Obj* test = constantValue(o, car(clause));
+        changed = changed || clause != car(p);
+        if(test == falseObj || test == nullObj) {
+            changed = true;
+            continue;
+        }
+        if(test && clauses.empty()) {
+            result = cdr(clause) != nullObj ? car(cdr(clause)) : nullObj;
+            break;
+        }
+        clauses.push_back(clause);
+        if(test) {
+            changed = changed || cdr(p) != nullObj;
+            break;
+        }
+    }
+    if(!result) {
+        result = clauses.empty() ? nullObj : changed ? cons(car(x), makeList(clauses)) : x;
+    }
+    interp->extraRoots.pop_back();
+    return result;
+}
+
+// builtins that look names up in the env they are called from
+bool readsCallerEnv(Builtin builtin) {
+    return builtin == builtin_eval || builtin == builtin_import || builtin == builtin_macroexpand
+        || builtin == builtin_optimize;
+}
+
+// a body can be inlined if it is small, does not call fn again and only uses
+// calls to globals, cond, if, progn, quote, constants and variable references
+bool inlinable(Obj* fn, Obj* x, int64_t* budget) {
+    if(--*budget < 0) return false;
+    switch(typeOf(x)) {
+    case T_NULL:
+    case T_INT:
+    case T_FLOAT:
+    case T_STRING:
+    case T_BOOL:
+    case T_VARREF:
+        return true;
+    case T_CONS:
+        break;
+    default:
+        return false; // names looked up at runtime, lambda prototypes
+    }
+    if(list_length(x) < 0) return false;
+    Obj* head = car(x);
+    Obj* callee = nullptr;
+    if(typeOf(head) == T_SYMBOL) {
+        callee = head->v_global; // left unresolved: quote, macro calls
+    } else if(typeOf(head) == T_VARREF && head->v_ref.depth < 0) {
+        callee = head->v_ref.symbol->v_global;
+    }
+    if(callee && typeOf(callee) == T_BUILTIN && callee->v_builtin.form) {
+        SpecialForm form = callee->v_builtin.form;
+        if(form == builtin_quote) return true;
+        if(form == builtin_cond) {
+            for(Obj* p = cdr(x); p != nullObj; p = cdr(p)) {
+                if(typeOf(car(p)) != T_CONS || list_length(car(p)) < 0) return false;
+                for(Obj* q = car(p); q != nullObj; q = cdr(q)) {
+                    if(!inlinable(fn, car(q), budget)) return false;
+                }
+            }
+            return true;
+        }
+        if(form != builtin_if && form != builtin_progn) return false;
+    } else if(!callee || callee == fn) {
+        return false;
+    } else if(typeOf(callee) == T_BUILTIN ? readsCallerEnv(callee->v_builtin.ptr)
+        : typeOf(callee) != T_FUNCTION && typeOf(callee) != T_LAMBDA) {
+        return false;
+    }
+    for(Obj* p = cdr(x); p != nullObj; p = cdr(p)) {
+        if(!inlinable(fn, car(p), budget)) return false;
+    }
+    return true;
+}
+
+// x with the parameter references of the function it comes from replaced by args
+Obj* substitute(Obj* x, const std::vector<Obj*>& args) {
+    if(typeOf(x) == T_VARREF && x->v_ref.depth == 0) return args[x->v_ref.slot];
+    if(typeOf(x) != T_CONS || car(x) == interp->symQuote) return x;
+    Obj* head = substitute(car(x), args);
+    return cons(head, substitute(cdr(x), args));
+}
+
+// a body with nothing but calls to pure builtins, quote, constants and
+// variable references, so nothing it does can come before or between the
+// reads of its arguments and change them
+bool pureBody(Obj* x) {
+    if(typeOf(x) == T_SYMBOL) return false;
+    if(typeOf(x) != T_CONS) return true;
+    Obj* head = car(x);
+    if(typeOf(head) == T_SYMBOL) return isSpecialForm(head->v_global, builtin_quote);
+    if(typeOf(head) != T_VARREF || head->v_ref.depth >= 0) return false;
+    Obj* callee = head->v_ref.symbol->v_global;
+    if(!callee || typeOf(callee) != T_BUILTIN || callee->v_builtin.form || !isPureBuiltin(callee->v_builtin.ptr)) {
+        return false;
+    }
+    for(Obj* p = cdr(x); p != nullObj; p = cdr(p)) {
+        if(!pureBody(car(p))) return false;
+    }
+    return true;
+}
+
+// how many times a body reads parameter slot
+int64_t paramUses(Obj* x, int64_t slot) {
+    if(typeOf(x) == T_VARREF) return x->v_ref.depth == 0 && x->v_ref.slot == slot;
+    if(typeOf(x) != T_CONS || car(x) == interp->symQuote) return 0;
+    return paramUses(car(x), slot) + paramUses(cdr(x), slot);
+}
+
+// a variable argument that has a value now, so reading it can't fail. slots
+// of the caller's frame are taken to hold one
+bool isBound(Optimizer* o, Obj* x) {
+    if(typeOf(x) == T_VARREF) {
+        return x->v_ref.depth >= 0 || x->v_ref.symbol->v_global;
+    }
+    Obj** var = o->env ? findVar(o->env, x) : nullptr;
+    return var && *var;
+}
+
+// the body of fn put in place of the call, nullptr unless fn's body is a
+// single inlinable form. constant arguments go in wherever their parameter
+// is used. a variable argument is read once at the call, so it only goes in
+// when it is bound, its parameter is used exactly once and the body is pure
+Obj* inlineCall(Optimizer* o, Obj* fn, Obj* call) {
+    Obj* body = fn->v_function.body;
+    int64_t argc = list_length(cdr(call));
+    if(o->depth >= INLINE_MAX_DEPTH || argc != fn->fn_param_count || fn->fn_slot_count != argc) return nullptr;
+    if(typeOf(body) != T_CONS || cdr(body) != nullObj) return nullptr;
+    int64_t budget = INLINE_MAX_NODES;
+    if(!inlinable(fn, car(body), &budget)) return nullptr;
+    std::vector<Obj*> args; // held by call
+    for(Obj* p = cdr(call); p != nullObj; p = cdr(p)) {
+        Obj* arg = car(p);
+        if(!constantValue(o, arg)) {
+            if(typeOf(arg) != T_SYMBOL && typeOf(arg) != T_VARREF) return nullptr;
+            if(!isBound(o, arg) || paramUses(car(body), args.size()) != 1 || !pureBody(car(body))) return nullptr;
+        }
+        args.push_back(arg);
+    }
+    o->depth++;
+    Obj* inlined = optimize(o, substitute(car(body), args));
+    o->depth--;
+    return inlined;
+}
+
+Obj* optimize(Optimizer* o, Obj* x) {
+    if(typeOf(x) != T_CONS || list_length(x) < 0) return x;
+    Obj* fn = optGlobal(o, car(x));
+    if(fn && typeOf(fn) == T_MACRO) {
+        return o->expand ? optimize(o, macroexpand(o->env, fn, cdr(x))) : x;
+    }
+    if(fn && typeOf(fn) == T_BUILTIN && fn->v_builtin.form) {
+        SpecialForm form = fn->v_builtin.form;
+        int64_t length = list_length(x);
+        if(form == builtin_cond) {
+            Obj* pruned = optimizeCond(o, x);
+            return pruned ? pruned : x;
+        }
+        if(form == builtin_if || form == builtin_progn || form == builtin_while) {
+            Obj* args = optimizeList(o, cdr(x));
+            Obj* test = form == builtin_if && length == 4 ? constantValue(o, car(args)) : nullptr;
+            if(test) {
+                return test == falseObj || test == nullObj ? car(cdr(cdr(args))) : car(cdr(args));
+            }
+            return args == cdr(x) ? x : cons(car(x), args);
+        }
+        if(form == builtin_setq && length == 3) {
+            Obj* value = optimize(o, car(cdr(cdr(x))));
+            return value == car(cdr(cdr(x))) ? x : cons(car(x), cons(car(cdr(x)), cons(value, nullObj)));
+        }
+        return x; // quote, lambda, defun, defmacro and the rest take their arguments as written
+    }
+    if(!fn && typeOf(car(x)) == T_SYMBOL) {
+        return x; // a local, or not bound yet: may be a macro by the time it runs
+    }
+    Obj* call = optimizeList(o, x);
+    if(fn && typeOf(fn) == T_BUILTIN) {
+        std::vector<Obj*> values; // held by call
+        for(Obj* p = cdr(call); p != nullObj; p = cdr(p)) {
+            Obj* value = constantValue(o, car(p));
+            if(!value) return call;
+            values.push_back(value);
+        }
+        Obj* folded = foldCall(fn, values.size(), values.data());
+        return folded ? folded : call;
+    }
+    if(fn && typeOf(fn) == T_FUNCTION && o->level >= 2) {
+        Obj* inlined = inlineCall(o, fn, call);
+        if(inlined) return inlined;
+    }
+    return call;
+}
+
+// x as the optimizer leaves it at the -O level, for code running in env
+Obj* optimizeCode(Obj* env, Obj* x) {
+    if(interp->optLevel < 1) return x;
+    Optimizer o = { env, interp->optLevel, 0, false };
+    return optimize(&o, x);
+}
+
+// the forms of a resolved function body, optimized
+Obj* optimizeBody(Obj* body) {
+    if(interp->optLevel < 1) return body;
+    Optimizer o = { nullptr, interp->optLevel, 0, false };
+    return optimizeList(&o, body);
+}
+
+// (optimize '(form)) => the form as -O2 runs it, macro calls expanded
+Obj* builtin_optimize(Obj* env, int64_t argc, Obj** argv) {
+    Optimizer o = { env, 2, 0, true };
+    return optimize(&o, argv[0]);
+}
+
+#define PRINTER_FLUSH_SIZE (64 * 1024)
+
+// renders objects into a growing buffer, handed to out in large writes when
+// out is set. vectors and hashmaps being printed are kept to catch cycles
+struct Printer {
+    FILE* out; // nullptr collects the whole text in buf
+    std::string buf;
+    std::vector<Obj*> open;
+
+    explicit Printer(FILE* out) : out(out) {
+    }
+};
+
+void flushPrinter(Printer* pr) {
+    if(pr->out && !pr->buf.empty()) {
+        ::fwrite(pr->buf.data(), 1, pr->buf.size(), pr->out);
+        pr->buf.clear();
+    }
+}
+
+void printInt(Printer* pr, int64_t value) {
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* q = end;
+    uint64_t n = value < 0 ? 0 - static_cast<uint64_t>(value) : value;
+    do {
+        *--q = '0' + n % 10;
+        n /= 10;
+    } while(n);
+    if(value < 0) *--q = '-';
+    pr->buf.append(q, end - q);
+}
+
+// true if x is already being printed further up, and enters it otherwise
+bool enterContainer(Printer* pr, Obj* x) {
+    if(std::find(pr->open.begin(), pr->open.end(), x) != pr->open.end()) {
+        return false;
+    }
+    pr->open.push_back(x);
+    return true;
+}
+
+void printObj(Printer* pr, Obj* x) {
+    if(pr->out && pr->buf.size() >= PRINTER_FLUSH_SIZE) {
+        flushPrinter(pr);
+    }
+    switch(typeOf(x)) {
+        case T_NULL: pr->buf += "null"; break;
+        case T_INT: printInt(pr, intValue(x)); break;
+        case T_FLOAT: {
+            char str[512]; // %f of DBL_MAX is 316 characters
+            pr->buf.append(str, ::snprintf(str, sizeof(str), "%f", x->v_float));
+            break;
+        }
+        case T_STRING: pr->buf.append(x->v_str, x->v_strlen); break;
+        case T_BOOL: pr->buf += x->v_bool ? "true" : "false"; break;
+        case T_SYMBOL: pr->buf += x->v_symbol; break;
+        case T_VARREF: pr->buf += x->v_ref.symbol->v_symbol; break;
+        case T_CONS: {
+            pr->buf += '(';
+            for(Obj* p = x; p != nullObj; p = cdr(p)) {
+                if(typeOf(p) == T_CONS) {
+                    printObj(pr, car(p));
+                    if(cdr(p) != nullObj) pr->buf += ' ';
+                } else {
+                    pr->buf += ". ";
+                    printObj(pr, p);
+                    break;
+                }
+            }
+            pr->buf += ')';
+            break;
+        }
+        case T_VECTOR: {
+            if(!enterContainer(pr, x)) {
+                pr->buf += "[...]";
+                break;
+            }
+            pr->buf += '[';
+            for(int64_t i = 0; i < x->v_vector.size; i++) {
+                if(i > 0) pr->buf += ' ';
+                printObj(pr, x->v_vector.items[i]);
+            }
+            pr->buf += ']';
+            pr->open.pop_back();
+            break;
+        }
+        case T_HASHMAP: {
+            if(!enterContainer(pr, x)) {
+                pr->buf += "{...}";
+                break;
+            }
+            pr->buf += '{';
+            bool first = true;
+            for(int64_t i = 0; i < x->v_hash.capacity; i++) {
+                HashEntry& entry = x->v_hash.entries[i];
+                if(!entry.key) continue;
+                if(!first) pr->buf += ' ';
+                first = false;
+                printObj(pr, entry.key);
+                pr->buf += ' ';
+                printObj(pr, entry.value);
+            }
+            pr->buf += '}';
+            pr->open.pop_back();
+            break;
+        }
+        default: pr->buf += "<" + typeToString(typeOf(x)) + ">"; break;
+    }
+}
+
+Obj* print(Obj* x) {
+    Printer pr(stdout);
+    printObj(&pr, x);
+    flushPrinter(&pr);
+    return nullObj;
+}
+
+std::string toString(Obj* x) {
+    Printer pr(nullptr);
+    printObj(&pr, x);
+    return pr.buf;
+}
+
+// (to-string '(1 "a" [2])) => "(1 a [2])"
+Obj* builtin_to_string(Obj* env, int64_t argc, Obj** argv) {
+    Printer pr(nullptr);
+    printObj(&pr, argv[0]);
+    return makeString(pr.buf.data(), pr.buf.size());
+}
+
+Obj* gcStatsToList() {
+    Obj* stats = nullObj;
+    stats = acons(intern("gc-millis"), makeFloat(interp->gcStats.gcMillis), stats);
+    stats = acons(intern("peak-heap-bytes"), makeInt(interp->gcStats.peakHeapBytes), stats);
+    stats = acons(intern("heap-bytes"), makeInt(interp->gcStats.heapBytes), stats);
+    stats = acons(intern("live-bytes"), makeInt(interp->gcStats.liveBytes), stats);
+    stats = acons(intern("live-objects"), makeInt(interp->gcStats.liveObjects), stats);
+    stats = acons(intern("freed-objects"), makeInt(interp->gcStats.freedObjects), stats);
+    stats = acons(intern("allocated-bytes"), makeInt(interp->gcStats.allocatedBytes), stats);
+    stats = acons(intern("allocated-objects"), makeInt(interp->gcStats.allocatedObjects), stats);
+    stats = acons(intern("collections"), makeInt(interp->gcStats.collections), stats);
+    return stats;
+}
+
+// (gc) => run a full collection and return the collector statistics
+Obj* builtin_gc(Obj* env, int64_t argc, Obj** argv) {
+    gcCollect();
+    return gcStatsToList();
+}
+
+void printGCStats() {
+    ::fprintf(stderr,
+        "gc: %" PRIu64 " collections, %.3f ms\n"
+        "gc: allocated %" PRIu64 " objects / %" PRIu64 " bytes, freed %" PRIu64 " objects / %" PRIu64 " bytes\n"
+        "gc: live %" PRIu64 " objects / %" PRIu64 " bytes, heap %" PRIu64 " bytes (peak %" PRIu64 ")\n",
+        interp->gcStats.collections, interp->gcStats.gcMillis,
+        interp->gcStats.allocatedObjects, interp->gcStats.allocatedBytes, interp->gcStats.freedObjects, interp->gcStats.freedBytes,
+        interp->gcStats.liveObjects, interp->gcStats.liveBytes, interp->gcStats.heapBytes, interp->gcStats.peakHeapBytes);
+}
+
+// builtins called at least once, most called first
+std::vector<Obj*> calledBuiltins() {
+    std::vector<Obj*> builtins;
+    for(auto& entry : interp->symbols.entries) {
+        Obj* fn = entry.symbol ? entry.symbol->v_global : nullptr;
+        if(fn && typeOf(fn) == T_BUILTIN && fn->v_builtin.calls > 0) {
+            builtins.push_back(fn);
+        }
+    }
+    std::sort(builtins.begin(), builtins.end(), [](Obj* a, Obj* b) {
+        return a->v_builtin.calls > b->v_builtin.calls;
+    });
+    return builtins;
+}
+
+// (stats) => ((allocations (CONS . n) ...) (interns . n) ... (builtins (car . n) ...))
+Obj* builtin_stats(Obj* env, int64_t argc, Obj** argv) {
+#if RUNTIME_STATS
+    std::vector<Obj*> builtins = calledBuiltins();
+    Obj* calls = nullObj;
+    for(size_t i = builtins.size(); i > 0; i--) {
+        calls = acons(builtins[i - 1]->fn_name, makeInt(builtins[i - 1]->v_builtin.calls), calls);
+    }
+    Obj* allocations = nullObj;
+    for(int type = T_FREE; type >= T_NULL; type--) {
+        if(interp->runtimeStats.allocations[type] == 0) continue;
+        allocations = acons(interp->typeSymbols[type], makeInt(interp->runtimeStats.allocations[type]), allocations);
+    }
+    Obj* stats = nullObj;
+    stats = acons(intern("builtins"), calls, stats);
+    stats = acons(intern("builtin-calls"), makeInt(interp->runtimeStats.builtinCalls), stats);
+    stats = acons(intern("env-frames"), makeInt(interp->runtimeStats.envFrames), stats);
+    stats = acons(intern("call-cache-misses"), makeInt(interp->runtimeStats.callCacheMisses), stats);
+    stats = acons(intern("call-cache-hits"), makeInt(interp->runtimeStats.callCacheHits), stats);
+    stats = acons(intern("macro-cache-hits"), makeInt(interp->runtimeStats.macroCacheHits), stats);
+    stats = acons(intern("macro-expansions"), makeInt(interp->runtimeStats.macroExpansions), stats);
+    stats = acons(intern("var-lookup-frames"), makeInt(interp->runtimeStats.varLookupFrames), stats);
+    stats = acons(intern("var-lookups"), makeInt(interp->runtimeStats.varLookups), stats);
+    stats = acons(intern("symbols"), makeInt(interp->symbols.count), stats);
+    stats = acons(intern("interns"), makeInt(interp->runtimeStats.interns), stats);
+    stats = acons(intern("allocations"), allocations, stats);
+    return stats;
+#else
+    return nullObj;
+#endif
+}
+
+void printRuntimeStats() {
+#if RUNTIME_STATS
+    uint64_t calls = interp->runtimeStats.callCacheHits + interp->runtimeStats.callCacheMisses;
+    ::fprintf(stderr,
+        "stats: %" PRIu64 " interns, %zu symbols\n"
+        "stats: %" PRIu64 " var lookups walking %" PRIu64 " env frames\n"
+        "stats: %" PRIu64 " macro expansions, %" PRIu64 " expansion cache hits\n"
+        "stats: %" PRIu64 " call cache hits, %" PRIu64 " misses (%.1f%% hits)\n"
+        "stats: %" PRIu64 " env frames, %" PRIu64 " builtin calls\n",
+        interp->runtimeStats.interns, interp->symbols.count,
+        interp->runtimeStats.varLookups, interp->runtimeStats.varLookupFrames,
+        interp->runtimeStats.macroExpansions, interp->runtimeStats.macroCacheHits,
+        interp->runtimeStats.callCacheHits, interp->runtimeStats.callCacheMisses,
+        calls ? 100.0 * interp->runtimeStats.callCacheHits / calls : 0.0,
+        interp->runtimeStats.envFrames, interp->runtimeStats.builtinCalls);
+    ::fprintf(stderr, "stats: allocated");
+    for(int type = T_NULL; type <= T_FREE; type++) {
+        if(interp->runtimeStats.allocations[type] == 0) continue;
+        ::fprintf(stderr, " %s %" PRIu64, typeToString(static_cast<ObjType>(type)).c_str(), interp->runtimeStats.allocations[type]);
+    }
+    ::fprintf(stderr, "\nstats: builtin calls");
+    std::vector<Obj*> builtins = calledBuiltins();
+    for(size_t i = 0; i < builtins.size() && i < 20; i++) {
+        ::fprintf(stderr, " %s %" PRIu64, builtins[i]->fn_name->v_symbol, builtins[i]->v_builtin.calls);
+    }
+    ::fprintf(stderr, "\n");
+#else
+    ::fprintf(stderr, "stats: counters compiled out (RUNTIME_STATS=0)\n");
+#endif
+}
+
+void addBuiltin(Obj* env, const char* name, Builtin builtin, SpecialForm form, int64_t param_count) {
+    Obj* builtinObj = makeObj(T_BUILTIN);
+    builtinObj->fn_name = intern(name);
+    builtinObj->fn_param_count = param_count;
+    builtinObj->v_builtin.ptr = builtin;
+    builtinObj->v_builtin.form = form;
+    builtinObj->v_builtin.calls = 0;
+    addVar(env, builtinObj->fn_name, builtinObj);
+}
+
+// every builtin, in the order images refer to them by
+static const struct BuiltinDef {
+    const char* name;
+    Builtin fn;
+    SpecialForm form;
+    int64_t paramCount;
+    BuiltinDef(const char* name, Builtin fn, int64_t paramCount) : name(name), fn(fn), form(nullptr), paramCount(paramCount) {}
+    BuiltinDef(const char* name, SpecialForm form, int64_t paramCount) : name(name), fn(nullptr), form(form), paramCount(paramCount) {}
+} builtinTable[] = {
+    { "print", builtin_print, 1 },
+    { "println", builtin_println, 1 },
+    { "to-string", builtin_to_string, 1 },
+    { "+", builtin_add, -1 },
+    { "-", builtin_sub, -1 },
+    { "*", builtin_mul, -1 },
+    { "/", builtin_div, -1 },
+    { "list", builtin_list, -1 }, /* unlimited number of parameters */
+    { "car", builtin_car, 1 },
+    { "cdr", builtin_cdr, 1 },
+    { "progn", builtin_progn, -1 },
+    { "setq", builtin_setq, 2 },
+    { "defun", builtin_defun, 3 },
+    { "quote", builtin_quote, 1 },
+    { "length", builtin_length, 1 },
+    { "cond", builtin_cond, -1 },
+    { "if", builtin_if, 3 },
+    { "eq", builtin_eq, -1 },
+    { "neq", builtin_neq, -1 },
+    { "gt", builtin_gt, -1 },
+    { "gte", builtin_gte, -1 },
+    { "lt", builtin_lt, -1 },
+    { "lte", builtin_lte, -1 },
+    { "typeof", builtin_typeof, 1 },
+    { "lambda", builtin_lambda, -1 },
+    { "eval", builtin_eval, 1 },
+    { "defmacro", builtin_defmacro, 3 },
+    { "macroexpand", builtin_macroexpand, 1 },
+    { "optimize", builtin_optimize, 1 },
+    { "cons", builtin_cons, 2 },
+    { "import", builtin_import, 1 },
+    { "while", builtin_while, 2 },
+    { "gc", builtin_gc, 0 },
+    { "stats", builtin_stats, 0 },
+    { "make-vector", builtin_make_vector, -1 },
+    { "vector", builtin_vector, -1 },
+    { "vector-ref", builtin_vector_ref, 2 },
+    { "vector-set!", builtin_vector_set, 3 },
+    { "vector-length", builtin_vector_length, 1 },
+    { "vector-push", builtin_vector_push, 2 },
+    { "list->vector", builtin_list_to_vector, 1 },
+    { "vector->list", builtin_vector_to_list, 1 },
+    { "make-hash", builtin_make_hash, -1 },
+    { "hash-get", builtin_hash_get, -1 },
+    { "hash-set!", builtin_hash_set, 3 },
+    { "hash-remove!", builtin_hash_remove, 2 },
+    { "hash-keys", builtin_hash_keys, 1 },
+    { "hash-count", builtin_hash_count, 1 },
+    { "pmap", builtin_pmap, 2 },
+    { "pfor-each", builtin_pfor_each, 2 },
+    { "preduce", builtin_preduce, 3 },
+    { "spawn", builtin_spawn, -1 },
+    { "yield", builtin_yield, 0 },
+    { "chan", builtin_chan, -1 },
+    { "send", builtin_send, 2 },
+    { "recv", builtin_recv, 1 },
+};
+static const size_t builtinCount = sizeof(builtinTable) / sizeof(builtinTable[0]);
+
+void defineBuiltins(Obj* env) {
+    for(size_t i = 0; i < builtinCount; i++) {
+        addBuiltin(env, builtinTable[i].name, builtinTable[i].fn, builtinTable[i].form, builtinTable[i].paramCount);
+    }
+
+    addVar(env, interp->symNull, nullObj);
+    addVar(env, intern("true"), trueObj);
+    addVar(env, intern("false"), falseObj);
+
+    addVar(env, intern("NULL"), intern("NULL"));
+    addVar(env, intern("INT"), intern("INT"));
+    addVar(env, intern("FLOAT"), intern("FLOAT"));
+    addVar(env, intern("STRING"), intern("STRING"));
+    addVar(env, intern("SYMBOL"), intern("SYMBOL"));
+    addVar(env, intern("BOOL"), intern("BOOL"));
+    addVar(env, intern("CONS"), intern("CONS"));
+    addVar(env, intern("BUILTIN"), intern("BUILTIN"));
+    addVar(env, intern("FUNCTION"), intern("FUNCTION"));
+    addVar(env, intern("ENV"), intern("ENV"));
+    addVar(env, intern("VECTOR"), intern("VECTOR"));
+    addVar(env, intern("HASHMAP"), intern("HASHMAP"));
+    addVar(env, intern("CHANNEL"), intern("CHANNEL"));
+    addVar(env, intern("UNDEFINED"), intern("UNDEFINED"));
+}
+
+// --save-image writes everything reachable from the roots and the symbol
+// table; --image starts from such a file instead of defining the builtins and
+// loading lib.lisp. an object is stored as its cell, with pointers turned
+// into refs, followed by the malloc'd storage it owns. a ref is 0 for nullptr,
+// a fixnum as is, or twice (index + 1) for the index-th object of the image.
+// indices 0 to 2 are null, true and false, which every interpreter shares
+#define IMAGE_MAGIC 0x474d4954u
+#define IMAGE_VERSION 6
+#define IMAGE_SHARED 3
+#define IMAGE_ROOTS 2
+
+struct ImageHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t builtins; // an image only fits a binary with the same builtins
+    uint64_t objectCount;
+    uint64_t bodySize;
+    Obj* roots[IMAGE_ROOTS]; // globalEnv and modules as refs
+};
+
+uint64_t builtinsHash() {
+    uint64_t hash = hashString(nullptr, 0);
+    for(size_t i = 0; i < builtinCount; i++) {
+        hash = hashString(builtinTable[i].name, ::strlen(builtinTable[i].name) + 1, hash);
+    }
+    return hash;
+}
+
+// calls f on every object pointer held in the cell itself
+template<typename F>
+void forEachField(Obj* obj, F f) {
+    switch(obj->type) {
+        case T_CONS:
+            f(obj->v_cons.head);
+            f(obj->v_cons.tail);
+            break;
+        case T_ENV:
+            f(obj->v_env.up);
+            f(obj->v_env.names);
+            f(obj->v_env.vars);
+            for(int64_t i = 0; i < obj->v_env.size; i++) {
+                f(obj->v_env.slots[i]);
+            }
+            break;
+        case T_SYMBOL:
+            f(obj->v_global);
+            break;
+        case T_VARREF:
+            f(obj->v_ref.symbol);
+            break;
+        case T_BUILTIN:
+            f(obj->fn_name);
+            break;
+        case T_FUNCTION:
+        case T_MACRO:
+            f(obj->fn_name);
+            f(obj->fn_code);
+            f(obj->v_function.params);
+            f(obj->v_function.body);
+            break;
+        case T_LAMBDA:
+            f(obj->fn_name);
+            f(obj->fn_code);
+            f(obj->v_lambda.params);
+            f(obj->v_lambda.body);
+            f(obj->v_lambda.env);
+            break;
+        default: break;
+    }
+}
+
+struct ImageWriter {
+    CacheWriter out;
+    std::unordered_map<Obj*, uint64_t> ids;
+    std::vector<Obj*> objects; // in image order, appended to as refs are taken
+};
+
+Obj* imageRef(ImageWriter* w, Obj* obj) {
+    if(!obj || isFixnum(obj)) return obj;
+    auto it = w->ids.find(obj);
+    if(it == w->ids.end()) {
+        it = w->ids.insert(std::make_pair(obj, static_cast<uint64_t>(w->objects.size()))).first;
+        w->objects.push_back(obj);
+    }
+    return reinterpret_cast<Obj*>((it->second + 1) << 1);
+}
+
+void saveImage(const char* path) {
+    ImageWriter w;
+    ImageHeader header;
+    ::memset(&header, 0, sizeof(header));
+    Obj* shared[IMAGE_SHARED] = { nullObj, trueObj, falseObj };
+    for(int i = 0; i < IMAGE_SHARED; i++) {
+        imageRef(&w, shared[i]);
+    }
+    Obj* roots[IMAGE_ROOTS] = { interp->globalEnv, interp->modules };
+    for(int i = 0; i < IMAGE_ROOTS; i++) {
+        header.roots[i] = imageRef(&w, roots[i]);
+    }
+    for(auto& entry : interp->symbols.entries) {
+        if(entry.symbol) imageRef(&w, entry.symbol);
+    }
+    std::string cell;
+    for(size_t i = IMAGE_SHARED; i < w.objects.size(); i++) {
+        Obj* obj = w.objects[i];
+        uint32_t cellSize = chunkAt(reinterpret_cast<uintptr_t>(obj))->cellSize;
+        cell.assign(reinterpret_cast<const char*>(obj), cellSize);
+        Obj* copy = reinterpret_cast<Obj*>(&cell[0]);
+        copy->marked = false;
+        forEachField(copy, [&](Obj*& field) { field = imageRef(&w, field); });
+        switch(obj->type) {
+            case T_BUILTIN: copy->fn_code = nullptr; copy->v_builtin.ptr = nullptr; copy->v_builtin.form = nullptr; copy->v_builtin.calls = 0; break;
+            case T_SYMBOL: copy->v_symbol = nullptr; break;
+            case T_VECTOR: copy->v_vector.items = nullptr; break;
+            case T_HASHMAP: copy->v_hash.entries = nullptr; break;
+            case T_CHANNEL: copy->v_channel.state = nullptr; break;
+            case T_CODE:
+                copy->v_code.ops = nullptr;
+                copy->v_code.consts = nullptr;
+                copy->v_code.hotness = 0; // a run starts interpreted and compiles what gets hot again
+                copy->v_code.native = nullptr;
+                break;
+            default: break;
+        }
+        cachePut<uint32_t>(&w.out, cellSize);
+        w.out.body.append(cell);
+        switch(obj->type) {
+            case T_BUILTIN: {
+                uint32_t index = 0;
+                while(index < builtinCount && (builtinTable[index].fn != obj->v_builtin.ptr
+                    || builtinTable[index].form != obj->v_builtin.form)) index++;
+                cachePut<uint32_t>(&w.out, index);
+                break;
+            }
+            case T_SYMBOL: {
+                uint32_t len = ::strlen(obj->v_symbol);
+                cachePut<uint32_t>(&w.out, len);
+                w.out.body.append(obj->v_symbol, len);
+                break;
+            }
+            case T_VECTOR:
+                for(int64_t j = 0; j < obj->v_vector.size; j++) {
+                    cachePut<Obj*>(&w.out, imageRef(&w, obj->v_vector.items[j]));
+                }
+                break;
+            case T_HASHMAP:
+                // keys hash by content, so the table is saved as it is laid out
+                for(int64_t j = 0; j < obj->v_hash.capacity; j++) {
+                    HashEntry& entry = obj->v_hash.entries[j];
+                    cachePut<HashEntry>(&w.out, HashEntry { entry.hash, imageRef(&w, entry.key), imageRef(&w, entry.value) });
+                }
+                break;
+            case T_CODE:
+                w.out.body.append(reinterpret_cast<const char*>(obj->v_code.ops), obj->v_code.nops * sizeof(intptr_t));
+                for(int32_t j = 0; j < obj->v_code.nconsts; j++) {
+                    cachePut<Obj*>(&w.out, imageRef(&w, obj->v_code.consts[j]));
+                }
+                break;
+            default: break;
+        }
+    }
+    header.magic = IMAGE_MAGIC;
+    header.version = IMAGE_VERSION;
+    header.builtins = builtinsHash();
+    header.objectCount = w.objects.size();
+    header.bodySize = w.out.body.size();
+    FILE* file = ::fopen(path, "wb");
+    bool ok = file && ::fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && ::fwrite(w.out.body.data(), 1, w.out.body.size(), file) == w.out.body.size();
+    ok = file && ::fclose(file) == 0 && ok;
+    if(!ok) {
+        ::fprintf(stderr, "can't write image: %s\n", path);
+        ::exit(-1);
+    }
+}
+
+Obj* imageObj(CacheReader* r, const std::vector<Obj*>& objects, Obj* ref) {
+    if(!ref || isFixnum(ref)) return ref;
+    uintptr_t index = (reinterpret_cast<uintptr_t>(ref) >> 1) - 1;
+    if(index >= objects.size()) cacheError(r);
+    return objects[index];
+}
+
+template<typename T>
+T* imageArray(CacheReader* r, int64_t count) {
+    if(count < 0 || static_cast<uint64_t>(r->end - r->pos) / sizeof(T) < static_cast<uint64_t>(count)) cacheError(r);
+    T* items = static_cast<T*>(::malloc(std::max<int64_t>(count, 1) * sizeof(T)));
+    if(!items) {
+        ::fprintf(stderr, "MemoryError: out of memory\n");
+        ::exit(-1);
+    }
+    ::memcpy(items, r->pos, count * sizeof(T));
+    r->pos += count * sizeof(T);
+    return items;
+}
+
+// copies every object of the image into the heap, then relocates their refs.
+// nothing is collected meanwhile since the cells hold refs until the end
+void loadImage(const char* path) {
+    int fd = ::open(path, O_RDONLY);
+    struct stat st;
+    void* data = MAP_FAILED;
+    if(fd >= 0 && ::fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if(fd >= 0) ::close(fd);
+    ImageHeader header;
+    if(data == MAP_FAILED || static_cast<size_t>(st.st_size) < sizeof(header)) {
+        throw_error(nullptr, "ImageError: can't open image: %s", path);
+    }
+    ::memcpy(&header, data, sizeof(header));
+    if(header.magic != IMAGE_MAGIC || header.version != IMAGE_VERSION || header.builtins != builtinsHash()) {
+        ::munmap(data, st.st_size);
+        throw_error(nullptr, "ImageError: %s was not written by this interpreter", path);
+    }
+    CacheReader r;
+    r.pos = static_cast<const char*>(data) + sizeof(header);
+    r.end = static_cast<const char*>(data) + st.st_size;
+    r.error = "ImageError: corrupt image";
+    r.path = path;
+    if(static_cast<uint64_t>(r.end - r.pos) != header.bodySize) cacheError(&r);
+
+    uintptr_t stackBottom = interp->gcStackBottom;
+    interp->gcStackBottom = 0;
+    std::vector<Obj*> objects;
+    objects.reserve(header.objectCount);
+    objects.push_back(nullObj);
+    objects.push_back(trueObj);
+    objects.push_back(falseObj);
+    for(uint64_t i = IMAGE_SHARED; i < header.objectCount; i++) {
+        uint32_t cellSize = cacheGet<uint32_t>(&r);
+        if(cellSize < offsetof(Obj, v_int) || static_cast<size_t>(r.end - r.pos) < cellSize) cacheError(&r);
+        const char* cell = r.pos; // not aligned, so only read through memcpy
+        uint32_t typeTag;
+        ::memcpy(&typeTag, cell + offsetof(Obj, type), sizeof(typeTag));
+        if(typeTag >= T_FREE || cellSize < objSize(static_cast<ObjType>(typeTag))) cacheError(&r);
+        ObjType type = static_cast<ObjType>(typeTag);
+        r.pos += cellSize;
+        Obj* obj;
+        if(type == T_SYMBOL) {
+            uint32_t len = cacheGet<uint32_t>(&r);
+            if(static_cast<size_t>(r.end - r.pos) < len) cacheError(&r);
+            obj = intern(r.pos, len);
+            r.pos += len;
+            ::memcpy(&obj->v_global, cell + offsetof(Obj, v_global), sizeof(Obj*));
+            objects.push_back(obj);
+            continue;
+        }
+        obj = makeObjSized(type, cellSize);
+        ::memcpy(obj, cell, cellSize);
+        if((type == T_ENV && objSizeOf(obj) > cellSize) || (type == T_STRING && (obj->v_strlen < 0 || objSizeOf(obj) > cellSize))) {
+            cacheError(&r);
+        }
+        switch(type) {
+            case T_BUILTIN: {
+                uint32_t index = cacheGet<uint32_t>(&r);
+                if(index >= builtinCount) cacheError(&r);
+                obj->v_builtin.ptr = builtinTable[index].fn;
+                obj->v_builtin.form = builtinTable[index].form;
+                break;
+            }
+            case T_VECTOR:
+                obj->v_vector.items = imageArray<Obj*>(&r, obj->v_vector.size);
+                obj->v_vector.capacity = std::max<int64_t>(obj->v_vector.size, 1);
+                break;
+            case T_HASHMAP:
+                if(obj->v_hash.capacity <= 0 || (obj->v_hash.capacity & (obj->v_hash.capacity - 1)) ||
+                   obj->v_hash.count >= obj->v_hash.capacity) {
+                    cacheError(&r);
+                }
+                obj->v_hash.entries = imageArray<HashEntry>(&r, obj->v_hash.capacity);
+                break;
+            case T_CHANNEL:
+                // saved empty: buffered values and waiting threads belong to the run that made them
+                if(obj->v_channel.capacity < 1) cacheError(&r);
+                obj->v_channel.state = newChannel(obj->v_channel.capacity);
+                break;
+            case T_CODE:
+                obj->v_code.ops = imageArray<intptr_t>(&r, obj->v_code.nops);
+                obj->v_code.consts = imageArray<Obj*>(&r, obj->v_code.nconsts);
+                break;
+            default: break;
+        }
+        objects.push_back(obj);
+    }
+    if(r.pos != r.end) cacheError(&r);
+
+    for(size_t k = IMAGE_SHARED; k < objects.size(); k++) {
+        Obj* obj = objects[k];
+        forEachField(obj, [&](Obj*& field) { field = imageObj(&r, objects, field); });
+        switch(obj->type) {
+            case T_VECTOR:
+                for(int64_t i = 0; i < obj->v_vector.size; i++) {
+                    obj->v_vector.items[i] = imageObj(&r, objects, obj->v_vector.items[i]);
+                }
+                break;
+            case T_CODE:
+                for(int32_t i = 0; i < obj->v_code.nconsts; i++) {
+                    obj->v_code.consts[i] = imageObj(&r, objects, obj->v_code.consts[i]);
+                }
+                break;
+            case T_HASHMAP: {
+                int64_t count = 0;
+                for(int64_t i = 0; i < obj->v_hash.capacity; i++) {
+                    HashEntry& entry = obj->v_hash.entries[i];
+                    if(!entry.key) continue;
+                    entry.key = imageObj(&r, objects, entry.key);
+                    entry.value = imageObj(&r, objects, entry.value);
+                    uint64_t hash;
+                    if(!hashKey(entry.key, &hash) || hash != entry.hash) cacheError(&r);
+                    count++;
+                }
+                if(count != obj->v_hash.count) cacheError(&r);
+                break;
+            }
+            default: break;
+        }
+    }
+    interp->globalEnv = imageObj(&r, objects, header.roots[0]);
+    interp->modules = imageObj(&r, objects, header.roots[1]);
+    interp->gcStackBottom = stackBottom;
+    ::munmap(data, st.st_size);
+}
+
+void checkArity(Obj* env, Obj* fn, int64_t argc) {
+    throw_error_assert(fn->fn_param_count == -1 || argc == fn->fn_param_count, env, 
+        "%s() takes %" PRId64 " positional arguments but %" PRId64 " were given", 
+        fn->fn_name->v_symbol, fn->fn_param_count, argc);
+}
+
+Obj* macroexpand(Obj* env, Obj* macro, Obj* args) {
+    STAT_ADD(macroExpansions, 1);
+    if(interp->vmEnabled) {
+        return vmApply(env, macro, args);
+    }
+    int64_t argc = list_length(args);
+    checkArity(env, macro, argc);
+    CallScope scope(macro->fn_name);
+    Obj** argv = vmPushList(env, args, argc);
+    Obj* newEnv = pushEnv(interp->globalEnv, macro, argc, argv);
+    interp->vm.sp = argv;
+    return builtin_progn(newEnv, macro->v_macro.body);
+}
+
+// expand the macro call x once per call site, again if macro is redefined
+Obj* expandCached(Obj* env, Obj* macro, Obj* x) {
+    auto it = interp->macroCache.find(x);
+    if(it != interp->macroCache.end() && it->second.macro == macro) {
+        STAT_ADD(macroCacheHits, 1);
+        return it->second.expanded;
+    }
+    Obj* expanded = optimizeCode(env, macroexpand(env, macro, cdr(x)));
+    interp->macroCache[x] = MacroExpansion { macro, expanded };
+    return expanded;
+}
+
+// evaluate the argc argument forms x onto the vm stack, which keeps the
+// values alive until the caller pops them
+Obj** evalArgs(Obj* env, Obj* x, int64_t argc) {
+    vmCheckStack(env, argc);
+    Obj** argv = interp->vm.sp;
+    interp->vm.high = std::max(interp->vm.high, argv + argc);
+    for(Obj* p = x; p != nullObj; p = cdr(p)) {
+        Obj* value = eval(env, car(p));
+        *interp->vm.sp++ = value;
+    }
+    return argv;
+}
+
+// call fn on argc evaluated arguments at argv, its arity already checked
+Obj* invoke(Obj* env, Obj* fn, int64_t argc, Obj** argv) {
+    if(typeOf(fn) == T_BUILTIN) {
+        CallScope scope(fn->fn_name);
+        STAT_BUILTIN_CALL(fn);
+        return fn->v_builtin.ptr(env, argc, argv);
+    } else if(interp->vmEnabled) {
+        return vmCall(env, fn, argc, argv);
+    }
+    CallScope scope(fn->fn_name);
+    if(typeOf(fn) == T_FUNCTION) {
+        return builtin_progn(pushEnv(interp->globalEnv, fn, argc, argv), fn->v_function.body);
+    }
+    return builtin_progn(pushEnv(fn->v_lambda.env, fn, argc, argv), fn->v_lambda.body);
+}
+
+// apply the forms in args to fn, already known to take argc arguments
+Obj* applyChecked(Obj* env, Obj* fn, int64_t argc, Obj* args) {
+    if(typeOf(fn) == T_BUILTIN && fn->v_builtin.form) {
+        CallScope scope(fn->fn_name);
+        STAT_BUILTIN_CALL(fn);
+        return fn->v_builtin.form(env, args);
+    }
+    Obj** argv = evalArgs(env, args, argc);
+    Obj* result = invoke(env, fn, argc, argv);
+    interp->vm.sp = argv;
+    return result;
+}
+
+Obj* apply_function(Obj* env, Obj* fn, Obj* args) {
+    int64_t argc = list_length(args);
+    checkArity(env, fn, argc);
+    return applyChecked(env, fn, argc, args);
+}
+
+// call fn with already evaluated arguments from c++
+Obj* callFunction(Obj* env, Obj* fn, int64_t argc, Obj** argv) {
+    checkArity(env, fn, argc);
+    return invoke(env, fn, argc, argv);
+}
+
+// c++ recursion that lisp code can drive (eval, macro expansion, builtins
+// calling back into lisp) reports a RecursionError instead of overflowing
+void checkNativeStack(Obj* env) {
+    uintptr_t top = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    if(interp->nativeStackLimit && interp->gcStackBottom - top > interp->nativeStackLimit) {
+        throw_error(env, "RecursionError: maximum recursion depth exceeded");
+    }
+}
+
+// evaluate the leading forms of a progn, cond or if and return the form left
+// in tail position
+Obj* evalToTail(Obj* env, SpecialForm form, Obj* x) {
+    if(form == builtin_if) {
+        Obj* test = eval(env, car(x));
+        return test == falseObj || test == nullObj ? car(cdr(cdr(x))) : car(cdr(x));
+    }
+    if(form == builtin_cond) {
+        for(Obj* p = x; p != nullObj; p = cdr(p)) {
+            Obj* item = car(p);
+            Obj* cond = eval(env, car(item));
+            if(cond != falseObj && cond != nullObj) {
+                return car(cdr(item));
+            }
+        }
+        return nullObj;
+    }
+    if(x == nullObj) return nullObj;
+    for(; cdr(x) != nullObj; x = cdr(x)) {
+        eval(env, car(x));
+    }
+    return car(x);
+}
+
+bool isTailForm(SpecialForm form) {
+    return form == builtin_progn || form == builtin_cond || form == builtin_if;
+}
+
+// the names of the innermost env in the chain that has any, which along with
+// the call form fix where each name in the form is bound. nullptr when some
+// env holds bindings made at runtime, which could shadow any name
+Obj* envShape(Obj* env) {
+    Obj* shape = nullptr;
+    for(Obj* e = env; e != nullObj; e = e->v_env.up) {
+        if(e->v_env.vars != nullObj) return nullptr;
+        if(!shape && e->v_env.names != nullObj) shape = e->v_env.names;
+    }
+    return shape ? shape : nullObj;
+}
+
+CallKind callKind(Obj* fn, int64_t argc) {
+    ObjType type = typeOf(fn);
+    if(type == T_MACRO) return CALL_MACRO;
+    if(type != T_BUILTIN && type != T_FUNCTION && type != T_LAMBDA) return CALL_UNCACHED;
+    if(fn->fn_param_count != -1 && argc != fn->fn_param_count) return CALL_UNCACHED;
+    if(type != T_BUILTIN) return CALL_FUNCTION;
+    if(!fn->v_builtin.form) return CALL_BUILTIN;
+    return isTailForm(fn->v_builtin.form) ? CALL_TAIL_FORM : CALL_FORM;
+}
+
+// the callee of the call x and how to call it, through the site's cache
+Obj* resolveCall(Obj* env, Obj* x, CallKind* kind, int64_t* argc) {
+    uintptr_t key = reinterpret_cast<uintptr_t>(x) * UINT64_C(0x9e3779b97f4a7c15);
+    CallSite& site = interp->callSites[key >> (64 - CALL_CACHE_BITS)];
+    Obj* head = car(x);
+    Obj* sym = typeOf(head) == T_VARREF ? head->v_ref.symbol : head;
+    bool filled = site.form == x && site.epoch == interp->callEpoch;
+    if(filled && site.global && sym->v_global == site.callees[0] && site.shape == envShape(env)) {
+        STAT_ADD(callCacheHits, 1);
+        *kind = site.kinds[0];
+        *argc = site.argc;
+        return site.callees[0];
+    }
+    Obj* fn = eval(env, head);
+    if(filled && !site.global) {
+        for(int32_t i = 0; i < site.ways; i++) {
+            if(site.callees[i] == fn) {
+                STAT_ADD(callCacheHits, 1);
+                *kind = site.kinds[i];
+                *argc = site.argc;
+                return fn;
+            }
+        }
+    }
+    STAT_ADD(callCacheMisses, 1);
+    *argc = list_length(cdr(x));
+    *kind = callKind(fn, *argc);
+    if(*kind == CALL_UNCACHED) return fn;
+    // the head names a global if looking it up by name ends at the symbol's cell
+    Obj* shape = nullptr;
+    if(typeOf(head) == T_SYMBOL || (typeOf(head) == T_VARREF && head->v_ref.depth < 0)) {
+        shape = envShape(env);
+        if(shape && findVar(env, sym) != &sym->v_global) shape = nullptr;
+    }
+    if(!filled || shape || site.global) {
+        site.form = x;
+        site.epoch = interp->callEpoch;
+        site.argc = *argc;
+        site.global = shape != nullptr;
+        site.shape = shape;
+        site.ways = 0;
+    }
+    // a megamorphic site keeps the callees it saw first
+    if(site.ways < CALL_CACHE_WAYS) {
+        site.callees[site.ways] = fn;
+        site.kinds[site.ways] = *kind;
+        site.ways++;
+    }
+    return fn;
+}
+
+Obj* eval(Obj* env, Obj* x) {
+    checkNativeStack(env);
+    CallScope scope; // entered by the first call this eval makes
+    // forms in tail position loop here, so tail calls run in constant stack
+    for(;;) {
+    if(!x) return nullObj;
+    switch(typeOf(x)) {
+    case T_NULL:
+        return nullObj;
+    case T_INT:
+    case T_FLOAT:
+    case T_STRING:
+        return x;
+    case T_SYMBOL: {
+            Obj** var = findVar(env, x);
+            if(var == nullptr || *var == nullptr) {
+                throw_error(env, "can't find symbol: %s", x->v_symbol);
+            }
+            return *var;
+        }
+    case T_VARREF: {
+            Obj* obj = *findVarRef(env, x);
+            if(obj == nullptr) {
+                // not bound where the resolver expected, try names created at runtime
+                Obj** var = findVar(env, x->v_ref.symbol);
+                obj = var ? *var : nullptr;
+            }
+            if(obj == nullptr) {
+                throw_error(env, "can't find symbol: %s", x->v_ref.symbol->v_symbol);
+            }
+            return obj;
+        }
+    case T_CONS: {
+        CallKind kind;
+        int64_t argc;
+        Obj* obj = resolveCall(env, x, &kind, &argc);
+        Obj* args = cdr(x);
+        if(kind == CALL_MACRO) {
+            x = expandCached(env, obj, x);
+            continue;
+        }
+        if(kind == CALL_UNCACHED) {
+            if(typeOf(obj) != T_BUILTIN && typeOf(obj) != T_FUNCTION && typeOf(obj) != T_LAMBDA) {
+                throw_error(env, "can't call type: %s(%s)", typeToString(typeOf(obj)).c_str(), toString(obj).c_str());
+            }
+            checkArity(env, obj, argc);
+        }
+        if(kind == CALL_TAIL_FORM) {
+            STAT_BUILTIN_CALL(obj);
+            x = evalToTail(env, obj->v_builtin.form, args);
+            continue;
+        }
+        if(kind != CALL_FUNCTION || interp->vmEnabled) {
+            return applyChecked(env, obj, argc, args);
+        }
+        Obj** argv = evalArgs(env, args, argc);
+        scope.enter(obj->fn_name);
+        env = pushEnv(typeOf(obj) == T_FUNCTION ? interp->globalEnv : obj->v_lambda.env, obj, argc, argv);
+        interp->vm.sp = argv;
+        x = evalToTail(env, builtin_progn, typeOf(obj) == T_FUNCTION ? obj->v_function.body : obj->v_lambda.body);
+        continue;
+    }
+    default: break;
+    }
+    return x;
+    }
+}
+
+// bytecode compiler: resolved function bodies and top level forms compile
+// to a flat array of words, each opcode followed by its operands. special
+// forms get their own opcodes and calls to a few hot fixed-arity builtins are
+// inlined behind a guard on the callee symbol's global cell, so rebinding
+// the symbol still works.
+
+#define VM_MIN_STACK_SIZE (1024 * 1024)
+#define VM_SLOTS_PER_FRAME 16
+
+enum OpCode {
+    OP_CONST, // k: push consts[k]
+    OP_POP,
+    OP_LOCAL, // slot sym: push a local living on the vm stack
+    OP_SETLOCAL, // slot sym
+    OP_ENVREF, // depth slot sym: push a slot of a heap env frame
+    OP_SETENV, // depth slot sym
+    OP_GLOBAL, // sym: push the global value cell of sym
+    OP_SETGLOBAL, // sym
+    OP_NAME, // sym: look sym up by name at runtime
+    OP_SETNAME, // sym
+    OP_JUMP, // target
+    OP_JUMPIFNOT, // target: pop, jump if false or null
+    OP_JUMPIFNOTTRUE, // target: pop, jump unless true (while loops)
+    OP_CALL, // argc: callee sits below the arguments
+    OP_CALLGLOBAL, // sym argc: callee is the global value of sym
+    OP_TAILCALL, // argc: like OP_CALL, replacing the current frame
+    OP_TAILCALLGLOBAL, // sym argc
+    OP_RETURN,
+    OP_LAMBDA, // k: close the lambda prototype consts[k] over env
+    OP_MACRO, // k cache: run the expansion of the macro call consts[k] in a new frame
+    OP_TAILMACRO, // k cache: run the expansion in place of the current frame
+    OP_SPECIAL, // fn args: apply a special form to unevaluated arguments
+    OP_ADD, // sym fn: inlined builtins, used while sym is still bound to fn
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_EQ,
+    OP_NEQ,
+    OP_LT,
+    OP_GT,
+    OP_LTE,
+    OP_GTE,
+    OP_CAR,
+    OP_CDR,
+    OP_CONS,
+    OP_COUNT
+};
+
+struct Compiler {
+    Obj* fn; // function being compiled, nullptr for top level code
+    Obj* env; // env top level code runs in
+    bool heapEnv; // locals live in a heap env frame
+    bool needsEnv; // the code closes over, or looks up names in, its frame
+    std::vector<intptr_t> ops;
+    std::vector<Obj*> consts;
+    int32_t depth;
+    int32_t maxDepth;
+
+    Compiler(Obj* fn, Obj* env, bool heapEnv)
+    : fn(fn), env(env), heapEnv(heapEnv), needsEnv(false), depth(0), maxDepth(0) {
+        interp->extraRoots.push_back(&consts);
+    }
+    ~Compiler() {
+        interp->extraRoots.pop_back();
+    }
+};
+
+void compileExpr(Compiler* c, Obj* x, bool tail = false);
+
+intptr_t addConst(Compiler* c, Obj* obj) {
+    for(size_t i = 0; i < c->consts.size(); i++) {
+        if(c->consts[i] == obj) return i;
+    }
+    c->consts.push_back(obj);
+    return c->consts.size() - 1;
+}
+
+// n consts the vm may overwrite, never shared with other operands
+intptr_t addSlots(Compiler* c, int n) {
+    c->consts.insert(c->consts.end(), n, nullObj);
+    return c->consts.size() - n;
+}
+
+void emit(Compiler* c, intptr_t word) {
+    c->ops.push_back(word);
+}
+
+void adjustDepth(Compiler* c, int32_t delta) {
+    c->depth += delta;
+    c->maxDepth = std::max(c->maxDepth, c->depth);
+}
+
+void emitConst(Compiler* c, Obj* obj) {
+    emit(c, OP_CONST);
+    emit(c, addConst(c, obj));
+    adjustDepth(c, 1);
+}
+
+size_t emitJump(Compiler* c, OpCode op) {
+    emit(c, op);
+    emit(c, 0);
+    return c->ops.size() - 1;
+}
+
+void patchJump(Compiler* c, size_t at) {
+    c->ops[at] = c->ops.size();
+}
+
+// top level code at global scope reads and writes global cells directly
+bool atGlobalScope(Compiler* c) {
+    return !c->fn && c->env == interp->globalEnv;
+}
+
+void compileVarRef(Compiler* c, Obj* ref, bool set) {
+    intptr_t sym = addConst(c, ref->v_ref.symbol);
+    if(ref->v_ref.depth < 0) {
+        emit(c, set ? OP_SETGLOBAL : OP_GLOBAL);
+        emit(c, sym);
+    } else if(!c->heapEnv && ref->v_ref.depth == 0) {
+        emit(c, set ? OP_SETLOCAL : OP_LOCAL);
+        emit(c, ref->v_ref.slot);
+        emit(c, sym);
+    } else {
+        // without a heap frame of its own, depth 0 of env is the enclosing frame
+        emit(c, set ? OP_SETENV : OP_ENVREF);
+        emit(c, c->heapEnv ? ref->v_ref.depth : ref->v_ref.depth - 1);
+        emit(c, ref->v_ref.slot);
+        emit(c, sym);
+    }
+    adjustDepth(c, set ? 0 : 1);
+}
+
+void compileSymbol(Compiler* c, Obj* symbol, bool set) {
+    if(atGlobalScope(c)) {
+        emit(c, set ? OP_SETGLOBAL : OP_GLOBAL);
+    } else {
+        c->needsEnv = true;
+        emit(c, set ? OP_SETNAME : OP_NAME);
+    }
+    emit(c, addConst(c, symbol));
+    adjustDepth(c, set ? 0 : 1);
+}
+
+// the global symbol a call head refers to, nullptr if it is a local or an expression
+Obj* calleeSymbol(Compiler* c, Obj* head) {
+    if(typeOf(head) == T_VARREF) {
+        return head->v_ref.depth < 0 ? head->v_ref.symbol : nullptr;
+    }
+    if(typeOf(head) != T_SYMBOL) {
+        return nullptr;
+    }
+    if(c->fn || atGlobalScope(c)) {
+        // the resolver leaves a symbol head only where no local shadows it
+        return head;
+    }
+    Obj** var = findVar(c->env, head);
+    return !var || var == &head->v_global ? head : nullptr;
+}
+
+void compileSpecial(Compiler* c, Obj* fn, Obj* args) {
+    c->needsEnv = true;
+    emit(c, OP_SPECIAL);
+    emit(c, addConst(c, fn));
+    emit(c, addConst(c, args));
+    adjustDepth(c, 1);
+}
+
+void compileProgn(Compiler* c, Obj* body, bool tail) {
+    if(body == nullObj) {
+        emitConst(c, nullObj);
+        return;
+    }
+    for(Obj* p = body; p != nullObj; p = cdr(p)) {
+        compileExpr(c, car(p), tail && cdr(p) == nullObj);
+        if(cdr(p) != nullObj) {
+            emit(c, OP_POP);
+            adjustDepth(c, -1);
+        }
+    }
+}
+
+bool compileSetq(Compiler* c, Obj* args) {
+    Obj* target = car(args);
+    if(typeOf(target) != T_VARREF && typeOf(target) != T_SYMBOL) {
+        return false;
+    }
+    compileExpr(c, car(cdr(args)));
+    if(typeOf(target) == T_VARREF) {
+        compileVarRef(c, target, true);
+    } else {
+        compileSymbol(c, target, true);
+    }
+    return true;
+}
+
+// (cond (test value)...) evaluates the first value whose test is not false or null
+bool compileCond(Compiler* c, Obj* clauses, bool tail) {
+    for(Obj* p = clauses; p != nullObj; p = cdr(p)) {
+        if(typeOf(car(p)) != T_CONS) return false;
+    }
+    std::vector<size_t> ends;
+    for(Obj* p = clauses; p != nullObj; p = cdr(p)) {
+        Obj* item = car(p);
+        compileExpr(c, car(item));
+        size_t next = emitJump(c, OP_JUMPIFNOT);
+        adjustDepth(c, -1);
+        compileExpr(c, cdr(item) != nullObj ? car(cdr(item)) : nullObj, tail);
+        ends.push_back(emitJump(c, OP_JUMP));
+        adjustDepth(c, -1);
+        patchJump(c, next);
+    }
+    emitConst(c, nullObj);
+    for(size_t at : ends) {
+        patchJump(c, at);
+    }
+    return true;
+}
+
+void compileIf(Compiler* c, Obj* args, bool tail) {
+    compileExpr(c, car(args));
+    size_t elseJump = emitJump(c, OP_JUMPIFNOT);
+    adjustDepth(c, -1);
+    compileExpr(c, car(cdr(args)), tail);
+    size_t endJump = emitJump(c, OP_JUMP);
+    adjustDepth(c, -1);
+    patchJump(c, elseJump);
+    compileExpr(c, car(cdr(cdr(args))), tail);
+    patchJump(c, endJump);
+}
+
+void compileWhile(Compiler* c, Obj* args) {
+    size_t loop = c->ops.size();
+    compileExpr(c, car(args));
+    size_t exitJump = emitJump(c, OP_JUMPIFNOTTRUE);
+    adjustDepth(c, -1);
+    compileExpr(c, car(cdr(args)));
+    emit(c, OP_POP);
+    adjustDepth(c, -1);
+    emit(c, OP_JUMP);
+    emit(c, loop);
+    patchJump(c, exitJump);
+    emitConst(c, nullObj);
+}
+
+bool compileLambda(Compiler* c, Obj* args) {
+    Obj* proto;
+    if(typeOf(car(args)) == T_LAMBDA) {
+        proto = car(args);
+    } else if(!c->fn) {
+        // top level lambdas are resolved against the env they will close over
+        proto = makeLambdaIn(c->env, args);
+    } else {
+        return false;
+    }
+    c->needsEnv = true;
+    emit(c, OP_LAMBDA);
+    emit(c, addConst(c, proto));
+    adjustDepth(c, 1);
+    return true;
+}
+
+OpCode inlineOp(Builtin builtin, int64_t* arity) {
+    struct { Builtin builtin; OpCode op; int64_t arity; } ops[] = {
+        { builtin_add, OP_ADD, 2 }, { builtin_sub, OP_SUB, 2 },
+        { builtin_mul, OP_MUL, 2 }, { builtin_div, OP_DIV, 2 },
+        { builtin_eq, OP_EQ, 2 }, { builtin_neq, OP_NEQ, 2 },
+        { builtin_lt, OP_LT, 2 }, { builtin_gt, OP_GT, 2 },
+        { builtin_lte, OP_LTE, 2 }, { builtin_gte, OP_GTE, 2 },
+        { builtin_car, OP_CAR, 1 }, { builtin_cdr, OP_CDR, 1 },
+        { builtin_cons, OP_CONS, 2 },
+    };
+    for(auto& op : ops) {
+        if(op.builtin == builtin) {
+            *arity = op.arity;
+            return op.op;
+        }
+    }
+    return OP_COUNT;
+}
+
+// compile a special form inline, false falls back to OP_SPECIAL
+bool compileSpecialForm(Compiler* c, Obj* fn, Obj* args, bool tail) {
+    SpecialForm form = fn->v_builtin.form;
+    int64_t argc = list_length(args);
+    if(fn->fn_param_count != -1 && argc != fn->fn_param_count) {
+        return false; // let apply_function report the arity error at runtime
+    }
+    if(form == builtin_quote) {
+        emitConst(c, car(args));
+        return true;
+    }
+    if(form == builtin_setq) return compileSetq(c, args);
+    if(form == builtin_cond) return compileCond(c, args, tail);
+    if(form == builtin_lambda) return compileLambda(c, args);
+    if(form == builtin_if) {
+        compileIf(c, args, tail);
+        return true;
+    }
+    if(form == builtin_progn) {
+        compileProgn(c, args, tail);
+        return true;
+    }
+    if(form == builtin_while) {
+        compileWhile(c, args);
+        return true;
+    }
+    return false;
+}
+
+// a call in tail position reuses the caller's frame
+void compileForm(Compiler* c, Obj* x, bool tail) {
+    Obj* args = cdr(x);
+    Obj* sym = calleeSymbol(c, car(x));
+    Obj* fn = sym ? sym->v_global : nullptr;
+    if(fn && typeOf(fn) == T_MACRO) {
+        c->needsEnv = true;
+        emit(c, tail ? OP_TAILMACRO : OP_MACRO);
+        emit(c, addConst(c, x));
+        emit(c, addSlots(c, 2));
+        adjustDepth(c, 1);
+        return;
+    }
+    int64_t argc = list_length(args);
+    if(fn && typeOf(fn) == T_BUILTIN) {
+        Builtin builtin = fn->v_builtin.ptr;
+        if(fn->v_builtin.form) {
+            if(!compileSpecialForm(c, fn, args, tail)) {
+                compileSpecial(c, fn, args);
+            }
+            return;
+        }
+        int64_t arity;
+        OpCode op = inlineOp(builtin, &arity);
+        if(op != OP_COUNT && argc == arity) {
+            for(Obj* p = args; p != nullObj; p = cdr(p)) {
+                compileExpr(c, car(p));
+            }
+            emit(c, op);
+            emit(c, addConst(c, sym));
+            emit(c, addConst(c, fn));
+            adjustDepth(c, 1 - arity);
+            return;
+        }
+        if(readsCallerEnv(builtin)) {
+            c->needsEnv = true;
+        }
+    }
+    if(argc < 0) {
+        compileSpecial(c, fn ? fn : car(x), args); // improper argument list, fails at runtime
+        return;
+    }
+    if(!sym) {
+        compileExpr(c, car(x));
+    }
+    for(Obj* p = args; p != nullObj; p = cdr(p)) {
+        compileExpr(c, car(p));
+    }
+    if(sym) {
+        emit(c, tail ? OP_TAILCALLGLOBAL : OP_CALLGLOBAL);
+        emit(c, addConst(c, sym));
+        emit(c, argc);
+        adjustDepth(c, 1 - argc);
+    } else {
+        emit(c, tail ? OP_TAILCALL : OP_CALL);
+        emit(c, argc);
+        adjustDepth(c, -argc);
+    }
+}
+
+void compileExpr(Compiler* c, Obj* x, bool tail) {
+    if(!x) {
+        x = nullObj;
+    }
+    switch(typeOf(x)) {
+        case T_SYMBOL: compileSymbol(c, x, false); break;
+        case T_VARREF: compileVarRef(c, x, false); break;
+        case T_CONS: compileForm(c, x, tail); break;
+        default: emitConst(c, x); break;
+    }
+}
+
+Obj* finishCode(Compiler* c) {
+    emit(c, OP_RETURN);
+    Obj* code = makeObj(T_CODE);
+    code->v_code.ops = static_cast<intptr_t*>(::malloc(c->ops.size() * sizeof(intptr_t)));
+    code->v_code.consts = static_cast<Obj**>(::malloc((c->consts.size() + 1) * sizeof(Obj*)));
+    ::memcpy(code->v_code.ops, c->ops.data(), c->ops.size() * sizeof(intptr_t));
+    ::memcpy(code->v_code.consts, c->consts.data(), c->consts.size() * sizeof(Obj*));
+    code->v_code.nops = c->ops.size();
+    code->v_code.nconsts = c->consts.size();
+    code->v_code.maxStack = c->maxDepth + 1;
+    code->v_code.needsEnv = c->heapEnv;
+    return code;
+}
+
+Obj* compileFunction(Obj* fn) {
+    Obj* body = fn->type == T_LAMBDA ? fn->v_lambda.body : fn->v_function.body;
+    {
+        // locals stay on the vm stack unless the body needs a real env frame
+        Compiler c(fn, nullptr, false);
+        compileProgn(&c, body, true);
+        if(!c.needsEnv) {
+            fn->fn_code = finishCode(&c);
+            return fn->fn_code;
+        }
+    }
+    Compiler c(fn, nullptr, true);
+    compileProgn(&c, body, true);
+    fn->fn_code = finishCode(&c);
+    return fn->fn_code;
+}
+
+Obj* compileToplevel(Obj* env, Obj* x) {
+    Compiler c(nullptr, env, true);
+    compileExpr(&c, x, true);
+    return finishCode(&c);
+}
+
+// virtual machine
+
+void vmInit() {
+    // room for recursionLimit nested calls plus the base and entry frames
+    size_t frames = interp->recursionLimit + 2;
+    size_t slots = std::max<size_t>(VM_MIN_STACK_SIZE, interp->recursionLimit * VM_SLOTS_PER_FRAME);
+    interp->vm.stack = static_cast<Obj**>(::malloc(slots * sizeof(Obj*)));
+    interp->vm.frames = static_cast<VMFrame*>(::malloc(frames * sizeof(VMFrame)));
+    if(!interp->vm.stack || !interp->vm.frames) {
+        ::fprintf(stderr, "MemoryError: can't allocate the vm stack\n");
+        ::exit(-1);
+    }
+    interp->vm.end = interp->vm.stack + slots;
+    interp->vm.sp = interp->vm.high = interp->vm.stack;
+    interp->vm.framesEnd = interp->vm.frames + frames;
+    interp->vm.fp = interp->vm.frames;
+    *interp->vm.fp = VMFrame { nullptr, nullptr, nullptr, interp->vm.stack, interp->vm.stack, nullptr, true };
+}
+
+void vmCheckStack(Obj* env, int64_t slots) {
+    if(interp->vm.fp + 1 >= interp->vm.framesEnd || interp->vm.sp + slots >= interp->vm.end) {
+        throw_error(env, "RecursionError: maximum recursion depth exceeded");
+    }
+}
+
+Obj* vmUnbound(Obj* env, Obj* symbol) {
+    // names created at runtime (setq in a macro expansion, eval) are not resolved
+    Obj** var = findVar(env, symbol);
+    if(!var || !*var) {
+        throw_error(env, "can't find symbol: %s", symbol->v_symbol);
+    }
+    return *var;
+}
+
+// set frame up to run fn on the argc arguments at the top of the stack
+void vmEnterFrame(VMFrame* frame, Obj* env, Obj* fn, int64_t argc) {
+    checkArity(env, fn, argc);
+    Obj* code = fn->fn_code ? fn->fn_code : compileFunction(fn);
+    if(!code->v_code.native && interp->jit.enabled) {
+        jitCount(code, fn->fn_name, "calls");
+    }
+    int64_t slots = fn->fn_slot_count;
+    vmCheckStack(env, slots - argc + code->v_code.maxStack);
+    Obj* up = fn->type == T_LAMBDA ? fn->v_lambda.env : interp->globalEnv;
+    frame->fn = fn;
+    frame->code = code;
+    frame->pc = code->v_code.ops;
+    frame->bp = interp->vm.sp - argc;
+    frame->env = up;
+    while(interp->vm.sp < frame->bp + slots) {
+        *interp->vm.sp++ = nullptr;
+    }
+    interp->vm.high = std::max(interp->vm.high, interp->vm.sp + code->v_code.maxStack);
+    if(code->v_code.needsEnv) {
+        Obj* names = fn->type == T_LAMBDA ? fn->v_lambda.params : fn->v_function.params;
+        Obj* frameEnv = makeEnv(up, names, slots);
+        ::memcpy(frameEnv->v_env.slots, frame->bp, argc * sizeof(Obj*));
+        frame->env = frameEnv;
+    }
+}
+
+void vmPushFrame(Obj* env, Obj* fn, int64_t argc, Obj** retSp, bool entry) {
+    vmCheckStack(env, 0);
+    VMFrame* frame = interp->vm.fp + 1;
+    frame->retSp = retSp;
+    frame->entry = entry;
+    vmEnterFrame(frame, env, fn, argc);
+    interp->vm.fp = frame;
+}
+
+// push a frame running compiled top level code in env
+void vmPushCode(Obj* env, Obj* code, bool entry) {
+    vmCheckStack(env, code->v_code.maxStack);
+    VMFrame* frame = interp->vm.fp + 1;
+    *frame = VMFrame { nullptr, code, code->v_code.ops, interp->vm.sp, interp->vm.sp, env, entry };
+    interp->vm.fp = frame;
+    interp->vm.high = std::max(interp->vm.high, interp->vm.sp + code->v_code.maxStack);
+}
+
+// the compiled expansion of a macro call. cache holds {binding, code} from the
+// last expansion and is reused while the head symbol stays bound to the same macro
+Obj* vmExpandMacro(Obj* env, Obj* form, Obj** cache) {
+    Obj* head = car(form);
+    Obj* sym = typeOf(head) == T_VARREF ? head->v_ref.symbol : head;
+    Obj* macro = sym->v_global;
+    if(cache[1] != nullObj && cache[0] == macro) {
+        STAT_ADD(macroCacheHits, 1);
+        Obj* code = cache[1];
+        if(!code->v_code.native && interp->jit.enabled) {
+            VMFrame* fp = interp->vm.fp;
+            jitCount(code, fp->fn ? fp->fn->fn_name : interp->symToplevel, "macro expansion runs");
+        }
+        return code;
+    }
+    Obj* expanded = form;
+    if(macro && typeOf(macro) == T_MACRO) {
+        expanded = optimizeCode(env, macroexpand(env, macro, cdr(form)));
+    }
+    Obj* code = compileToplevel(env, expanded);
+    cache[0] = macro;
+    cache[1] = code;
+    return code;
+}
+
+Obj* vmClosure(Obj* env, Obj* proto) {
+    if(!proto->fn_code) {
+        compileFunction(proto); // shared by every closure made from it
+    }
+    Obj* lambdaObj = makeObj(T_LAMBDA);
+    ::memcpy(lambdaObj, proto, objSize(T_LAMBDA));
+    lambdaObj->v_lambda.env = env;
+    return lambdaObj;
+}
+
+void vmCallError(Obj* env, Obj* fn) {
+    throw_error(env, "can't call type: %s(%s)", typeToString(typeOf(fn)).c_str(), toString(fn).c_str());
+}
+
+// jit: a template compiler from bytecode to x86-64. once a code object has
+// been called or looped jit.threshold times, each of its ops becomes the
+// machine code for vmRun's fast path on it, behind the same guards. when a
+// guard fails, native code stores the op's pc and the stack top and
+// returns, and vmRun carries on from there.
+// native code works on the vm stacks, holding in callee saved registers
+//   rbx  the value stack top     r12  frame->bp
+//   r13  the VMFrame             r14  &jit.exit
+// and moves between frames by itself: a call pushes the callee's frame and
+// jumps to its native code, a return pops back to the caller's. it only
+// returns to c++ from an entry frame, at a bailout, or into a frame without
+// native code, so lisp recursion doesn't take native stack.
+// helpers do allocation and the calls native code doesn't inline. a helper
+// never lets an exception unwind through native code: it parks it in
+// jit.error and returns 0, and the c++ code that entered native code
+// rethrows it
+
+enum JitBailout {
+    JIT_UNBOUND, JIT_REBOUND, JIT_OPERANDS, JIT_OVERFLOW, JIT_ZERO,
+};
+
+static const char* jitBailoutReasons[] = {
+    "unbound variable", "inlined builtin was rebound", "operand types",
+    "result overflows a fixnum", "division by zero",
+};
+
+// operand words after each opcode
+static const int opOperands[OP_COUNT] = {
+    1, 0, 2, 2, 3, 3, 1, 1, 1, 1, 1, 1, 1,
+    1, 2, 1, 2, 0, 1, 2, 2, 2,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2,
+};
+
+// native code runs outside green threads, whose stacks get copied around
+bool jitCanEnter() {
+    return !interp->scheduler.current;
+}
+
+typedef Obj*(*JitEnter)(VMFrame* frame, Obj** sp, JitExit* exit, const void* target);
+
+// run fp's native code from op index at. returns the result when an entry
+// frame returns, with vm.fp still that frame, or nullptr when native code
+// left vm.fp, its pc and vm.sp for vmRun to go on
+Obj* jitRun(VMFrame* fp, Obj** sp, size_t at) {
+    Jit& jit = interp->jit;
+    Obj* result = reinterpret_cast<JitEnter>(jit.enter)(fp, sp, &jit.exit, fp->code->v_code.native[at]);
+    if(result) return result;
+    if(jit.error) {
+        std::exception_ptr error = jit.error;
+        jit.error = nullptr;
+        std::rethrow_exception(error);
+    }
+    interp->vm.sp = jit.exit.sp;
+    fp = interp->vm.fp;
+    if(jit.log && jit.exit.reason >= 0 && jit.loggedBailouts.insert(std::make_pair(fp->pc, jit.exit.reason)).second) {
+        Obj* name = fp->fn ? fp->fn->fn_name : interp->symToplevel;
+        ::fprintf(stderr, "jit: bailout in %s at op %td: %s\n", toString(name).c_str(),
+            fp->pc - fp->code->v_code.ops, jitBailoutReasons[jit.exit.reason]);
+    }
+    return nullptr;
+}
+
+#define JIT_LEAVE reinterpret_cast<const void*>(1) // the vm runs the rest of the frame
+#define JIT_CALL reinterpret_cast<const void*>(2) // not a function: make an ordinary call
+
+// where native code goes once vm.fp runs other code: that code's native
+// code, or back to the vm. jit.exit.sp is the new stack top
+const void* jitTakeOver(VMFrame* fp) {
+    interp->jit.exit.sp = interp->vm.sp;
+    interp->jit.exit.reason = -1;
+    return fp->code->v_code.native && jitCanEnter() ? fp->code->v_code.native[0] : JIT_LEAVE;
+}
+
+// helpers native code calls, with vmRun's code for the op. resume is the
+// pc the caller goes on from once a frame pushed for a call returns
+const void* jitPushFrame(Obj* fn, int64_t argc, Obj** retSp, Obj** sp, const intptr_t* resume) {
+    try {
+        VMFrame* caller = interp->vm.fp;
+        caller->pc = resume;
+        interp->vm.sp = sp;
+        vmPushFrame(caller->env, fn, argc, retSp, false);
+        return jitTakeOver(interp->vm.fp);
+    } catch(...) {
+        interp->jit.error = std::current_exception();
+    }
+    return nullptr;
+}
+
+const void* jitPushMacro(Obj* form, Obj** cache, Obj** sp, const intptr_t* resume) {
+    try {
+        VMFrame* caller = interp->vm.fp;
+        caller->pc = resume;
+        interp->vm.sp = sp;
+        vmPushCode(caller->env, vmExpandMacro(caller->env, form, cache), false);
+        return jitTakeOver(interp->vm.fp);
+    } catch(...) {
+        interp->jit.error = std::current_exception();
+    }
+    return nullptr;
+}
+
+// a builtin, or an error for anything else that isn't a function
+Obj* jitCall(Obj* fn, int64_t argc, Obj** retSp, Obj** sp) {
+    try {
+        interp->vm.sp = sp;
+        VMFrame* caller = interp->vm.fp;
+        if(typeOf(fn) == T_BUILTIN && fn->v_builtin.ptr) {
+            checkArity(caller->env, fn, argc);
+            CallScope scope(fn->fn_name);
+            STAT_BUILTIN_CALL(fn);
+            Obj* result = fn->v_builtin.ptr(caller->env, argc, sp - argc);
+            interp->vm.sp = retSp;
+            return result;
+        }
+        vmCallError(caller->env, fn);
+    } catch(...) {
+        interp->jit.error = std::current_exception();
+    }
+    return nullptr;
+}
+
+const void* jitTailCall(Obj* fn, int64_t argc, Obj** sp) {
+    try {
+        if(typeOf(fn) != T_FUNCTION && typeOf(fn) != T_LAMBDA) return JIT_CALL;
+        VMFrame* fp = interp->vm.fp;
+        ::memmove(fp->bp, sp - argc, argc * sizeof(Obj*));
+        interp->vm.sp = fp->bp + argc;
+        vmEnterFrame(fp, fp->env, fn, argc);
+        return jitTakeOver(fp);
+    } catch(...) {
+        interp->jit.error = std::current_exception();
+    }
+    return nullptr;
+}
+
+const void* jitTailMacro(Obj* form, Obj** cache) {
+    try {
+        // as op_tailmacro does
+        VMFrame* fp = interp->vm.fp;
+        Obj* code = vmExpandMacro(fp->env, form, cache);
+        interp->vm.sp = fp->bp;
+        vmCheckStack(fp->env, code->v_code.maxStack);
+        fp->code = code;
+        fp->pc = code->v_code.ops;
+        interp->vm.high = std::max(interp->vm.high, interp->vm.sp + code->v_code.maxStack);
+        return jitTakeOver(fp);
+    } catch(...) {
+        interp->jit.error = std::current_exception();
+    }
+    return nullptr;
+}
+
+Obj* jitSpecial(Obj* fn, Obj* args, Obj** sp) {
+    try {
+        interp->vm.sp = sp;
+        return apply_function(interp->vm.fp->env, fn, args);
+    } catch(...) {
+        interp->jit.error = std::current_exception();
+    }
+    return nullptr;
+}
+
+Obj* jitName(Obj* symbol) {
+    try {
+        return vmUnbound(interp->vm.fp->env, symbol);
+    } catch(...) {
+        interp->jit.error = std::current_exception();
+    }
+    return nullptr;
+}
+
+Obj* jitSetName(Obj* symbol, Obj* value) {
+    try {
+        Obj* env = interp->vm.fp->env;
+        Obj** var = findVar(env, symbol);
+        if(var) {
+            *var = value;
+        } else {
+            addVar(env, symbol, value);
+        }
+        return value;
+    } catch(...) {
+        interp->jit.error = std::current_exception();
+    }
+    return nullptr;
+}
+
+Obj* jitClosure(Obj* proto) {
+    try {
+        return vmClosure(interp->vm.fp->env, proto);
+    } catch(...) {
+        interp->jit.error = std::current_exception();
+    }
+    return nullptr;
+}
+
+Obj* jitCons(Obj* head, Obj* tail) {
+    try {
+        return cons(head, tail);
+    } catch(...) {
+        interp->jit.error = std::current_exception();
+    }
+    return nullptr;
+}
+
+Obj* jitMakeFloat(double x) {
+    try {
+        return makeFloat(x);
+    } catch(...) {
+        interp->jit.error = std::current_exception();
+    }
+    return nullptr;
+}
+
+#if JIT_SUPPORTED
+
+// the emitters below run once per code object. they are marked cold so gcc
+// spends its inlining budget for this file on vmRun rather than on them
+
+enum JitReg {
+    JIT_RAX = 0, JIT_RCX = 1, JIT_RDX = 2, JIT_RBX = 3, JIT_RSP = 4, JIT_RSI = 6, JIT_RDI = 7, JIT_R8 = 8,
+    JIT_R12 = 12, JIT_R13 = 13, JIT_R14 = 14, JIT_R15 = 15,
+    JIT_SP = JIT_RBX, JIT_BP = JIT_R12, JIT_FRAME = JIT_R13, JIT_EXIT = JIT_R14,
+};
+
+// condition codes, and the opcodes of two-register alu instructions
+enum JitCond { JIT_O = 0x0, JIT_AE = 0x3, JIT_E = 0x4, JIT_NE = 0x5, JIT_A = 0x7,
+    JIT_L = 0xc, JIT_GE = 0xd, JIT_LE = 0xe, JIT_G = 0xf, JIT_ALWAYS = -1 };
+enum JitAlu { JIT_ADD = 0x01, JIT_AND = 0x21, JIT_SUB = 0x29, JIT_XOR = 0x31, JIT_CMP = 0x39, JIT_TEST = 0x85 };
+
+// an x86-64 emitter, just the instructions the op templates need. jumps are
+// rel32 fixups resolved once the whole code object is emitted
+struct JitAsm {
+    std::vector<uint8_t> buf;
+    std::vector<std::pair<size_t, intptr_t>> jumps; // fixup => op index it jumps to
+    std::vector<std::pair<size_t, std::pair<intptr_t, int>>> bailouts; // fixup => {op index, JitBailout}
+    std::vector<size_t> errors; // fixups jumping to the error exit
+
+    void byte(uint8_t b) {
+        buf.push_back(b);
+    }
+    void u32(uint32_t x) {
+        for(int i = 0; i < 4; i++) byte(x >> (8 * i));
+    }
+    void u64(uint64_t x) {
+        for(int i = 0; i < 8; i++) byte(x >> (8 * i));
+    }
+    void rex(bool wide, int reg, int rm) {
+        uint8_t prefix = 0x40 | (wide ? 8 : 0) | (reg & 8 ? 4 : 0) | (rm & 8 ? 1 : 0);
+        if(prefix != 0x40) byte(prefix);
+    }
+    // modrm for [base + disp32], and for a register operand
+    void mem(int reg, int base, int32_t disp) {
+        byte(0x80 | (reg & 7) << 3 | (base & 7));
+        if((base & 7) == JIT_RSP) byte(0x24);
+        u32(disp);
+    }
+    void regs(int reg, int rm) {
+        byte(0xc0 | (reg & 7) << 3 | (rm & 7));
+    }
+    void load(int dst, int base, int32_t disp) {
+        rex(true, dst, base);
+        byte(0x8b);
+        mem(dst, base, disp);
+    }
+    void store(int base, int32_t disp, int src) {
+        rex(true, src, base);
+        byte(0x89);
+        mem(src, base, disp);
+    }
+    void lea(int dst, int base, int32_t disp) {
+        rex(true, dst, base);
+        byte(0x8d);
+        mem(dst, base, disp);
+    }
+    void mov(int dst, int src) {
+        alu(0x89, dst, src);
+    }
+    void movImm(int dst, uint64_t imm) {
+        rex(true, 0, dst);
+        byte(0xb8 | (dst & 7));
+        u64(imm);
+    }
+    void movImm(int dst, const void* p) {
+        movImm(dst, reinterpret_cast<uint64_t>(p));
+    }
+    void alu(int op, int dst, int src) {
+        rex(true, src, dst);
+        byte(op);
+        regs(src, dst);
+    }
+    // add, or, and, sub, cmp with an immediate, by their /digit
+    void aluImm(int digit, int dst, int32_t imm) {
+        rex(true, 0, dst);
+        byte(0x81);
+        regs(digit, dst);
+        u32(imm);
+    }
+    void addImm(int dst, int32_t imm) {
+        aluImm(0, dst, imm);
+    }
+    void cmpByte(int base, int32_t disp, uint8_t imm) {
+        rex(false, 0, base);
+        byte(0x80);
+        mem(7, base, disp);
+        byte(imm);
+    }
+    void testFixnum(int reg) {
+        rex(true, 0, reg);
+        byte(0xf7);
+        regs(0, reg);
+        u32(1);
+    }
+    void cmpType(int obj, ObjType type) {
+        rex(false, 0, obj);
+        byte(0x81);
+        mem(7, obj, offsetof(Obj, type));
+        u32(type);
+    }
+    void imul(int dst, int src) {
+        rex(true, dst, src);
+        byte(0x0f);
+        byte(0xaf);
+        regs(dst, src);
+    }
+    void sar1(int reg) {
+        rex(true, 0, reg);
+        byte(0xd1);
+        regs(7, reg);
+    }
+    void idiv(int reg) {
+        byte(0x48); // cqo
+        byte(0x99);
+        rex(true, 0, reg);
+        byte(0xf7);
+        regs(7, reg);
+    }
+    void cmov(int cond, int dst, int src) {
+        rex(true, dst, src);
+        byte(0x0f);
+        byte(0x40 | cond);
+        regs(dst, src);
+    }
+    // sse2 on doubles: 0x10 loads, 0x58 adds, 0x59 multiplies, 0x5c subtracts
+    void sse(int op, int xmm, int base, int32_t disp) {
+        byte(0xf2);
+        rex(false, xmm, base);
+        byte(0x0f);
+        byte(op);
+        mem(xmm, base, disp);
+    }
+    void ucomisd(int a, int b) {
+        byte(0x66);
+        byte(0x0f);
+        byte(0x2e);
+        regs(a, b);
+    }
+    void push(int reg) {
+        rex(false, 0, reg);
+        byte(0x50 | (reg & 7));
+    }
+    void pop(int reg) {
+        rex(false, 0, reg);
+        byte(0x58 | (reg & 7));
+    }
+    void call(const void* fn) {
+        movImm(JIT_RAX, fn);
+        byte(0xff);
+        regs(2, JIT_RAX);
+    }
+    void jumpReg(int reg) {
+        rex(false, 0, reg);
+        byte(0xff);
+        regs(4, reg);
+    }
+    size_t jump(int cond) {
+        if(cond == JIT_ALWAYS) {
+            byte(0xe9);
+        } else {
+            byte(0x0f);
+            byte(0x80 | cond);
+        }
+        u32(0);
+        return buf.size() - 4;
+    }
+    void patch(size_t fixup, size_t target) {
+        int32_t rel = static_cast<int32_t>(target - (fixup + 4));
+        ::memcpy(&buf[fixup], &rel, 4);
+    }
+    void here(size_t fixup) {
+        patch(fixup, buf.size());
+    }
+    void jumpOp(int cond, intptr_t op) {
+        jumps.push_back(std::make_pair(jump(cond), op));
+    }
+    void bail(int cond, intptr_t op, int reason) {
+        bailouts.push_back(std::make_pair(jump(cond), std::make_pair(op, reason)));
+    }
+    void onError() {
+        alu(JIT_TEST, JIT_RAX, JIT_RAX);
+        errors.push_back(jump(JIT_E));
+    }
+    void pushValue(int reg) {
+        store(JIT_SP, 0, reg);
+        addImm(JIT_SP, 8);
+    }
+    // replace the two operands at the stack top with reg
+    void replacePair(int reg) {
+        store(JIT_SP, -16, reg);
+        addImm(JIT_SP, -8);
+    }
+    void leave() {
+        pop(JIT_R15);
+        pop(JIT_R14);
+        pop(JIT_R13);
+        pop(JIT_R12);
+        pop(JIT_RBX);
+        byte(0xc3);
+    }
+};
+
+// copy code into executable memory
+char* jitPlace(const std::vector<uint8_t>& code) {
+    Jit& jit = interp->jit;
+    size_t size = (code.size() + 15) & ~static_cast<size_t>(15);
+    if(static_cast<size_t>(jit.end - jit.next) < size) {
+        size_t chunk = std::max<size_t>(JIT_CHUNK_SIZE, size);
+        if(jit.codeBytes + chunk > JIT_MAX_CODE) return nullptr;
+        void* mapped = ::mmap(nullptr, chunk, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mapped == MAP_FAILED) return nullptr;
+        jit.chunks.push_back(std::make_pair(static_cast<char*>(mapped), chunk));
+        jit.next = static_cast<char*>(mapped);
+        jit.end = jit.next + chunk;
+        jit.codeBytes += chunk;
+    }
+    // pages are only writable while code is copied in
+    uintptr_t page = ::sysconf(_SC_PAGESIZE);
+    uintptr_t low = reinterpret_cast<uintptr_t>(jit.next) & ~(page - 1);
+    uintptr_t high = (reinterpret_cast<uintptr_t>(jit.next) + size + page - 1) & ~(page - 1);
+    if(::mprotect(reinterpret_cast<void*>(low), high - low, PROT_READ | PROT_WRITE)) return nullptr;
+    ::memcpy(jit.next, code.data(), code.size());
+    ::mprotect(reinterpret_cast<void*>(low), high - low, PROT_READ | PROT_EXEC);
+    char* placed = jit.next;
+    jit.next += size;
+    return placed;
+}
+
+// JitEnter(frame, sp, exit, target): save the registers native code keeps
+// its state in and jump to target. each code object's native code restores
+// them and returns by itself
+__attribute__((cold)) bool jitMakeTrampoline() {
+    JitAsm a;
+    a.push(JIT_RBX);
+    a.push(JIT_R12);
+    a.push(JIT_R13);
+    a.push(JIT_R14);
+    a.push(JIT_R15); // also keeps calls from native code 16 byte aligned
+    a.mov(JIT_FRAME, JIT_RDI);
+    a.mov(JIT_SP, JIT_RSI);
+    a.mov(JIT_EXIT, JIT_RDX);
+    a.load(JIT_BP, JIT_FRAME, offsetof(VMFrame, bp));
+    a.jumpReg(JIT_RCX);
+    interp->jit.enter = jitPlace(a.buf);
+    return interp->jit.enter != nullptr;
+}
+
+// the function about to be called at op at: the callee slot below the
+// arguments, or the global value of a symbol, bailing out while it is unbound
+__attribute__((cold)) void jitLoadCallee(JitAsm* a, const intptr_t* arg, Obj** consts, intptr_t op, intptr_t at, int64_t argc) {
+    if(op == OP_CALL || op == OP_TAILCALL) {
+        a->load(JIT_RDI, JIT_SP, -8 * (argc + 1));
+        return;
+    }
+    a->movImm(JIT_RAX, consts[arg[0]]);
+    a->load(JIT_RDI, JIT_RAX, offsetof(Obj, v_global));
+    a->alu(JIT_TEST, JIT_RDI, JIT_RDI);
+    a->bail(JIT_E, at, JIT_UNBOUND);
+}
+
+// after a helper that gave vm.fp other code to run: jump to its native
+// code, or return to the vm
+__attribute__((cold)) void jitEmitTakeOver(JitAsm* a) {
+    a->movImm(JIT_RCX, &interp->vm.fp);
+    a->load(JIT_FRAME, JIT_RCX, 0);
+    a->load(JIT_BP, JIT_FRAME, offsetof(VMFrame, bp));
+    a->load(JIT_SP, JIT_EXIT, offsetof(JitExit, sp));
+    a->movImm(JIT_RCX, JIT_LEAVE);
+    a->alu(JIT_CMP, JIT_RAX, JIT_RCX);
+    size_t leave = a->jump(JIT_E);
+    a->jumpReg(JIT_RAX);
+    a->here(leave);
+    a->alu(JIT_XOR, JIT_RAX, JIT_RAX);
+    a->leave();
+}
+
+// an entry frame returns to c++. others pop back to the caller, and go on
+// in its native code, or in the vm when it has none
+__attribute__((cold)) void jitEmitReturn(JitAsm* a) {
+    a->load(JIT_RAX, JIT_SP, -8);
+    a->cmpByte(JIT_FRAME, offsetof(VMFrame, entry), 0);
+    size_t entry = a->jump(JIT_NE);
+    a->load(JIT_SP, JIT_FRAME, offsetof(VMFrame, retSp));
+    a->addImm(JIT_FRAME, -static_cast<int32_t>(sizeof(VMFrame)));
+    a->movImm(JIT_RCX, &interp->vm.fp);
+    a->store(JIT_RCX, 0, JIT_FRAME);
+    a->pushValue(JIT_RAX);
+    a->load(JIT_BP, JIT_FRAME, offsetof(VMFrame, bp));
+    a->load(JIT_RCX, JIT_FRAME, offsetof(VMFrame, code));
+    a->load(JIT_RDX, JIT_RCX, offsetof(Obj, v_code.native));
+    a->alu(JIT_TEST, JIT_RDX, JIT_RDX);
+    size_t interpreted = a->jump(JIT_E);
+    // native[i] sits at the same offset in its array as ops[i] in theirs
+    a->load(JIT_RAX, JIT_FRAME, offsetof(VMFrame, pc));
+    a->load(JIT_RCX, JIT_RCX, offsetof(Obj, v_code.ops));
+    a->alu(JIT_SUB, JIT_RAX, JIT_RCX);
+    a->alu(JIT_ADD, JIT_RAX, JIT_RDX);
+    a->load(JIT_RAX, JIT_RAX, 0);
+    a->jumpReg(JIT_RAX);
+    a->here(interpreted);
+    a->store(JIT_EXIT, offsetof(JitExit, sp), JIT_SP);
+    a->movImm(JIT_RAX, static_cast<uint64_t>(-1));
+    a->store(JIT_EXIT, offsetof(JitExit, reason), JIT_RAX);
+    a->alu(JIT_XOR, JIT_RAX, JIT_RAX);
+    a->here(entry);
+    a->leave();
+}
+
+// call the builtin in rdi through jitCall and push what it returns
+__attribute__((cold)) void jitEmitCall(JitAsm* a, int64_t argc, int32_t retOffset) {
+    a->movImm(JIT_RSI, argc);
+    a->lea(JIT_RDX, JIT_SP, retOffset);
+    a->mov(JIT_RCX, JIT_SP);
+    a->call(reinterpret_cast<const void*>(jitCall));
+    a->onError();
+    a->lea(JIT_SP, JIT_SP, retOffset);
+    a->pushValue(JIT_RAX);
+}
+
+__attribute__((cold)) void jitSetBool(JitAsm* a, int cond) {
+    a->movImm(JIT_RAX, falseObj);
+    a->movImm(JIT_RDX, trueObj);
+    a->cmov(cond, JIT_RAX, JIT_RDX);
+}
+
+// the fast paths of the inlined builtins on the operands at the stack top
+__attribute__((cold)) void jitEmitInlined(JitAsm* a, intptr_t op, intptr_t at) {
+    if(op == OP_CAR || op == OP_CDR) {
+        a->load(JIT_RAX, JIT_SP, -8);
+        a->testFixnum(JIT_RAX);
+        a->bail(JIT_NE, at, JIT_OPERANDS);
+        a->cmpType(JIT_RAX, T_CONS);
+        a->bail(JIT_NE, at, JIT_OPERANDS);
+        a->load(JIT_RAX, JIT_RAX, op == OP_CAR ? offsetof(Obj, v_cons.head) : offsetof(Obj, v_cons.tail));
+        a->store(JIT_SP, -8, JIT_RAX);
+        return;
+    }
+    if(op == OP_CONS) {
+        a->load(JIT_RDI, JIT_SP, -16);
+        a->load(JIT_RSI, JIT_SP, -8);
+        a->call(reinterpret_cast<const void*>(jitCons));
+        a->onError();
+        a->replacePair(JIT_RAX);
+        return;
+    }
+    a->load(JIT_RAX, JIT_SP, -16);
+    a->load(JIT_RCX, JIT_SP, -8);
+    if(op == OP_EQ || op == OP_NEQ) {
+        // null, or two fixnums, compare by identity
+        a->movImm(JIT_RDX, nullObj);
+        a->alu(JIT_CMP, JIT_RAX, JIT_RDX);
+        size_t left = a->jump(JIT_E);
+        a->alu(JIT_CMP, JIT_RCX, JIT_RDX);
+        size_t right = a->jump(JIT_E);
+        a->mov(JIT_RDX, JIT_RAX);
+        a->alu(JIT_AND, JIT_RDX, JIT_RCX);
+        a->testFixnum(JIT_RDX);
+        a->bail(JIT_E, at, JIT_OPERANDS);
+        a->here(left);
+        a->here(right);
+        a->alu(JIT_CMP, JIT_RAX, JIT_RCX);
+        jitSetBool(a, op == OP_EQ ? JIT_E : JIT_NE);
+        a->replacePair(JIT_RAX);
+        return;
+    }
+    // two fixnums work on the tagged words: 2x+1 and 2y+1
+    a->mov(JIT_RDX, JIT_RAX);
+    a->alu(JIT_AND, JIT_RDX, JIT_RCX);
+    a->testFixnum(JIT_RDX);
+    size_t floats = a->jump(JIT_E);
+    switch(op) {
+        case OP_ADD:
+            a->addImm(JIT_RAX, -1);
+            a->alu(JIT_ADD, JIT_RAX, JIT_RCX);
+            a->bail(JIT_O, at, JIT_OVERFLOW);
+            break;
+        case OP_SUB:
+            a->alu(JIT_SUB, JIT_RAX, JIT_RCX);
+            a->bail(JIT_O, at, JIT_OVERFLOW);
+            a->addImm(JIT_RAX, 1);
+            break;
+        case OP_MUL:
+            a->sar1(JIT_RAX);
+            a->addImm(JIT_RCX, -1);
+            a->imul(JIT_RAX, JIT_RCX);
+            a->bail(JIT_O, at, JIT_OVERFLOW);
+            a->addImm(JIT_RAX, 1);
+            break;
+        case OP_DIV:
+            a->sar1(JIT_RAX);
+            a->sar1(JIT_RCX);
+            a->alu(JIT_TEST, JIT_RCX, JIT_RCX);
+            a->bail(JIT_E, at, JIT_ZERO);
+            a->idiv(JIT_RCX);
+            a->alu(JIT_ADD, JIT_RAX, JIT_RAX);
+            a->bail(JIT_O, at, JIT_OVERFLOW);
+            a->addImm(JIT_RAX, 1);
+            break;
+        default:
+            a->alu(JIT_CMP, JIT_RAX, JIT_RCX);
+            jitSetBool(a, op == OP_LT ? JIT_L : op == OP_GT ? JIT_G : op == OP_LTE ? JIT_LE : JIT_GE);
+            break;
+    }
+    a->replacePair(JIT_RAX);
+    size_t done = a->jump(JIT_ALWAYS);
+    a->here(floats);
+    if(op == OP_DIV) {
+        a->bail(JIT_ALWAYS, at, JIT_OPERANDS);
+        a->here(done);
+        return;
+    }
+    // else two floats
+    a->testFixnum(JIT_RAX);
+    a->bail(JIT_NE, at, JIT_OPERANDS);
+    a->testFixnum(JIT_RCX);
+    a->bail(JIT_NE, at, JIT_OPERANDS);
+    a->cmpType(JIT_RAX, T_FLOAT);
+    a->bail(JIT_NE, at, JIT_OPERANDS);
+    a->cmpType(JIT_RCX, T_FLOAT);
+    a->bail(JIT_NE, at, JIT_OPERANDS);
+    int32_t value = offsetof(Obj, v_float);
+    a->sse(0x10, 0, JIT_RAX, value);
+    if(op == OP_ADD || op == OP_SUB || op == OP_MUL) {
+        a->sse(op == OP_ADD ? 0x58 : op == OP_SUB ? 0x5c : 0x59, 0, JIT_RCX, value);
+        a->call(reinterpret_cast<const void*>(jitMakeFloat));
+        a->onError();
+    } else {
+        // a < b as b above a, so comparisons with nan come out false
+        a->sse(0x10, 1, JIT_RCX, value);
+        if(op == OP_LT || op == OP_LTE) {
+            a->ucomisd(1, 0);
+        } else {
+            a->ucomisd(0, 1);
+        }
+        jitSetBool(a, op == OP_LT || op == OP_GT ? JIT_A : JIT_AE);
+    }
+    a->replacePair(JIT_RAX);
+    a->here(done);
+}
+
+__attribute__((cold)) void jitEmit(Obj* code, JitAsm* a, std::vector<int32_t>* starts) {
+    const intptr_t* ops = code->v_code.ops;
+    Obj** consts = code->v_code.consts;
+    for(intptr_t at = 0; at < code->v_code.nops; at += 1 + opOperands[ops[at]]) {
+        intptr_t op = ops[at];
+        const intptr_t* arg = ops + at + 1;
+        (*starts)[at] = a->buf.size();
+        switch(op) {
+            case OP_CONST:
+                a->movImm(JIT_RAX, consts[arg[0]]);
+                a->pushValue(JIT_RAX);
+                break;
+            case OP_POP:
+                a->addImm(JIT_SP, -8);
+                break;
+            case OP_LOCAL:
+                a->load(JIT_RAX, JIT_BP, 8 * arg[0]);
+                a->alu(JIT_TEST, JIT_RAX, JIT_RAX);
+                a->bail(JIT_E, at, JIT_UNBOUND);
+                a->pushValue(JIT_RAX);
+                break;
+            case OP_SETLOCAL:
+                a->load(JIT_RAX, JIT_SP, -8);
+                a->store(JIT_BP, 8 * arg[0], JIT_RAX);
+                break;
+            case OP_ENVREF:
+            case OP_SETENV: {
+                a->load(JIT_RCX, JIT_FRAME, offsetof(VMFrame, env));
+                for(intptr_t d = arg[0]; d > 0; d--) {
+                    a->load(JIT_RCX, JIT_RCX, offsetof(Obj, v_env.up));
+                }
+                int32_t slot = offsetof(Obj, v_env.slots) + 8 * arg[1];
+                if(op == OP_SETENV) {
+                    a->load(JIT_RAX, JIT_SP, -8);
+                    a->store(JIT_RCX, slot, JIT_RAX);
+                    break;
+                }
+                a->load(JIT_RAX, JIT_RCX, slot);
+                a->alu(JIT_TEST, JIT_RAX, JIT_RAX);
+                a->bail(JIT_E, at, JIT_UNBOUND);
+                a->pushValue(JIT_RAX);
+                break;
+            }
+            case OP_GLOBAL:
+                a->movImm(JIT_RCX, consts[arg[0]]);
+                a->load(JIT_RAX, JIT_RCX, offsetof(Obj, v_global));
+                a->alu(JIT_TEST, JIT_RAX, JIT_RAX);
+                a->bail(JIT_E, at, JIT_UNBOUND);
+                a->pushValue(JIT_RAX);
+                break;
+            case OP_SETGLOBAL:
+                a->movImm(JIT_RCX, consts[arg[0]]);
+                a->load(JIT_RAX, JIT_SP, -8);
+                a->store(JIT_RCX, offsetof(Obj, v_global), JIT_RAX);
+                break;
+            case OP_JUMP:
+                a->jumpOp(JIT_ALWAYS, arg[0]);
+                break;
+            case OP_JUMPIFNOT:
+                a->addImm(JIT_SP, -8);
+                a->load(JIT_RAX, JIT_SP, 0);
+                a->movImm(JIT_RCX, falseObj);
+                a->alu(JIT_CMP, JIT_RAX, JIT_RCX);
+                a->jumpOp(JIT_E, arg[0]);
+                a->movImm(JIT_RCX, nullObj);
+                a->alu(JIT_CMP, JIT_RAX, JIT_RCX);
+                a->jumpOp(JIT_E, arg[0]);
+                break;
+            case OP_JUMPIFNOTTRUE:
+                a->addImm(JIT_SP, -8);
+                a->load(JIT_RAX, JIT_SP, 0);
+                a->movImm(JIT_RCX, trueObj);
+                a->alu(JIT_CMP, JIT_RAX, JIT_RCX);
+                a->jumpOp(JIT_NE, arg[0]);
+                break;
+            case OP_CALL:
+            case OP_CALLGLOBAL: {
+                int64_t argc = op == OP_CALL ? arg[0] : arg[1];
+                int32_t retOffset = -8 * (op == OP_CALL ? argc + 1 : argc);
+                jitLoadCallee(a, arg, consts, op, at, argc);
+                a->testFixnum(JIT_RDI);
+                size_t fixnum = a->jump(JIT_NE);
+                a->cmpType(JIT_RDI, T_FUNCTION);
+                size_t function = a->jump(JIT_E);
+                a->cmpType(JIT_RDI, T_LAMBDA);
+                size_t lambda = a->jump(JIT_E);
+                a->here(fixnum);
+                jitEmitCall(a, argc, retOffset);
+                size_t done = a->jump(JIT_ALWAYS);
+                a->here(function);
+                a->here(lambda);
+                a->movImm(JIT_RSI, argc);
+                a->lea(JIT_RDX, JIT_SP, retOffset);
+                a->mov(JIT_RCX, JIT_SP);
+                a->movImm(JIT_R8, ops + at + 1 + opOperands[op]);
+                a->call(reinterpret_cast<const void*>(jitPushFrame));
+                a->onError();
+                jitEmitTakeOver(a);
+                a->here(done);
+                break;
+            }
+            case OP_TAILCALL:
+            case OP_TAILCALLGLOBAL: {
+                int64_t argc = op == OP_TAILCALL ? arg[0] : arg[1];
+                jitLoadCallee(a, arg, consts, op, at, argc);
+                a->movImm(JIT_RSI, argc);
+                a->mov(JIT_RDX, JIT_SP);
+                a->call(reinterpret_cast<const void*>(jitTailCall));
+                a->onError();
+                a->movImm(JIT_RCX, JIT_CALL);
+                a->alu(JIT_CMP, JIT_RAX, JIT_RCX);
+                size_t ordinary = a->jump(JIT_E);
+                jitEmitTakeOver(a);
+                // a builtin in tail position returns to this frame like any call
+                a->here(ordinary);
+                jitLoadCallee(a, arg, consts, op, at, argc);
+                jitEmitCall(a, argc, -8 * (op == OP_TAILCALL ? argc + 1 : argc));
+                break;
+            }
+            case OP_RETURN:
+                jitEmitReturn(a);
+                break;
+            case OP_NAME: {
+                // the names of the frame's own env are searched inline, the
+                // rest of the chain through findVar
+                a->load(JIT_RCX, JIT_FRAME, offsetof(VMFrame, env));
+                a->load(JIT_RDX, JIT_RCX, offsetof(Obj, v_env.names));
+                a->lea(JIT_RCX, JIT_RCX, offsetof(Obj, v_env.slots));
+                a->movImm(JIT_RSI, consts[arg[0]]);
+                a->movImm(JIT_R8, nullObj);
+                size_t loop = a->buf.size();
+                a->alu(JIT_CMP, JIT_RDX, JIT_R8);
+                size_t missing = a->jump(JIT_E);
+                a->load(JIT_RAX, JIT_RDX, offsetof(Obj, v_cons.head));
+                a->alu(JIT_CMP, JIT_RAX, JIT_RSI);
+                size_t found = a->jump(JIT_E);
+                a->load(JIT_RDX, JIT_RDX, offsetof(Obj, v_cons.tail));
+                a->addImm(JIT_RCX, 8);
+                a->patch(a->jump(JIT_ALWAYS), loop);
+                a->here(found);
+                a->load(JIT_RAX, JIT_RCX, 0);
+                a->alu(JIT_TEST, JIT_RAX, JIT_RAX);
+                size_t bound = a->jump(JIT_NE);
+                a->here(missing);
+                a->mov(JIT_RDI, JIT_RSI);
+                a->call(reinterpret_cast<const void*>(jitName));
+                a->onError();
+                a->here(bound);
+                a->pushValue(JIT_RAX);
+                break;
+            }
+            case OP_SETNAME:
+                a->movImm(JIT_RDI, consts[arg[0]]);
+                a->load(JIT_RSI, JIT_SP, -8);
+                a->call(reinterpret_cast<const void*>(jitSetName));
+                a->onError();
+                break;
+            case OP_LAMBDA:
+                a->movImm(JIT_RDI, consts[arg[0]]);
+                a->call(reinterpret_cast<const void*>(jitClosure));
+                a->onError();
+                a->pushValue(JIT_RAX);
+                break;
+            case OP_MACRO:
+                a->movImm(JIT_RDI, consts[arg[0]]);
+                a->movImm(JIT_RSI, consts + arg[1]);
+                a->mov(JIT_RDX, JIT_SP);
+                a->movImm(JIT_RCX, ops + at + 1 + opOperands[op]);
+                a->call(reinterpret_cast<const void*>(jitPushMacro));
+                a->onError();
+                jitEmitTakeOver(a);
+                break;
+            case OP_TAILMACRO:
+                a->movImm(JIT_RDI, consts[arg[0]]);
+                a->movImm(JIT_RSI, consts + arg[1]);
+                a->call(reinterpret_cast<const void*>(jitTailMacro));
+                a->onError();
+                jitEmitTakeOver(a);
+                break;
+            case OP_SPECIAL:
+                a->movImm(JIT_RDI, consts[arg[0]]);
+                a->movImm(JIT_RSI, consts[arg[1]]);
+                a->mov(JIT_RDX, JIT_SP);
+                a->call(reinterpret_cast<const void*>(jitSpecial));
+                a->onError();
+                a->pushValue(JIT_RAX);
+                break;
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+            case OP_LT: case OP_GT: case OP_LTE: case OP_GTE:
+            case OP_EQ: case OP_NEQ:
+            case OP_CAR: case OP_CDR: case OP_CONS:
+                // the guard vmRun checks: sym is still bound to the builtin
+                a->movImm(JIT_RCX, consts[arg[0]]);
+                a->load(JIT_RAX, JIT_RCX, offsetof(Obj, v_global));
+                a->movImm(JIT_RCX, consts[arg[1]]);
+                a->alu(JIT_CMP, JIT_RAX, JIT_RCX);
+                a->bail(JIT_NE, at, JIT_REBOUND);
+                jitEmitInlined(a, op, at);
+                break;
+        }
+    }
+}
+
+__attribute__((cold)) void jitCompile(Obj* code, Obj* name, const char* counted) {
+    Jit& jit = interp->jit;
+    int32_t nops = code->v_code.nops;
+    JitAsm a;
+    std::vector<int32_t> starts(nops, -1);
+    jitEmit(code, &a, &starts);
+    for(auto& jump : a.jumps) {
+        a.patch(jump.first, starts[jump.second]);
+    }
+    // one exit stub per op and reason, leaving the stack top, the op's pc and
+    // the reason behind for vmRun
+    std::map<std::pair<intptr_t, int>, size_t> stubs;
+    for(auto& bailout : a.bailouts) {
+        auto stub = stubs.find(bailout.second);
+        if(stub == stubs.end()) {
+            stub = stubs.insert(std::make_pair(bailout.second, a.buf.size())).first;
+            a.store(JIT_EXIT, offsetof(JitExit, sp), JIT_SP);
+            a.movImm(JIT_RAX, bailout.second.second);
+            a.store(JIT_EXIT, offsetof(JitExit, reason), JIT_RAX);
+            a.movImm(JIT_RAX, code->v_code.ops + bailout.second.first);
+            a.store(JIT_FRAME, offsetof(VMFrame, pc), JIT_RAX);
+            a.alu(JIT_XOR, JIT_RAX, JIT_RAX);
+            a.leave();
+        }
+        a.patch(bailout.first, stub->second);
+    }
+    size_t errorExit = a.buf.size();
+    a.alu(JIT_XOR, JIT_RAX, JIT_RAX);
+    a.leave();
+    for(size_t error : a.errors) {
+        a.patch(error, errorExit);
+    }
+    char* placed = jit.enter || jitMakeTrampoline() ? jitPlace(a.buf) : nullptr;
+    if(!placed) {
+        jit.enabled = false;
+        if(jit.log) ::fprintf(stderr, "jit: out of code memory, nothing more gets compiled\n");
+        return;
+    }
+    void** native = static_cast<void**>(::calloc(nops, sizeof(void*)));
+    for(int32_t i = 0; i < nops; i++) {
+        if(starts[i] >= 0) native[i] = placed + starts[i];
+    }
+    code->v_code.native = native;
+    if(jit.log) {
+        ::fprintf(stderr, "jit: compiled %s after %u %s, %d ops to %zu bytes\n", toString(name).c_str(),
+            code->v_code.hotness, counted, nops, a.buf.size());
+    }
+}
+
+#else
+
+void jitCompile(Obj* code, Obj* name, const char* counted) {
+    interp->jit.enabled = false;
+}
+
+#endif
+
+// count a call of code, or an iteration of a loop in it, and compile it
+// once that makes it hot
+void jitCount(Obj* code, Obj* name, const char* counted) {
+    if(++code->v_code.hotness >= interp->jit.threshold) {
+        jitCompile(code, name, counted);
+    }
+}
+
+Obj* vmRun() {
+    static void* dispatch[OP_COUNT] = {
+        &&op_const, &&op_pop, &&op_local, &&op_setlocal, &&op_envref, &&op_setenv,
+        &&op_global, &&op_setglobal, &&op_name, &&op_setname,
+        &&op_jump, &&op_jumpifnot, &&op_jumpifnottrue,
+        &&op_call, &&op_callglobal, &&op_tailcall, &&op_tailcallglobal,
+        &&op_return, &&op_lambda, &&op_macro, &&op_tailmacro, &&op_special,
+        &&op_add, &&op_sub, &&op_mul, &&op_div, &&op_eq, &&op_neq,
+        &&op_lt, &&op_gt, &&op_lte, &&op_gte, &&op_car, &&op_cdr, &&op_cons,
+    };
+    VMFrame* fp;
+    Obj** sp;
+    const intptr_t* pc;
+    const intptr_t* ops;
+    Obj** consts;
+    Obj** bp;
+    Obj* env;
+    Obj* fn;
+    Obj** retSp;
+    int64_t argc;
+    int64_t product;
+
+#define VM_LOAD() (fp = interp->vm.fp, sp = interp->vm.sp, pc = fp->pc, ops = fp->code->v_code.ops, \
+    consts = fp->code->v_code.consts, bp = fp->bp, env = fp->env)
+#define VM_SYNC() (interp->vm.sp = sp, fp->pc = pc)
+#define NEXT() goto *dispatch[*pc++]
+
+#define VM_INT_OP(label, guard, result) \
+    label: { \
+        Obj* a = sp[-2]; \
+        Obj* b = sp[-1]; \
+        int64_t x = fixnumValue(a); \
+        int64_t y = fixnumValue(b); \
+        if(consts[pc[0]]->v_global == consts[pc[1]] && isFixnum(a) && isFixnum(b) && (guard)) { \
+            sp[-2] = (result); \
+            sp--; \
+            pc += 2; \
+            NEXT(); \
+        } \
+        argc = 2; \
+        goto slow_builtin; \
+    }
+
+    VM_LOAD();
+    NEXT();
+
+op_const:
+    *sp++ = consts[pc[0]];
+    pc += 1;
+    NEXT();
+op_pop:
+    sp--;
+    NEXT();
+op_local: {
+        Obj* v = bp[pc[0]];
+        *sp++ = v ? v : vmUnbound(env, consts[pc[1]]);
+        pc += 2;
+        NEXT();
+    }
+op_setlocal:
+    bp[pc[0]] = sp[-1];
+    pc += 2;
+    NEXT();
+op_envref: {
+        Obj* e = env;
+        for(intptr_t d = pc[0]; d > 0; d--) e = e->v_env.up;
+        Obj* v = e->v_env.slots[pc[1]];
+        *sp++ = v ? v : vmUnbound(env, consts[pc[2]]);
+        pc += 3;
+        NEXT();
+    }
+op_setenv: {
+        Obj* e = env;
+        for(intptr_t d = pc[0]; d > 0; d--) e = e->v_env.up;
+        e->v_env.slots[pc[1]] = sp[-1];
+        pc += 3;
+        NEXT();
+    }
+op_global: {
+        Obj* v = consts[pc[0]]->v_global;
+        *sp++ = v ? v : vmUnbound(env, consts[pc[0]]);
+        pc += 1;
+        NEXT();
+    }
+op_setglobal:
+    consts[pc[0]]->v_global = sp[-1];
+    pc += 1;
+    NEXT();
+op_name:
+    *sp++ = vmUnbound(env, consts[pc[0]]);
+    pc += 1;
+    NEXT();
+op_setname: {
+        VM_SYNC();
+        Obj** var = findVar(env, consts[pc[0]]);
+        if(var) {
+            *var = sp[-1];
+        } else {
+            addVar(env, consts[pc[0]], sp[-1]);
+        }
+        pc += 1;
+        NEXT();
+    }
+op_jump:
+    if(pc[0] < pc - ops && interp->jit.enabled) {
+        // a loop: count its iterations, and once it is compiled go round it natively
+        pc = ops + pc[0];
+        if(!fp->code->v_code.native) {
+            jitCount(fp->code, fp->fn ? fp->fn->fn_name : interp->symToplevel, "loop iterations");
+        }
+        if(fp->code->v_code.native && jitCanEnter()) goto enter_native;
+        NEXT();
+    }
+    pc = ops + pc[0];
+    NEXT();
+op_jumpifnot: {
+        Obj* v = *--sp;
+        pc = (v == falseObj || v == nullObj) ? ops + pc[0] : pc + 1;
+        NEXT();
+    }
+op_jumpifnottrue: {
+        Obj* v = *--sp;
+        pc = v != trueObj ? ops + pc[0] : pc + 1;
+        NEXT();
+    }
+op_call:
+    argc = pc[0];
+    pc += 1;
+    fn = sp[-argc - 1];
+    retSp = sp - argc - 1;
+    goto do_call;
+op_callglobal:
+    fn = consts[pc[0]]->v_global;
+    if(!fn) fn = vmUnbound(env, consts[pc[0]]);
+    argc = pc[1];
+    pc += 2;
+    retSp = sp - argc;
+    goto do_call;
+op_tailcall:
+    argc = pc[0];
+    pc += 1;
+    fn = sp[-argc - 1];
+    retSp = sp - argc - 1;
+    goto do_tailcall;
+op_tailcallglobal:
+    fn = consts[pc[0]]->v_global;
+    if(!fn) fn = vmUnbound(env, consts[pc[0]]);
+    argc = pc[1];
+    pc += 2;
+    retSp = sp - argc;
+do_tailcall:
+    if(typeOf(fn) == T_FUNCTION || typeOf(fn) == T_LAMBDA) {
+        // slide the arguments down over the current frame and reuse it
+        ::memmove(bp, sp - argc, argc * sizeof(Obj*));
+        sp = bp + argc;
+        VM_SYNC();
+        vmEnterFrame(fp, env, fn, argc);
+        VM_LOAD();
+        if(fp->code->v_code.native && jitCanEnter()) goto enter_native;
+        NEXT();
+    }
+    goto do_call;
+slow_builtin:
+    // an inlined builtin whose guard failed: call whatever the symbol holds now
+    fn = consts[pc[0]]->v_global;
+    if(!fn) fn = vmUnbound(env, consts[pc[0]]);
+    pc += 2;
+    retSp = sp - argc;
+do_call:
+    if(typeOf(fn) == T_FUNCTION || typeOf(fn) == T_LAMBDA) {
+        VM_SYNC();
+        vmPushFrame(env, fn, argc, retSp, false);
+        VM_LOAD();
+        if(fp->code->v_code.native && jitCanEnter()) goto enter_native;
+        NEXT();
+    }
+    if(typeOf(fn) == T_BUILTIN && fn->v_builtin.ptr) {
+        checkArity(env, fn, argc);
+        VM_SYNC();
+        CallRecord record { fn->fn_name, fp, interp->callTop };
+        std::atomic_signal_fence(std::memory_order_release);
+        interp->callTop = &record;
+        STAT_BUILTIN_CALL(fn);
+        Obj* result = fn->v_builtin.ptr(env, argc, sp - argc);
+        interp->callTop = record.up;
+        sp = retSp;
+        *sp++ = result;
+        if(interp->scheduler.suspending) {
+            // the builtin parked this green thread: hand its stacks back to runGreen
+            VM_SYNC();
+            return nullptr;
+        }
+        NEXT();
+    }
+    // macros and special forms can't be applied to evaluated arguments
+    vmCallError(env, fn);
+enter_native: {
+        // run the loaded frame natively from pc. native code may move on to
+        // other frames before an entry frame returns, or it bails out
+        Obj* result = jitRun(fp, sp, pc - ops);
+        VM_LOAD();
+        if(!result) NEXT();
+        sp = fp->bp;
+        *sp++ = result;
+    }
+op_return: {
+        Obj* result = sp[-1];
+        bool entry = fp->entry;
+        sp = fp->retSp;
+        interp->vm.fp = --fp;
+        if(entry) {
+            interp->vm.sp = sp;
+            return result;
+        }
+        *sp++ = result;
+        pc = fp->pc;
+        ops = fp->code->v_code.ops;
+        consts = fp->code->v_code.consts;
+        bp = fp->bp;
+        env = fp->env;
+        if(fp->code->v_code.native && jitCanEnter()) goto enter_native;
+        NEXT();
+    }
+op_lambda: {
+        VM_SYNC();
+        Obj* lambdaObj = vmClosure(env, consts[pc[0]]);
+        *sp++ = lambdaObj;
+        pc += 1;
+        NEXT();
+    }
+op_macro: {
+        VM_SYNC();
+        Obj* code = vmExpandMacro(env, consts[pc[0]], consts + pc[1]);
+        fp->pc = pc + 2;
+        vmPushCode(env, code, false);
+        VM_LOAD();
+        if(fp->code->v_code.native && jitCanEnter()) goto enter_native;
+        NEXT();
+    }
+op_tailmacro: {
+        // locals of a frame running a macro call live in its env, so the
+        // expansion can take over the frame
+        VM_SYNC();
+        Obj* code = vmExpandMacro(env, consts[pc[0]], consts + pc[1]);
+        interp->vm.sp = bp;
+        vmCheckStack(env, code->v_code.maxStack);
+        fp->code = code;
+        fp->pc = code->v_code.ops;
+        interp->vm.high = std::max(interp->vm.high, interp->vm.sp + code->v_code.maxStack);
+        VM_LOAD();
+        if(fp->code->v_code.native && jitCanEnter()) goto enter_native;
+        NEXT();
+    }
+op_special: {
+        VM_SYNC();
+        Obj* result = apply_function(env, consts[pc[0]], consts[pc[1]]);
+        *sp++ = result;
+        pc += 2;
+        NEXT();
+    }
+// sums and differences of two fixnums can't overflow an int64_t
+VM_INT_OP(op_add, true, makeInt(x + y))
+VM_INT_OP(op_sub, true, makeInt(x - y))
+VM_INT_OP(op_mul, !__builtin_mul_overflow(x, y, &product), makeInt(product))
+VM_INT_OP(op_div, y != 0, makeInt(x / y))
+VM_INT_OP(op_lt, true, toBoolObj(x < y))
+VM_INT_OP(op_gt, true, toBoolObj(x > y))
+VM_INT_OP(op_lte, true, toBoolObj(x <= y))
+VM_INT_OP(op_gte, true, toBoolObj(x >= y))
+op_eq:
+op_neq: {
+        bool isEq = pc[-1] == OP_EQ;
+        Obj* a = sp[-2];
+        Obj* b = sp[-1];
+        if(consts[pc[0]]->v_global == consts[pc[1]]) {
+            if(a == nullObj || b == nullObj) {
+                sp[-2] = toBoolObj((a == b) == isEq);
+                sp--;
+                pc += 2;
+                NEXT();
+            }
+            if(isFixnum(a) && isFixnum(b)) {
+                sp[-2] = toBoolObj((a == b) == isEq);
+                sp--;
+                pc += 2;
+                NEXT();
+            }
+        }
+        argc = 2;
+        goto slow_builtin;
+    }
+op_car:
+op_cdr: {
+        Obj* a = sp[-1];
+        if(consts[pc[0]]->v_global == consts[pc[1]] && typeOf(a) == T_CONS) {
+            sp[-1] = pc[-1] == OP_CAR ? car(a) : cdr(a);
+            pc += 2;
+            NEXT();
+        }
+        argc = 1;
+        goto slow_builtin;
+    }
+op_cons:
+    if(consts[pc[0]]->v_global == consts[pc[1]]) {
+        Obj* obj = cons(sp[-2], sp[-1]);
+        sp[-2] = obj;
+        sp--;
+        pc += 2;
+        NEXT();
+    }
+    argc = 2;
+    goto slow_builtin;
+
+#undef VM_INT_OP
+#undef NEXT
+#undef VM_SYNC
+#undef VM_LOAD
+}
+
+// run compiled top level code in env
+Obj* vmExecute(Obj* env, Obj* code) {
+    vmPushCode(env, code, true);
+    return vmRun();
+}
+
+// push the argc items of list onto the vm stack
+Obj** vmPushList(Obj* env, Obj* list, int64_t argc) {
+    vmCheckStack(env, argc);
+    Obj** argv = interp->vm.sp;
+    for(Obj* p = list; p != nullObj; p = cdr(p)) {
+        *interp->vm.sp++ = car(p);
+    }
+    interp->vm.high = std::max(interp->vm.high, interp->vm.sp);
+    return argv;
+}
+
+// call a function or macro with an argument list from c++
+Obj* vmApply(Obj* env, Obj* fn, Obj* args) {
+    int64_t argc = list_length(args);
+    Obj** retSp = vmPushList(env, args, argc);
+    vmPushFrame(env, fn, argc, retSp, true);
+    return vmRun();
 }
 
-Obj* builtin_println(Obj* env, Obj* x) {
-    builtin_print(env, x);
-    putchar('\n');
-    return nullObj;
+// call a function on argc arguments at argv from c++. arguments already at
+// the top of the vm stack are used where they are
+Obj* vmCall(Obj* env, Obj* fn, int64_t argc, Obj** argv) {
+    Obj** retSp = argv;
+    if(argv + argc != interp->vm.sp) {
+        vmCheckStack(env, argc);
+        retSp = interp->vm.sp;
+        interp->vm.sp = std::copy(argv, argv + argc, retSp);
+        interp->vm.high = std::max(interp->vm.high, interp->vm.sp);
+    }
+    vmPushFrame(env, fn, argc, retSp, true);
+    return vmRun();
 }
 
-#define binary_op(f, op) \
-Obj* builtin_##f(Obj* env, Obj* x) {    \
-    Obj* a = eval(env, car(x)); \
-    Obj* b = eval(env, car(cdr(x)));    \
-    if(::strcmp(#op, "+") == 0 && (a->type == T_STRING && b->type == T_STRING)) return makeString(strcat(a->v_str, b->v_str)); \
-    if(a->type == T_INT) {  \
-        if(b->type == T_INT) return makeInt(a->v_int op b->v_int);    \
-        else if(b->type == T_FLOAT) return makeFloat(static_cast<double>(a->v_int) op b->v_float);   \
-    } else if(a->type == T_FLOAT) { \
-        if(b->type == T_INT) return makeFloat(a->v_float op static_cast<double>(b->v_int));   \
-        else if(b->type == T_FLOAT) return makeFloat(a->v_float op b->v_float);  \
-    } \
-    throw_error(env, "TypeError: unsupported operand type(s) for %s: '%s' and '%s'", #op, typeToString(a->type).c_str(), typeToString(b->type).c_str()); \
-    return nullObj; \
-}
-
-binary_op(add, +);
-binary_op(sub, -);
-binary_op(mul, *);
-binary_op(div, /);
-
-Obj* builtin_list(Obj* env, Obj* x) {
-    return x;
+// evaluate a top level form with the selected evaluator
+Obj* evalTop(Obj* env, Obj* x) {
+    x = optimizeCode(env, x);
+    CallScope scope(interp->symToplevel);
+    if(!interp->vmEnabled) {
+        return eval(env, x);
+    }
+    Obj* code = compileToplevel(env, x);
+    return vmExecute(env, code);
 }
 
-Obj* builtin_car(Obj* env, Obj* x) {
-    return car(car(x));
+// green thread scheduling. a builtin that blocks parks the current thread
+// when its vm frames reach straight down to the builtin; under a native
+// caller (eval, a macro expansion, a builtin calling back into lisp) or
+// outside green threads it runs the other threads in place until it can go on
+void queuePush(ThreadQueue* q, GreenThread* t) {
+    t->next = nullptr;
+    if(q->tail) {
+        q->tail->next = t;
+    } else {
+        q->head = t;
+    }
+    q->tail = t;
 }
 
-Obj* builtin_cdr(Obj* env, Obj* x) {
-    return cdr(car(x));
+GreenThread* queuePop(ThreadQueue* q) {
+    GreenThread* t = q->head;
+    if(t) {
+        q->head = t->next;
+        if(!q->head) q->tail = nullptr;
+    }
+    return t;
 }
 
-Obj* builtin_cons(Obj* env, Obj* x) {
-    return cons(car(x), car(cdr(x)));
+void finishGreen(GreenThread* t) {
+    std::vector<GreenThread*>& threads = interp->scheduler.threads;
+    threads[t->index] = threads.back();
+    threads[t->index]->index = t->index;
+    threads.pop_back();
+    delete t;
 }
 
-Obj* builtin_progn(Obj* env, Obj* x) {
-    Obj* currentEnv = makeEnv(env, nullObj);
-    Obj* retObj = nullObj;
-    for(Obj* p = x; p != nullObj; p = cdr(p)) {
-        retObj = eval(currentEnv, car(p));
+// copy t's saved stacks back on top of the current ones
+void restoreGreen(Obj* env, GreenThread* t) {
+    Obj** base = interp->vm.sp;
+    VMFrame* fp = interp->vm.fp;
+    Obj* top = t->frames.back().code;
+    if(base + t->slots.size() + top->v_code.maxStack >= interp->vm.end || fp + t->frames.size() + 1 >= interp->vm.framesEnd) {
+        throw_error(env, "RecursionError: maximum recursion depth exceeded");
     }
-    return retObj;
+    std::copy(t->slots.begin(), t->slots.end(), base);
+    for(VMFrame& frame : t->frames) {
+        *++fp = frame;
+        fp->bp = base + (frame.bp - t->base);
+        fp->retSp = base + (frame.retSp - t->base);
+    }
+    interp->vm.sp = base + t->slots.size();
+    interp->vm.fp = fp;
+    interp->vm.high = std::max(interp->vm.high, interp->vm.sp + top->v_code.maxStack);
+    interp->vm.sp[-1] = t->value ? t->value : nullObj; // the result of the call it blocked in
+    t->value = nullptr;
+    t->slots.clear();
+    t->frames.clear();
 }
 
-Obj* builtin_setq(Obj* env, Obj* x) {
-    assert(car(x)->type == T_SYMBOL);
-    Obj* var = findVar(env, car(x));
-    Obj* obj = eval(env, car(cdr(x)));
-    if(var) {
-        var->v_cons.tail = obj;
+// run t until it finishes or parks, on top of the current vm stacks
+void runGreen(Obj* env, GreenThread* t) {
+    Scheduler& s = interp->scheduler;
+    GreenThread* current = s.current;
+    VMFrame* entryFrame = s.entryFrame;
+    CallRecord* callBase = s.callBase;
+    bool vmEnabled = interp->vmEnabled;
+    Obj** base = interp->vm.sp;
+    VMFrame* baseFp = interp->vm.fp;
+    s.current = t;
+    s.entryFrame = baseFp + 1;
+    s.callBase = interp->callTop;
+    interp->vmEnabled = true; // only vm stacks can be saved
+    try {
+        if(t->frames.empty()) {
+            Obj* args = t->args;
+            t->args = nullptr;
+            vmApply(interp->globalEnv, t->fn, args);
+        } else {
+            restoreGreen(env, t);
+            vmRun();
+        }
+    } catch(const LispError& e) {
+        interp->vm.sp = base;
+        interp->vm.fp = baseFp;
+        s.current = current;
+        s.entryFrame = entryFrame;
+        s.callBase = callBase;
+        s.suspending = false;
+        interp->vmEnabled = vmEnabled;
+        finishGreen(t);
+        throw;
+    }
+    if(s.suspending) {
+        s.suspending = false;
+        t->base = base;
+        t->slots.assign(base, interp->vm.sp);
+        t->frames.assign(baseFp + 1, interp->vm.fp + 1);
     } else {
-        addVar(env, car(x), obj);
+        finishGreen(t);
     }
-    return obj;
+    interp->vm.sp = base;
+    interp->vm.fp = baseFp;
+    s.current = current;
+    s.entryFrame = entryFrame;
+    s.callBase = callBase;
+    interp->vmEnabled = vmEnabled;
 }
 
-Obj* check_paramters(Obj* env, Obj* params) {
-    if(params == intern("null")) params = nullObj;
-    for(Obj* p = params; p != nullObj; p = cdr(p)) {
-        throw_error_assert(p->type == T_CONS, env, "parameter list is not a flat list");
-        throw_error_assert(car(p)->type == T_SYMBOL, env, "parameter must be a symbol");
+// whether the builtin running now may park the current thread: nothing but
+// vm frames between it and the thread's entry frame
+bool canSuspend() {
+    Scheduler& s = interp->scheduler;
+    if(!s.current || !interp->callTop || interp->callTop->up != s.callBase) return false;
+    for(VMFrame* f = interp->vm.fp; f > s.entryFrame; f--) {
+        if(f->entry) return false;
     }
-    return params;
+    return true;
 }
 
-Obj* builtin_defun(Obj* env, Obj* x) {
-    Obj* funcObj = makeObj(T_FUNCTION);
-    funcObj->fn_name = car(x);
-    funcObj->v_function.params = check_paramters(env, car(cdr(x)));
-    funcObj->fn_param_count = list_length(car(cdr(x)));
-    funcObj->v_function.body = cdr(cdr(x));
-    addVar(env, funcObj->fn_name, funcObj);
-    return funcObj;
+// park the current thread in q, or anywhere if q is nullptr. the builtin
+// returns right after, and the thread's stacks are saved once it has
+void suspendGreen(ThreadQueue* q) {
+    Scheduler& s = interp->scheduler;
+    if(q) queuePush(q, s.current);
+    s.suspending = true;
 }
 
-Obj* builtin_lambda(Obj* env, Obj* x) {
-    Obj* params = car(cdr(x));
-    if(params == intern("null")) {
-        params = nullObj;
+// run other threads in place until ready() holds
+template<typename F>
+void runGreenUntil(Obj* env, const char* name, F ready) {
+    while(!ready()) {
+        GreenThread* t = queuePop(&interp->scheduler.runnable);
+        if(!t) throw_error(env, "DeadlockError: %s() blocks forever, no green thread can run", name);
+        runGreen(env, t);
     }
-    Obj* lambdaObj = makeObj(T_LAMBDA);
-    lambdaObj->fn_name = intern("LAMBDA1");
-    lambdaObj->v_lambda.params = check_paramters(env, car(x));
-    lambdaObj->fn_param_count = list_length(car(x));
-    lambdaObj->v_lambda.body = cdr(x);
-    lambdaObj->v_lambda.env = env;
-    return lambdaObj;
 }
 
-Obj* builtin_defmacro(Obj* env, Obj* x) {
-    Obj* macroObj = makeObj(T_MACRO);
-    macroObj->fn_name = car(x);
-    macroObj->v_macro.params = check_paramters(env, car(cdr(x)));
-    macroObj->fn_param_count = list_length(car(cdr(x)));
-    macroObj->v_macro.body = cdr(cdr(x));
-    addVar(env, macroObj->fn_name, macroObj);
-    return macroObj;
+// (spawn fn args...) => the id of a new green thread calling (fn args...)
+Obj* builtin_spawn(Obj* env, int64_t argc, Obj** argv) {
+    throw_error_assert(argc > 0, env, "spawn() missing 1 required positional argument: 'fn'");
+    Obj* fn = argv[0];
+    if(typeOf(fn) != T_FUNCTION && typeOf(fn) != T_LAMBDA)
+        throw_error(env, "TypeError: spawn() argument must be a function, not '%s'", typeToString(typeOf(fn)).c_str());
+    checkArity(env, fn, argc - 1);
+    Obj* args = argList(argc - 1, argv + 1);
+    Scheduler& s = interp->scheduler;
+    GreenThread* t = new GreenThread();
+    t->id = ++s.nextId;
+    t->fn = fn;
+    t->args = args;
+    t->index = s.threads.size();
+    s.threads.push_back(t);
+    queuePush(&s.runnable, t);
+    return makeInt(t->id);
 }
 
-// (macroexpand '(F 1 2 3))
-Obj* builtin_macroexpand(Obj* env, Obj* x) {
-    return macroexpand(env, cdr(findVar(env, car(car(x)))), cdr(car(x)));
+// (yield) => null, once the other runnable threads had a turn
+Obj* builtin_yield(Obj* env, int64_t argc, Obj** argv) {
+    Scheduler& s = interp->scheduler;
+    if(canSuspend()) {
+        suspendGreen(&s.runnable);
+        return nullObj;
+    }
+    GreenThread* last = s.runnable.tail;
+    while(GreenThread* t = queuePop(&s.runnable)) {
+        bool done = t == last;
+        runGreen(env, t);
+        if(done) break;
+    }
+    return nullObj;
 }
 
-Obj* cloneObj(Obj* x) {
-    Obj* destObj = ::makeObj(x->type); 
-    ::memcpy(destObj, x, sizeof(Obj));
-    if(destObj->type == T_CONS) {
-        for(Obj* p = destObj; p != nullObj; p = cdr(p)) {
-            p->v_cons.head = cloneObj(car(p));
-        }
-    }
-    return destObj;
+// (chan) or (chan capacity) => a channel buffering up to capacity values, 1 by default
+Obj* builtin_chan(Obj* env, int64_t argc, Obj** argv) {
+    throw_error_assert(argc <= 1, env, "chan() takes at most 1 positional argument but %" PRId64 " were given", argc);
+    if(argc == 0) return makeChannel(1);
+    throw_error_assert(typeOf(argv[0]) == T_INT && intValue(argv[0]) >= 1, env,
+        "TypeError: chan() capacity must be a positive integer");
+    return makeChannel(intValue(argv[0]));
 }
 
-Obj* parse_quote() {
-    skipChar('\'');
-    Obj* quote = intern("quote");
-    return cons(quote, cons(parse(), nullObj));
+Obj* checkChannel(Obj* env, const char* name, Obj* x) {
+    if(typeOf(x) != T_CHANNEL)
+        throw_error(env, "TypeError: %s() argument must be a channel, not '%s'", name, typeToString(typeOf(x)).c_str());
+    return x;
 }
 
-Obj* builtin_quote(Obj* env, Obj* x)  {
-    return car(x);
+void channelPut(Channel* c, Obj* value) {
+    c->ring[(c->head + c->count) % c->ring.size()] = value;
+    c->count++;
 }
 
-Obj* builtin_cond(Obj* env, Obj* x) {
-    for(Obj* p = x; p != nullObj; p = cdr(p)) {
-        Obj* item = car(p);
-        Obj* cond = eval(env, car(item));
-        if(cond != falseObj && cond != nullObj) {
-            return eval(env, car(cdr(item)));
+// the oldest buffered value. the first blocked sender gets its value into the freed slot
+Obj* channelTake(Channel* c) {
+    Obj* value = c->ring[c->head];
+    c->head = (c->head + 1) % c->ring.size();
+    c->count--;
+    if(GreenThread* sender = queuePop(&c->senders)) {
+        channelPut(c, sender->value);
+        sender->value = nullObj;
+        sender->channel = nullptr;
+        queuePush(&interp->scheduler.runnable, sender);
+    }
+    return value;
+}
+
+// (send ch value) => null, once value is buffered or handed to a receiver.
+// blocks while ch is full
+Obj* builtin_send(Obj* env, int64_t argc, Obj** argv) {
+    Obj* ch = checkChannel(env, "send", argv[0]);
+    Obj* value = argv[1];
+    Channel* c = ch->v_channel.state;
+    if(GreenThread* receiver = queuePop(&c->receivers)) {
+        // receivers only wait on an empty buffer
+        receiver->value = value;
+        receiver->channel = nullptr;
+        queuePush(&interp->scheduler.runnable, receiver);
+        return nullObj;
+    }
+    if(c->count == c->ring.size()) {
+        if(canSuspend()) {
+            interp->scheduler.current->value = value;
+            interp->scheduler.current->channel = ch;
+            suspendGreen(&c->senders);
+            return nullObj;
         }
+        runGreenUntil(env, "send", [&] { return c->count < c->ring.size(); });
     }
+    channelPut(c, value);
     return nullObj;
 }
 
-Obj* builtin_if(Obj* env, Obj* x) {
-    Obj* test = eval(env, car(x));
-    Obj* thenBody = car(cdr(x));
-    Obj* elseBody = car(cdr(cdr(x)));
-    if(test == falseObj || test == nullObj) {
-        return eval(env, elseBody);
-    } else {
-        return eval(env, thenBody);
+// (recv ch) => the oldest value sent on ch, blocking while there is none
+Obj* builtin_recv(Obj* env, int64_t argc, Obj** argv) {
+    Obj* ch = checkChannel(env, "recv", argv[0]);
+    Channel* c = ch->v_channel.state;
+    if(c->count == 0) {
+        if(canSuspend()) {
+            interp->scheduler.current->channel = ch;
+            suspendGreen(&c->receivers);
+            return nullObj;
+        }
+        runGreenUntil(env, "recv", [&] { return c->count > 0; });
     }
+    return channelTake(c);
 }
 
-#define binary_logic_op(f, op) \
-Obj* builtin_##f(Obj* env, Obj* x) { \
-    Obj* a = car(x); \
-    Obj* b = car(cdr(x)); \
-    if((a == nullObj || b == nullObj) && (::strcmp(#op , "==") == 0 || ::strcmp(#op , "!=") == 0)) return toBoolObj(a op b); \
-    if(a->type == T_INT && b->type == T_INT) return toBoolObj(a->v_int op b->v_int); \
-    if(a->type == T_INT && b->type == T_FLOAT) return toBoolObj(static_cast<double>(a->v_int) op b->v_float); \
-    if(a->type == T_FLOAT && b->type == T_FLOAT) return toBoolObj(a->v_float op b->v_float); \
-    if(a->type == T_FLOAT && b->type == T_INT) return toBoolObj(a->v_float op static_cast<double>(b->v_int)); \
-    if(a->type == T_STRING && ::strcmp(#op , "==") == 0) return toBoolObj(::strcmp(a->v_str, b->v_str) == 0); \
-    if(a->type == T_STRING && ::strcmp(#op , "!=") == 0) return toBoolObj(::strcmp(a->v_str, b->v_str) != 0); \
-    if(a->type == T_SYMBOL && ::strcmp(#op , "==") == 0) return toBoolObj(::strcmp(a->v_symbol, b->v_symbol) == 0); \
-    if(a->type == T_SYMBOL && ::strcmp(#op , "!=") == 0) return toBoolObj(::strcmp(a->v_symbol, b->v_symbol) != 0); \
-    throw_error(env, "TypeError: '%s' not supported between instances of '%s' and '%s'", #f, typeToString(a->type).c_str(), typeToString(b->type).c_str()); \
-    return falseObj; \
+// sampling profiler: SIGPROF fires every PROFILE_INTERVAL_US of cpu time and
+// the handler copies the lisp call stack into preallocated buffers. nothing
+// is allocated or looked up until the report is built at exit
+#define PROFILE_INTERVAL_US 1000
+#define PROFILE_MAX_DEPTH 1024 // innermost frames kept per sample
+#define PROFILE_MAX_SAMPLES (1 << 20)
+#define PROFILE_BUFFER_NAMES (16 << 20)
+
+static struct {
+    Obj** names; // the stacks of all samples back to back, innermost first
+    uint32_t* depths;
+    size_t used;
+    size_t samples;
+    size_t dropped;
+    Interpreter* target; // samples of other threads, such as pmap workers, are ignored
+} profile;
+
+void profileSignal(int) {
+    if(!interp || interp != profile.target) return;
+    if(profile.samples == PROFILE_MAX_SAMPLES || profile.used + PROFILE_MAX_DEPTH > PROFILE_BUFFER_NAMES) {
+        profile.dropped++;
+        return;
+    }
+    Obj** stack = profile.names + profile.used;
+    size_t depth = callStackNames(stack, PROFILE_MAX_DEPTH);
+    if(depth == 0) {
+        stack[depth++] = interp->symToplevel; // parsing between top level forms
+    }
+    profile.depths[profile.samples++] = depth;
+    profile.used += depth;
 }
 
-binary_logic_op(eq, ==);
-binary_logic_op(neq, !=);
-binary_logic_op(gt, >);
-binary_logic_op(gte, >=);
-binary_logic_op(lt, <);
-binary_logic_op(lte, <=);
+void startProfile() {
+    profile.target = interp;
+    profile.names = static_cast<Obj**>(::malloc(PROFILE_BUFFER_NAMES * sizeof(Obj*)));
+    profile.depths = static_cast<uint32_t*>(::malloc(PROFILE_MAX_SAMPLES * sizeof(uint32_t)));
+    if(!profile.names || !profile.depths) {
+        ::fprintf(stderr, "MemoryError: can't allocate the profile buffers\n");
+        ::exit(-1);
+    }
+    struct sigaction action;
+    ::memset(&action, 0, sizeof(action));
+    action.sa_handler = profileSignal;
+    action.sa_flags = SA_RESTART;
+    ::sigemptyset(&action.sa_mask);
+    ::sigaction(SIGPROF, &action, nullptr);
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = PROFILE_INTERVAL_US;
+    timer.it_value = timer.it_interval;
+    ::setitimer(ITIMER_PROF, &timer, nullptr);
+}
 
-int64_t list_length(Obj* x) {
-    int64_t i = 0;
-    for(Obj* p = x; p != nullObj; p = cdr(p)) {
-        if(p->type != T_CONS) {
-            // is not a list
-            return -1;
+struct ProfileCount {
+    uint64_t flat; // samples with the function innermost
+    uint64_t cum; // samples with the function anywhere on the stack
+    size_t lastSample; // counts recursive calls once per sample
+};
+
+// stop sampling, print flat and cumulative counts to stderr and write the
+// stacks in the collapsed format flamegraph.pl and speedscope read
+void stopProfile(const char* foldedPath) {
+    struct itimerval timer;
+    ::memset(&timer, 0, sizeof(timer));
+    ::setitimer(ITIMER_PROF, &timer, nullptr);
+    ::signal(SIGPROF, SIG_IGN);
+
+    std::map<Obj*, ProfileCount> counts;
+    std::map<std::string, uint64_t> folded;
+    Obj** stack = profile.names;
+    for(size_t i = 0; i < profile.samples; stack += profile.depths[i++]) {
+        size_t depth = profile.depths[i];
+        counts[stack[0]].flat++;
+        std::string line = depth == PROFILE_MAX_DEPTH ? "[truncated]" : "";
+        for(size_t j = depth; j > 0; j--) {
+            ProfileCount& count = counts[stack[j - 1]];
+            if(count.cum == 0 || count.lastSample != i) {
+                count.cum++;
+                count.lastSample = i;
+            }
+            if(!line.empty()) line += ';';
+            line += callName(stack[j - 1]);
         }
-        i++;
+        folded[line]++;
     }
-    return i;
+
+    std::vector<std::pair<Obj*, ProfileCount> > rows(counts.begin(), counts.end());
+    std::sort(rows.begin(), rows.end(), [](const std::pair<Obj*, ProfileCount>& a, const std::pair<Obj*, ProfileCount>& b) {
+        return a.second.flat != b.second.flat ? a.second.flat > b.second.flat : a.second.cum > b.second.cum;
+    });
+    double total = std::max<size_t>(profile.samples, 1);
+    ::fprintf(stderr, "profile: %zu samples every %dus, %zu dropped\n", profile.samples, PROFILE_INTERVAL_US, profile.dropped);
+    ::fprintf(stderr, "%10s %7s %10s %7s  %s\n", "flat", "flat%", "cum", "cum%", "function");
+    for(size_t i = 0; i < rows.size() && i < 40; i++) {
+        const ProfileCount& count = rows[i].second;
+        ::fprintf(stderr, "%10" PRIu64 " %6.1f%% %10" PRIu64 " %6.1f%%  %s\n",
+            count.flat, 100.0 * count.flat / total, count.cum, 100.0 * count.cum / total, callName(rows[i].first));
+    }
+
+    FILE* file = ::fopen(foldedPath, "w");
+    if(!file) {
+        ::fprintf(stderr, "profile: can't write %s\n", foldedPath);
+        return;
+    }
+    for(auto& entry : folded) {
+        ::fprintf(file, "%s %" PRIu64 "\n", entry.first.c_str(), entry.second);
+    }
+    ::fclose(file);
+    ::fprintf(stderr, "profile: collapsed stacks written to %s\n", foldedPath);
 }
 
-bool is_list(Obj* x) {
-    return list_length(x) != -1;
+void internWellKnownSymbols() {
+    interp->symQuote = intern("quote");
+    interp->symNull = intern("null");
+    interp->symTrue = intern("true");
+    interp->symFalse = intern("false");
+    interp->symLambda = intern("LAMBDA1");
+    interp->symToplevel = intern("<toplevel>");
+    interp->symGC = intern("<gc>");
+    for(int type = T_NULL; type <= T_FREE; type++) {
+        interp->typeSymbols[type] = intern(typeToString(static_cast<ObjType>(type)).c_str());
+    }
 }
 
-Obj* builtin_length(Obj* env, Obj* x)  {
-    return makeInt(list_length(car(x)));
+// a fresh interpreter, or the one saved in imagePath
+void init(const char* imagePath) {
+    if(imagePath) {
+        loadImage(imagePath);
+    } else {
+        interp->globalEnv = makeEnv(nullObj, nullObj, 0);
+        interp->modules = nullObj;
+    }
+    vmInit();
+    internWellKnownSymbols();
+    if(!imagePath) {
+        defineBuiltins(interp->globalEnv);
+        loadModule(interp->globalEnv, "./lib.lisp");
+    }
 }
 
-Obj* builtin_eval(Obj* env, Obj* x) {
-    x = car(x);
-    if(x->type == T_STRING) {
-        run_before(std::string(x->v_str));
-        return run(env);
+void repl() {
+    std::string input;
+    for(;;) {
+        std::cout << ">>> ";
+        std::getline(std::cin, input, '\n');
+        if(std::cin.eof()) break;
+        Parser parser(input);
+        print(run(interp->globalEnv, &parser));
+        std::cout << std::endl;
     }
-    return eval(env, x);
 }
 
-Obj* builtin_import(Obj* env, Obj* x) {
-    throw_error_assert(car(x)->type == T_STRING, env, "import() parameter type must be string");
-    loadModule(env, std::string(car(x)->v_str));
-    return nullObj;
+// parse sizes like 64M, 512K or 1G
+size_t parseSize(const char* str) {
+    char* end = nullptr;
+    size_t size = ::strtoull(str, &end, 10);
+    switch(*end) {
+        case 'k': case 'K': size <<= 10; break;
+        case 'm': case 'M': size <<= 20; break;
+        case 'g': case 'G': size <<= 30; break;
+        default: break;
+    }
+    return size;
 }
 
-Obj* builtin_while(Obj* env, Obj* x) {
-    while(eval(env, car(x)) == trueObj) {
-        eval(env, car(cdr(x)));
+// native stack the calling thread has left below bottom, less headroom
+uintptr_t threadStackLeft(uintptr_t bottom) {
+    const uintptr_t headroom = 256 * 1024;
+    pthread_attr_t attr;
+    void* low;
+    size_t size;
+    if(::pthread_getattr_np(::pthread_self(), &attr) != 0) return 0;
+    ::pthread_attr_getstack(&attr, &low, &size);
+    ::pthread_attr_destroy(&attr);
+    uintptr_t left = bottom - reinterpret_cast<uintptr_t>(low);
+    return left > 2 * headroom ? left - headroom : left / 2;
+}
+
+// usable native stack, leaving headroom for error reporting
+uintptr_t nativeStackSize() {
+    const uintptr_t headroom = 256 * 1024;
+    const uintptr_t fallback = 256 * 1024 * 1024; // when the stack is unlimited
+    struct rlimit limit;
+    uintptr_t size = fallback;
+    if(::getrlimit(RLIMIT_STACK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        size = limit.rlim_cur;
     }
-    return nullObj;
+    return size > 2 * headroom ? size - headroom : size / 2;
 }
 
-int objToStr(Obj* x, char* str) {
-    switch(x->type) {
-        case T_NULL: strcpy(str, "null"); return 4;
-        case T_INT: return sprintf(str, "%" PRId64, x->v_int);
-        case T_FLOAT: return sprintf(str, "%f", x->v_float);
-        case T_STRING: strcpy(str, x->v_str); break;
-        case T_BOOL: x->v_bool ? strcpy(str, "true") : strcpy(str, "false"); break;
-        case T_SYMBOL: strcpy(str, x->v_symbol); break;
-        case T_CONS: {
-            char* ptr = str;
-            *ptr++ = '(';
-            for(Obj* p = x; p != nullObj; p = cdr(p)) {
-                if(p->type == T_CONS) {
-                    ptr += objToStr(car(p), ptr);
-                    if(cdr(p) != nullObj) *ptr++ = ' ';
-                } else {
-                    *ptr++ = '.';
-                    *ptr++ = ' ';
-                    ptr += objToStr(p, ptr);
-                    break;
-                }
+// embedding api, declared in toylisp.h. an interpreter may move between
+// threads but is used by one thread at a time
+
+// makes ip the calling thread's interpreter, with bottom as the base of the
+// native stack its collections scan
+struct InterpreterScope {
+    Interpreter* saved;
+
+    InterpreterScope(Interpreter* ip, void* bottom) : saved(interp) {
+        interp = ip;
+        ip->embedded = true;
+        ip->gcStackBottom = reinterpret_cast<uintptr_t>(bottom);
+        ip->nativeStackLimit = threadStackLeft(ip->gcStackBottom);
+    }
+    ~InterpreterScope() {
+        interp->gcStackBottom = 0;
+        interp = saved;
+    }
+};
+
+// pmap, pfor-each and preduce split a list or vector into chunks and run fn
+// over them on a pool of worker threads. every worker has an interpreter of
+// its own with just the builtins: fn, the globals it reaches and the items
+// are copied into the worker's heap and the results are copied back in
+// order. side effects of fn stay in the worker, so fn should be pure
+#define PARALLEL_CHUNKS_PER_WORKER 4 // spare chunks for idle workers to steal
+
+enum ParallelKind { PARALLEL_MAP, PARALLEL_FOR_EACH, PARALLEL_REDUCE };
+
+// copies objects from another interpreter's heap, which must not change
+// meanwhile, into the current one. symbols are interned by name and, with
+// followGlobals, bring their global values along. compiled code is left
+// behind, so copied functions compile again on their first call
+struct HeapCopy {
+    std::unordered_map<Obj*, Obj*> copies;
+    std::vector<std::pair<Obj*, Obj*> > pending; // source and copy whose fields still point into the source
+    bool followGlobals;
+};
+
+Obj* heapCopyRef(HeapCopy* c, Obj* x) {
+    if(!x || isFixnum(x) || x == nullObj || x == trueObj || x == falseObj) return x;
+    if(x->type == T_CODE) return nullptr;
+    auto it = c->copies.find(x);
+    if(it != c->copies.end()) return it->second;
+    Obj* copy = nullptr;
+    bool fill = true;
+    if(x->type == T_SYMBOL) {
+        copy = intern(x->v_symbol);
+        fill = c->followGlobals && x->v_global;
+    } else if(x->type == T_BUILTIN) {
+        Obj* own = intern(x->fn_name->v_symbol)->v_global;
+        if(own && typeOf(own) == T_BUILTIN && own->v_builtin.ptr == x->v_builtin.ptr && own->v_builtin.form == x->v_builtin.form) {
+            copy = own;
+            fill = false;
+        }
+    }
+    if(!copy) {
+        copy = makeObjSized(x->type, objSizeOf(x));
+        ::memcpy(copy, x, objSizeOf(x));
+    }
+    c->copies[x] = copy;
+    if(fill) c->pending.push_back(std::make_pair(x, copy));
+    return copy;
+}
+
+// point the fields of the pending copies at copies of what they reach
+void heapCopyFields(HeapCopy* c) {
+    while(!c->pending.empty()) {
+        Obj* x = c->pending.back().first;
+        Obj* copy = c->pending.back().second;
+        c->pending.pop_back();
+        if(x->type == T_SYMBOL) {
+            copy->v_global = heapCopyRef(c, x->v_global);
+            continue;
+        }
+        forEachField(copy, [&](Obj*& field) { field = heapCopyRef(c, field); });
+        if(x->type == T_VECTOR) {
+            copy->v_vector.items = nullptr;
+            copy->v_vector.capacity = 0;
+            vectorReserve(copy, x->v_vector.capacity);
+            for(int64_t i = 0; i < x->v_vector.size; i++) {
+                copy->v_vector.items[i] = heapCopyRef(c, x->v_vector.items[i]);
             }
-            *ptr++ = ')';
-            break;
+        } else if(x->type == T_HASHMAP) {
+            // keys hash by content, so every entry keeps its slot
+            copy->v_hash.entries = static_cast<HashEntry*>(::calloc(x->v_hash.capacity, sizeof(HashEntry)));
+            if(!copy->v_hash.entries) {
+                ::fprintf(stderr, "MemoryError: out of memory\n");
+                ::exit(-1);
+            }
+            for(int64_t i = 0; i < x->v_hash.capacity; i++) {
+                const HashEntry& entry = x->v_hash.entries[i];
+                if(!entry.key) continue;
+                copy->v_hash.entries[i] = HashEntry { entry.hash, heapCopyRef(c, entry.key), heapCopyRef(c, entry.value) };
+            }
+        } else if(x->type == T_CHANNEL) {
+            copy->v_channel.state = newChannel(x->v_channel.capacity); // channels don't cross interpreters
         }
-        default: sprintf(str, "<%s>", typeToString(x->type).c_str()); break;
     }
-    return strlen(str);
 }
 
-void addBuiltin(Obj* env, const char* name, Builtin builtin, int64_t param_count) {
-    Obj* builtinObj = makeObj(T_BUILTIN);
-    builtinObj->fn_name = intern(name);
-    builtinObj->fn_param_count = param_count;
-    builtinObj->v_builtin.ptr = builtin;
-    addVar(env, builtinObj->fn_name, builtinObj);
+// a copy of x and everything it reaches. the copies point into the source
+// heap until their fields are filled in, so collection is off meanwhile
+Obj* heapCopy(HeapCopy* c, Obj* x) {
+    uintptr_t bottom = interp->gcStackBottom;
+    interp->gcStackBottom = 0;
+    Obj* copy = heapCopyRef(c, x);
+    heapCopyFields(c);
+    interp->gcStackBottom = bottom;
+    return copy;
 }
 
-void defineBuiltins(Obj* env) {
-    addBuiltin(env, "print", builtin_print, 1);
-    addBuiltin(env, "println", builtin_println, 1);
-    addBuiltin(env, "+", builtin_add, 2);
-    addBuiltin(env, "-", builtin_sub, 2);
-    addBuiltin(env, "*", builtin_mul, 2);
-    addBuiltin(env, "/", builtin_div, 2);
-    addBuiltin(env, "list", builtin_list, -1); /* unlimited number of parameters */
-    addBuiltin(env, "car", builtin_car, 1);
-    addBuiltin(env, "cdr", builtin_cdr, 1);
-    addBuiltin(env, "progn", builtin_progn, -1);
-    addBuiltin(env, "setq", builtin_setq, 2);
-    addBuiltin(env, "defun", builtin_defun, 3);
-    addBuiltin(env, "quote", builtin_quote, 1);
-    addBuiltin(env, "length", builtin_length, 1);
-    addBuiltin(env, "cond", builtin_cond, -1);
-    addBuiltin(env, "if", builtin_if, 3);
-    addBuiltin(env, "eq", builtin_eq, 2);
-    addBuiltin(env, "neq", builtin_neq, 2);
-    addBuiltin(env, "gt", builtin_gt, 2);
-    addBuiltin(env, "gte", builtin_gte, 2);
-    addBuiltin(env, "lt", builtin_lt, 2);
-    addBuiltin(env, "lte", builtin_lte, 2);
-    addBuiltin(env, "typeof", builtin_typeof, 1);
-    addBuiltin(env, "lambda", builtin_lambda, 2);
-    addBuiltin(env, "eval", builtin_eval, 1);
-    addBuiltin(env, "defmacro", builtin_defmacro, 3);
-    addBuiltin(env, "macroexpand", builtin_macroexpand, 1);
-    addBuiltin(env, "cons", builtin_cons, 2);
-    addBuiltin(env, "import", builtin_import, 1);
-    addBuiltin(env, "while", builtin_while, 2);
-
-    addVar(env, intern("null"), nullObj);
-    addVar(env, intern("true"), trueObj);
-    addVar(env, intern("false"), falseObj);
+struct Worker {
+    Interpreter* ip;
+    std::thread thread;
+    std::mutex lock;
+    std::deque<size_t> chunks; // the owner takes from the back, thieves from the front
+};
 
-    addVar(env, intern("NULL"), intern("NULL"));
-    addVar(env, intern("INT"), intern("INT"));
-    addVar(env, intern("FLOAT"), intern("FLOAT"));
-    addVar(env, intern("STRING"), intern("STRING"));
-    addVar(env, intern("SYMBOL"), intern("SYMBOL"));
-    addVar(env, intern("BOOL"), intern("BOOL"));
-    addVar(env, intern("CONS"), intern("CONS"));
-    addVar(env, intern("BUILTIN"), intern("BUILTIN"));
-    addVar(env, intern("FUNCTION"), intern("FUNCTION"));
-    addVar(env, intern("ENV"), intern("ENV"));
-    addVar(env, intern("UNDEFINED"), intern("UNDEFINED"));
+struct ParallelJob {
+    ParallelKind kind;
+    Interpreter* parent;
+    Obj* fn;
+    const std::vector<Obj*>* items; // in the parent's heap
+    size_t chunkSize;
+    std::vector<Obj*> results; // per item for pmap, per chunk for preduce, in the workers' heaps
+    std::atomic<bool> failed;
+    std::string error; // the first worker's error message
+};
+
+struct WorkerPool {
+    std::vector<Worker*> workers;
+    std::mutex lock;
+    std::condition_variable wake; // a job was posted or the pool is stopping
+    std::condition_variable done; // running dropped to 0
+    ParallelJob* job = nullptr;
+    uint64_t generation = 0; // counts posted jobs
+    size_t running = 0; // workers still busy with the job
+    bool stopping = false;
+};
+
+// the next chunk for worker self: its own, or one stolen from another worker
+bool takeChunk(WorkerPool* pool, size_t self, size_t* chunk) {
+    for(size_t k = 0; k < pool->workers.size(); k++) {
+        Worker* w = pool->workers[(self + k) % pool->workers.size()];
+        std::lock_guard<std::mutex> guard(w->lock);
+        if(w->chunks.empty()) continue;
+        if(k == 0) {
+            *chunk = w->chunks.back();
+            w->chunks.pop_back();
+        } else {
+            *chunk = w->chunks.front();
+            w->chunks.pop_front();
+        }
+        return true;
+    }
+    return false;
 }
 
-bool isNotEvalListBuiltin(Builtin builtin) {
-    return builtin == builtin_quote
-        || builtin == builtin_setq
-        || builtin == builtin_defun
-        || builtin == builtin_lambda
-        || builtin == builtin_defmacro
-        || builtin == builtin_cond
-        || builtin == builtin_progn
-        || builtin == builtin_if
-        || builtin == builtin_while;
+// run chunks of job until none are left. held keeps what the worker copied
+// and produced alive until the parent has copied the results
+void runChunks(WorkerPool* pool, size_t self, ParallelJob* job, std::vector<Obj*>& held) {
+    Obj* env = interp->globalEnv;
+    HeapCopy c;
+    c.copies[job->parent->globalEnv] = env;
+    c.followGlobals = true;
+    Obj* fn = heapCopy(&c, job->fn);
+    held.push_back(fn);
+    c.followGlobals = false;
+    size_t chunk;
+    while(!job->failed && takeChunk(pool, self, &chunk)) {
+        size_t begin = chunk * job->chunkSize;
+        size_t end = std::min(begin + job->chunkSize, job->items->size());
+        Obj* acc = nullptr;
+        for(size_t i = begin; i < end; i++) {
+            Obj* item = heapCopy(&c, (*job->items)[i]);
+            held.push_back(item);
+            if(job->kind == PARALLEL_REDUCE) {
+                if(i == begin) {
+                    acc = item;
+                } else {
+                    Obj* args[] = { acc, item };
+                    acc = callFunction(env, fn, 2, args);
+                }
+            } else {
+                Obj* result = callFunction(env, fn, 1, &item);
+                if(job->kind == PARALLEL_MAP) {
+                    job->results[i] = result;
+                    held.push_back(result);
+                }
+            }
+        }
+        if(job->kind == PARALLEL_REDUCE) {
+            job->results[chunk] = acc;
+            held.push_back(acc);
+        }
+    }
 }
 
-Obj* macroexpand(Obj* env, Obj* macro, Obj* args) {
-    Obj* newEnv = pushEnv(env, macro->v_macro.params, args);
-    // return builtin_progn(newEnv, cons(cons(macro->v_macro.body, nullObj), nullObj));
-    return builtin_progn(newEnv, macro->v_macro.body);
+void workerMain(WorkerPool* pool, size_t self) {
+    InterpreterScope scope(pool->workers[self]->ip, __builtin_frame_address(0));
+    interp->globalEnv = makeEnv(nullObj, nullObj, 0);
+    interp->modules = nullObj;
+    vmInit();
+    internWellKnownSymbols();
+    defineBuiltins(interp->globalEnv);
+
+    std::vector<Obj*> held;
+    interp->extraRoots.push_back(&held);
+    uint64_t seen = 0;
+    for(;;) {
+        ParallelJob* job;
+        {
+            std::unique_lock<std::mutex> guard(pool->lock);
+            pool->wake.wait(guard, [&] { return pool->stopping || pool->generation != seen; });
+            if(pool->stopping) break;
+            seen = pool->generation;
+            job = pool->job;
+        }
+        held.clear();
+        Obj** sp = interp->vm.sp;
+        VMFrame* fp = interp->vm.fp;
+        CallRecord* callTop = interp->callTop;
+        size_t extraRoots = interp->extraRoots.size();
+        try {
+            runChunks(pool, self, job, held);
+        } catch(const LispError& e) {
+            interp->vm.sp = sp;
+            interp->vm.fp = fp;
+            interp->callTop = callTop;
+            interp->extraRoots.resize(extraRoots);
+            std::lock_guard<std::mutex> guard(pool->lock);
+            if(!job->failed) job->error = e.message;
+            job->failed = true;
+        }
+        std::lock_guard<std::mutex> guard(pool->lock);
+        if(--pool->running == 0) pool->done.notify_all();
+    }
+    interp->extraRoots.pop_back();
 }
 
-Obj* apply_macro(Obj* env, Obj* macro, Obj* args) {
-    Obj* expanded = macroexpand(env, macro, args);
-    return eval(env, expanded);
+WorkerPool* startWorkers() {
+    WorkerPool* pool = new WorkerPool();
+    size_t count = interp->workerCount ? interp->workerCount : std::max(1u, std::thread::hardware_concurrency());
+    for(size_t i = 0; i < count; i++) {
+        Worker* w = new Worker();
+        w->ip = new Interpreter();
+        w->ip->isWorker = true;
+        w->ip->vmEnabled = interp->vmEnabled;
+        w->ip->optLevel = interp->optLevel;
+        w->ip->recursionLimit = interp->recursionLimit;
+        w->ip->jit.enabled = interp->jit.enabled;
+        w->ip->jit.threshold = interp->jit.threshold;
+        w->ip->jit.log = interp->jit.log;
+        pool->workers.push_back(w);
+    }
+    for(size_t i = 0; i < count; i++) {
+        pool->workers[i]->thread = std::thread(workerMain, pool, i);
+    }
+    return pool;
 }
 
-Obj* apply_function(Obj* env, Obj* fn, Obj* args) {
-    Obj* newEnv = nullptr;
-    Obj* body = nullptr;
-    int64_t argc = list_length(args);
-    throw_error_assert(fn->fn_param_count == -1 || argc == fn->fn_param_count, env, 
-        "%s() takes %" PRId64 " positional arguments but %" PRId64 " were given", 
-        fn->fn_name->v_symbol, fn->fn_param_count, argc);
-    if(fn->type != T_BUILTIN || !isNotEvalListBuiltin(fn->v_builtin.ptr)) {
-        args = eval_list(env, args);
-    }
-    if(fn->type == T_BUILTIN) {
-        return fn->v_builtin.ptr(env, args);
-    } else if(fn->type == T_FUNCTION) {
-        newEnv = pushEnv(env, fn->v_function.params, args);
-        body = fn->v_function.body;
-    } else if(fn->type == T_LAMBDA) {
-        newEnv = pushEnv(fn->v_lambda.env, fn->v_lambda.params, args);
-        body = fn->v_lambda.body;
-    }
-    return builtin_progn(newEnv, body);
-}
-
-Obj* eval_list(Obj* env, Obj* x) {
-    Obj *head, *tail;
-    head = tail = nullptr;
-    for (Obj *lp = x; lp != nullObj; lp = cdr(lp)) {
-        Obj *tmp = eval(env, car(lp));
-        if(head == NULL) {
-            head = tail = cons(tmp, nullObj);
-        } else {
-            tail->v_cons.tail = cons(tmp, nullObj);
-            tail = tail->v_cons.tail;
-        }
+void stopWorkers(Interpreter* ip) {
+    WorkerPool* pool = ip->pool;
+    if(!pool) return;
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        pool->stopping = true;
     }
-    return head == nullptr ? nullObj : head;
+    pool->wake.notify_all();
+    for(Worker* w : pool->workers) {
+        w->thread.join();
+        interpreterDestroy(w->ip);
+        delete w;
+    }
+    delete pool;
+    ip->pool = nullptr;
 }
 
-Obj* eval(Obj* env, Obj* x) {
-    if(!x) return nullObj;
-    switch(x->type) {
-    case T_NULL:
-        return nullObj;
-    case T_INT:
-    case T_FLOAT:
-    case T_STRING:
-        return x;
-    case T_SYMBOL: {
-            Obj* obj = findVar(env, x);
-            if(obj == nullptr || obj == nullObj) {
-                throw_error(env, "can't find symbol: %s", x->v_symbol);
+// fn over items: results gets one value per item for pmap, or for preduce
+// the fold of each chunk, left to right. results must be a root
+void parallelRun(Obj* env, ParallelKind kind, Obj* fn, const std::vector<Obj*>& items, std::vector<Obj*>* results) {
+    if(items.empty()) return;
+    if(interp->isWorker) {
+        // called from a worker: run in place rather than wait on the pool
+        for(size_t i = 0; i < items.size(); i++) {
+            if(kind != PARALLEL_REDUCE) {
+                Obj* item = items[i];
+                Obj* result = callFunction(env, fn, 1, &item);
+                if(kind == PARALLEL_MAP) results->push_back(result);
+            } else if(i == 0) {
+                results->push_back(items[0]);
+            } else {
+                Obj* args[] = { results->back(), items[i] };
+                Obj* acc = callFunction(env, fn, 2, args);
+                results->back() = acc;
             }
-            return cdr(obj);
         }
-    case T_CONS: {
-        Obj* obj = eval(env, car(x));
-        Obj* args = cdr(x);
-        if(obj->type == T_BUILTIN || obj->type == T_FUNCTION || obj->type == T_LAMBDA) {
-            return apply_function(env, obj, args);
-        } else if(obj->type == T_MACRO) {
-            return apply_macro(env, obj, args);
-        } else {
-            char objstr[512] = { 0 };
-            objToStr(obj, objstr);
-            throw_error(env, "can't call type: %s(%s)", typeToString(obj->type).c_str(), objstr);
+        return;
+    }
+    if(!interp->pool) interp->pool = startWorkers();
+    WorkerPool* pool = interp->pool;
+    size_t workers = pool->workers.size();
+    size_t chunkCount = std::min(items.size(), workers * PARALLEL_CHUNKS_PER_WORKER);
+
+    ParallelJob job;
+    job.kind = kind;
+    job.parent = interp;
+    job.fn = fn;
+    job.items = &items;
+    job.chunkSize = (items.size() + chunkCount - 1) / chunkCount;
+    chunkCount = (items.size() + job.chunkSize - 1) / job.chunkSize;
+    job.results.assign(kind == PARALLEL_REDUCE ? chunkCount : kind == PARALLEL_MAP ? items.size() : 0, nullptr);
+    job.failed = false;
+    for(size_t k = 0; k < workers; k++) {
+        Worker* w = pool->workers[k];
+        std::lock_guard<std::mutex> guard(w->lock);
+        for(size_t i = k * chunkCount / workers; i < (k + 1) * chunkCount / workers; i++) {
+            w->chunks.push_back(i);
         }
     }
-    default: break;
+    {
+        std::unique_lock<std::mutex> guard(pool->lock);
+        pool->job = &job;
+        pool->running = workers;
+        pool->generation++;
+        pool->wake.notify_all();
+        pool->done.wait(guard, [&] { return pool->running == 0; });
+        pool->job = nullptr;
+    }
+    if(job.failed) {
+        for(Worker* w : pool->workers) {
+            std::lock_guard<std::mutex> guard(w->lock);
+            w->chunks.clear(); // left over when the failure stopped the others
+        }
+        throw_error(env, "%s", job.error.c_str());
+    }
+
+    // the workers are idle until the next job, so their heaps hold still
+    HeapCopy c;
+    c.followGlobals = false;
+    for(Worker* w : pool->workers) {
+        c.copies[w->ip->globalEnv] = interp->globalEnv;
+    }
+    for(Obj* result : job.results) {
+        results->push_back(heapCopy(&c, result));
     }
-    return x;
 }
 
-std::string readTextFile(const std::string& filename) {
-    std::ifstream ifs(filename);
-    std::stringstream ss;
-    ss << ifs.rdbuf();
-    ifs.close();
-    return ss.str();
+Obj* checkParallelFn(Obj* env, const char* name, Obj* fn) {
+    ObjType type = typeOf(fn);
+    if(type != T_FUNCTION && type != T_LAMBDA && (type != T_BUILTIN || fn->v_builtin.form))
+        throw_error(env, "TypeError: %s() argument must be a function, not '%s'", name, typeToString(type).c_str());
+    return fn;
 }
 
-void init() {
-    nullObj = makeObj(T_NULL);
-    trueObj = makeObj(T_BOOL); trueObj->v_bool = true;
-    falseObj = makeObj(T_BOOL); falseObj->v_bool = false;
-    globalEnv = makeEnv(nullObj, nullObj);
-    symbols = nullObj;
-    modules = nullObj;
-    defineBuiltins(globalEnv);
-    loadModule(globalEnv, "./lib.lisp");
+// the items of a list or vector
+std::vector<Obj*> parallelItems(Obj* env, const char* name, Obj* seq) {
+    if(typeOf(seq) == T_VECTOR) {
+        return std::vector<Obj*>(seq->v_vector.items, seq->v_vector.items + seq->v_vector.size);
+    }
+    throw_error_assert(is_list(seq), env, "TypeError: %s() argument must be a list or vector, not '%s'",
+        name, typeToString(typeOf(seq)).c_str());
+    std::vector<Obj*> items;
+    for(Obj* p = seq; p != nullObj; p = cdr(p)) {
+        items.push_back(car(p));
+    }
+    return items;
 }
 
-void repl() {
-    std::string input;
-    for(;;) {
-        std::cout << ">>> ";
-        std::getline(std::cin, input, '\n');
-        if(std::cin.eof()) break;
-        run_before(input);
-        print(run(globalEnv));
-        std::cout << std::endl;
+// (pmap fn seq) => the results of fn on each item, in order, as a list or
+// a vector like seq
+Obj* builtin_pmap(Obj* env, int64_t argc, Obj** argv) {
+    Obj* fn = checkParallelFn(env, "pmap", argv[0]);
+    Obj* seq = argv[1];
+    std::vector<Obj*> items = parallelItems(env, "pmap", seq);
+    std::vector<Obj*> results;
+    interp->extraRoots.push_back(&results);
+    parallelRun(env, PARALLEL_MAP, fn, items, &results);
+    Obj* mapped;
+    if(typeOf(seq) == T_VECTOR) {
+        mapped = makeVector(results.size(), nullObj);
+        std::copy(results.begin(), results.end(), mapped->v_vector.items);
+    } else {
+        mapped = makeList(results);
+    }
+    interp->extraRoots.pop_back();
+    return mapped;
+}
+
+// (pfor-each fn seq) => null, after calling fn on every item
+Obj* builtin_pfor_each(Obj* env, int64_t argc, Obj** argv) {
+    Obj* fn = checkParallelFn(env, "pfor-each", argv[0]);
+    std::vector<Obj*> items = parallelItems(env, "pfor-each", argv[1]);
+    std::vector<Obj*> results;
+    parallelRun(env, PARALLEL_FOR_EACH, fn, items, &results);
+    return nullObj;
+}
+
+// (preduce fn init seq) => (fn (fn (fn init a) b) c) for seq (a b c). chunks
+// are folded separately and then combined, so fn must be associative
+Obj* builtin_preduce(Obj* env, int64_t argc, Obj** argv) {
+    Obj* fn = checkParallelFn(env, "preduce", argv[0]);
+    std::vector<Obj*> items = parallelItems(env, "preduce", argv[2]);
+    std::vector<Obj*> results;
+    interp->extraRoots.push_back(&results);
+    parallelRun(env, PARALLEL_REDUCE, fn, items, &results);
+    Obj* acc = argv[1];
+    for(Obj* partial : results) {
+        Obj* args[] = { acc, partial };
+        acc = callFunction(env, fn, 2, args);
+    }
+    interp->extraRoots.pop_back();
+    return acc;
+}
+
+Interpreter* interpreterCreate(const char* imagePath) {
+    Interpreter* ip = new Interpreter();
+    try {
+        InterpreterScope scope(ip, __builtin_frame_address(0));
+        init(imagePath);
+    } catch(const LispError& e) {
+        ::fprintf(stderr, "%s%s\n", e.traceback.c_str(), e.message.c_str());
+        interpreterDestroy(ip);
+        return nullptr;
+    }
+    return ip;
+}
+
+bool interpreterEval(Interpreter* ip, const std::string& source, std::string* result) {
+    InterpreterScope scope(ip, __builtin_frame_address(0));
+    Obj** sp = ip->vm.sp;
+    VMFrame* fp = ip->vm.fp;
+    CallRecord* callTop = ip->callTop;
+    size_t extraRoots = ip->extraRoots.size();
+    try {
+        Parser parser(source);
+        *result = toString(run(ip->globalEnv, &parser));
+        return true;
+    } catch(const LispError& e) {
+        // unwind whatever the failed evaluation left on the interpreter's stacks
+        ip->vm.sp = sp;
+        ip->vm.fp = fp;
+        ip->callTop = callTop;
+        ip->extraRoots.resize(extraRoots);
+        *result = e.traceback + e.message;
+        return false;
+    }
+}
+
+void interpreterDestroy(Interpreter* ip) {
+    stopWorkers(ip);
+    for(GreenThread* t : ip->scheduler.threads) {
+        delete t;
+    }
+    {
+        InterpreterScope scope(ip, __builtin_frame_address(0));
+        freeHeap();
+        ::free(ip->vm.stack);
+        ::free(ip->vm.frames);
     }
+    for(auto& chunk : ip->jit.chunks) {
+        ::munmap(chunk.first, chunk.second);
+    }
+    delete ip;
 }
 
+#ifndef TOYLISP_NO_MAIN
 int main(int argc, char** argv) {
+    interp = new Interpreter();
+    interp->gcStackBottom = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+    interp->nativeStackLimit = nativeStackSize();
 
-    init();
+    const char* filename = nullptr;
+    bool showGCStats = false;
+    bool showStats = false;
+    const char* profilePath = nullptr;
+    const char* imagePath = nullptr;
+    const char* saveImagePath = nullptr;
+    for(int i = 1; i < argc; i++) {
+        if(!::strncmp(argv[i], "--heap-max=", 11)) {
+            interp->heapLimit = parseSize(argv[i] + 11);
+        } else if(!::strcmp(argv[i], "--gc-stats")) {
+            showGCStats = true;
+        } else if(!::strcmp(argv[i], "--stats")) {
+            showStats = true;
+        } else if(!::strcmp(argv[i], "--profile")) {
+            profilePath = "profile.folded";
+        } else if(!::strncmp(argv[i], "--profile=", 10)) {
+            profilePath = argv[i] + 10;
+        } else if(!::strncmp(argv[i], "--image=", 8)) {
+            imagePath = argv[i] + 8;
+        } else if(!::strncmp(argv[i], "--save-image=", 13)) {
+            saveImagePath = argv[i] + 13;
+        } else if(!::strcmp(argv[i], "--eval=tree")) {
+            interp->vmEnabled = false;
+        } else if(!::strcmp(argv[i], "--eval=vm")) {
+            interp->vmEnabled = true;
+        } else if(!::strcmp(argv[i], "--jit=off")) {
+            interp->jit.enabled = false;
+        } else if(!::strcmp(argv[i], "--jit=on")) {
+            interp->jit.enabled = JIT_SUPPORTED;
+        } else if(!::strncmp(argv[i], "--jit=threshold=", 16)) {
+            interp->jit.enabled = JIT_SUPPORTED;
+            interp->jit.threshold = std::min<int64_t>(UINT32_MAX, std::max<int64_t>(1, ::strtoll(argv[i] + 16, nullptr, 10)));
+        } else if(!::strcmp(argv[i], "--jit-log")) {
+            interp->jit.log = true;
+        } else if(!::strncmp(argv[i], "--workers=", 10)) {
+            interp->workerCount = std::max<int64_t>(1, ::strtoll(argv[i] + 10, nullptr, 10));
+        } else if(!::strcmp(argv[i], "-O0") || !::strcmp(argv[i], "-O1") || !::strcmp(argv[i], "-O2")) {
+            interp->optLevel = argv[i][2] - '0';
+        } else if(!::strncmp(argv[i], "--max-depth=", 12)) {
+            interp->recursionLimit = std::max<int64_t>(1, ::strtoll(argv[i] + 12, nullptr, 10));
+        } else {
+            filename = argv[i];
+        }
+    }
 
-    if(argc > 1) {
-        run_before(readTextFile(std::string(argv[1])));
-        run(globalEnv);
+    init(imagePath);
+    if(profilePath) {
+        startProfile();
+    }
+
+    if(filename) {
+        FILE* file = ::fopen(filename, "rb");
+        if(!file) {
+            ::fprintf(stderr, "can't open file: %s\n", filename);
+            return -1;
+        }
+        Parser parser(filename, file);
+        run(interp->globalEnv, &parser);
     } else {
         repl();
     }
 
+    stopWorkers(interp);
+    if(profilePath) {
+        stopProfile(profilePath);
+    }
+    if(saveImagePath) {
+        saveImage(saveImagePath);
+    }
+    if(showGCStats) {
+        printGCStats();
+    }
+    if(showStats) {
+        printRuntimeStats();
+    }
+
     return 0;
 }
+#endif
@@ -0,0 +1,23 @@
+#ifndef TOYLISP_H
+#define TOYLISP_H
+
+// embedding api. build main.cpp with -DTOYLISP_NO_MAIN and link it into the
+// host program. interpreters share nothing, so each thread may run its own;
+// a single interpreter must not be used by two threads at once
+
+#include <string>
+
+struct Interpreter;
+
+// a fresh interpreter with the builtins and ./lib.lisp, or the one saved in
+// imagePath by --save-image. nullptr if that fails, with the error on stderr
+Interpreter* interpreterCreate(const char* imagePath = nullptr);
+
+// evaluates every form of source. true with the printed value of the last
+// form in result, or false with the traceback and error message
+bool interpreterEval(Interpreter* interpreter, const std::string& source, std::string* result);
+
+// frees the interpreter and its heap
+void interpreterDestroy(Interpreter* interpreter);
+
+#endif